@@ -34,7 +34,18 @@ int csync_ignore_uid = 0;
 int csync_ignore_gid = 0;
 int csync_ignore_mod = 0;
 unsigned csync_lock_timeout = 12;
+unsigned csync_parallel_peers = 1;
+unsigned csync_parallel_connections = 1;
+int csync_kernel_tls = 0;
 char *csync_tempdir = NULL;
+char *csync_sigcache_dir = NULL;
+unsigned csync_sigcache_size = 64;
+int csync_sigcache_prewarm = 0;
+unsigned csync_rsync_max_block_size = 131072;
+long long csync_whole_file_threshold = 65536;
+long long csync_bundle_threshold = 4096;
+unsigned csync_rsync_segment_size = 256;
+int csync_rsync_threads = 0;
 
 #ifdef __CYGWIN__
 int csync_lowercyg_disable = 0;
@@ -217,6 +228,17 @@ static void set_bak_gen(char *gen)
 	free(gen);
 }
 
+static void add_file_pattern(struct csync_group_action_pattern **list,
+		const char *pattern)
+{
+	struct csync_group_action_pattern *t =
+		calloc(sizeof(struct csync_group_action_pattern), 1);
+	t->star_matches_slashes = !!strstr(pattern, "**");
+	t->pattern = pattern;
+	t->next = *list;
+	*list = t;
+}
+
 static void check_group()
 {
 	if ( ! csync_group->key )
@@ -332,11 +354,68 @@ static void set_lock_timeout(const char *timeout)
 	csync_lock_timeout = atoi(timeout);
 }
 
+static void set_parallel_peers(const char *count)
+{
+	csync_parallel_peers = atoi(count);
+	if (csync_parallel_peers < 1)
+		csync_parallel_peers = 1;
+}
+
+static void set_parallel_connections(const char *count)
+{
+	csync_parallel_connections = atoi(count);
+	if (csync_parallel_connections < 1)
+		csync_parallel_connections = 1;
+}
+
 static void set_tempdir(const char *tempdir)
 {
 	csync_tempdir = strdup(tempdir);
 }
 
+static void set_sigcache_dir(const char *dir)
+{
+	if (dir[0] != '/')
+		csync_fatal("Config error: sigcache-directory '%s' is not an absolute path.\n", dir);
+	csync_sigcache_dir = strdup(dir);
+}
+
+static void set_rsync_max_block_size(const char *bytes)
+{
+	csync_rsync_max_block_size = atoi(bytes);
+}
+
+static void set_whole_file_threshold(const char *bytes)
+{
+	csync_whole_file_threshold = atoll(bytes);
+}
+
+static void set_bundle_threshold(const char *bytes)
+{
+	csync_bundle_threshold = atoll(bytes);
+	if (csync_bundle_threshold > CSYNC_BUNDLE_MAX_FILE_SIZE)
+		csync_bundle_threshold = CSYNC_BUNDLE_MAX_FILE_SIZE;
+}
+
+static void set_rsync_segment_size(const char *megabytes)
+{
+	csync_rsync_segment_size = atoi(megabytes);
+	if (csync_rsync_segment_size < 1)
+		csync_rsync_segment_size = 1;
+}
+
+static void set_rsync_threads(const char *threads)
+{
+	csync_rsync_threads = atoi(threads);
+}
+
+static void set_sigcache_size(const char *megabytes)
+{
+	csync_sigcache_size = atoi(megabytes);
+	if (csync_sigcache_size < 1)
+		csync_sigcache_size = 1;
+}
+
 static void set_database(const char *filename)
 {
 	if (!csync_database)
@@ -434,9 +513,18 @@ static void disable_cygwin_lowercase_hack()
 %token TK_NOSSL TK_IGNORE TK_GROUP TK_HOST TK_EXCL TK_INCL TK_COMP TK_KEY TK_DATABASE
 %token TK_ACTION TK_PATTERN TK_EXEC TK_DOLOCAL TK_LOGFILE TK_NOCYGLOWER
 %token TK_PREFIX TK_ON TK_COLON TK_POPEN TK_PCLOSE
-%token TK_BAK_DIR TK_BAK_GEN TK_DOLOCALONLY
+%token TK_BAK_DIR TK_BAK_GEN TK_DOLOCALONLY TK_APPEND_ONLY TK_INPLACE TK_DEDUP
 %token TK_TEMPDIR
 %token TK_LOCK_TIMEOUT
+%token TK_PARALLEL_PEERS
+%token TK_PARALLEL_CONNECTIONS
+%token TK_KERNEL_TLS
+%token TK_SIGCACHE_DIR TK_SIGCACHE_SIZE TK_SIGCACHE_PREWARM
+%token TK_RSYNC_MAX_BLOCK_SIZE
+%token TK_WHOLE_FILE_THRESHOLD
+%token TK_BUNDLE_THRESHOLD
+%token TK_RSYNC_SEGMENT_SIZE
+%token TK_RSYNC_THREADS
 %token <txt> TK_STRING
 
 %%
@@ -463,6 +551,28 @@ block:
 		{ disable_cygwin_lowercase_hack(); }
 |	TK_LOCK_TIMEOUT TK_STRING TK_STEND
 		{ set_lock_timeout($2); }
+|	TK_PARALLEL_PEERS TK_STRING TK_STEND
+		{ set_parallel_peers($2); }
+|	TK_PARALLEL_CONNECTIONS TK_STRING TK_STEND
+		{ set_parallel_connections($2); }
+|	TK_KERNEL_TLS TK_STEND
+		{ csync_kernel_tls = 1; }
+|	TK_SIGCACHE_DIR TK_STRING TK_STEND
+		{ set_sigcache_dir($2); }
+|	TK_SIGCACHE_SIZE TK_STRING TK_STEND
+		{ set_sigcache_size($2); }
+|	TK_SIGCACHE_PREWARM TK_STEND
+		{ csync_sigcache_prewarm = 1; }
+|	TK_RSYNC_MAX_BLOCK_SIZE TK_STRING TK_STEND
+		{ set_rsync_max_block_size($2); }
+|	TK_WHOLE_FILE_THRESHOLD TK_STRING TK_STEND
+		{ set_whole_file_threshold($2); }
+|	TK_BUNDLE_THRESHOLD TK_STRING TK_STEND
+		{ set_bundle_threshold($2); }
+|	TK_RSYNC_SEGMENT_SIZE TK_STRING TK_STEND
+		{ set_rsync_segment_size($2); }
+|	TK_RSYNC_THREADS TK_STRING TK_STEND
+		{ set_rsync_threads($2); }
 ;
 
 ignore_list:
@@ -508,6 +618,9 @@ stmt:
 		{ set_bak_dir($2); }
 |	TK_BAK_GEN TK_STRING
 		{ set_bak_gen($2); }
+|	TK_APPEND_ONLY append_list
+|	TK_INPLACE inplace_list
+|	TK_DEDUP dedup_list
 ;
 
 host_list:
@@ -545,6 +658,24 @@ comp_list:
 		{ add_patt(2, on_cygwin_lowercase($2)); }
 ;
 
+append_list:
+	/* empty */
+|	append_list TK_STRING
+		{ add_file_pattern(&csync_group->append_only, on_cygwin_lowercase($2)); }
+;
+
+inplace_list:
+	/* empty */
+|	inplace_list TK_STRING
+		{ add_file_pattern(&csync_group->inplace, on_cygwin_lowercase($2)); }
+;
+
+dedup_list:
+	/* empty */
+|	dedup_list TK_STRING
+		{ add_file_pattern(&csync_group->dedup, on_cygwin_lowercase($2)); }
+;
+
 action:
 	TK_ACTION
 		{ new_action(); }
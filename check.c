@@ -211,6 +211,110 @@ int csync_check_pure(const char *filename)
 	}
 }
 
+/*
+ * Regular files which vanished in this check, with their checktxt. A new
+ * file with the same checktxt (size, mtime, mode and owner) has most likely
+ * been moved there; this is recorded in the move table, so the update can
+ * ask the peer to rename its copy (see csync_update_moves()).
+ */
+static struct textlist *vanished;
+
+/* vanished, sorted by checktxt; rebuilt when vanished grows */
+static struct textlist **vanished_index;
+static int vanished_count;
+
+static int vanished_cmp(const void *a, const void *b)
+{
+	const struct textlist *x = *(struct textlist **)a;
+	const struct textlist *y = *(struct textlist **)b;
+	return strcmp(x->value2, y->value2);
+}
+
+static void csync_check_move(const char *file, const char *checktxt)
+{
+	struct textlist *t;
+	int lo, hi, mid;
+
+	if (!vanished_index) {
+		vanished_count = 0;
+		for (t = vanished; t != 0; t = t->next)
+			vanished_count++;
+		vanished_index = malloc(vanished_count * sizeof(*vanished_index));
+		vanished_count = 0;
+		for (t = vanished; t != 0; t = t->next)
+			vanished_index[vanished_count++] = t;
+		qsort(vanished_index, vanished_count, sizeof(*vanished_index), vanished_cmp);
+	}
+
+	/* the first one with this checktxt */
+	lo = 0;
+	hi = vanished_count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strcmp(vanished_index[mid]->value2, checktxt) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* the old file can not have been moved twice */
+	for (; lo < vanished_count; lo++) {
+		t = vanished_index[lo];
+		if ( !csync_cmpchecktxt(checktxt, t->value2) )
+			break;
+		if ( t->intvalue )
+			continue;
+		t->intvalue = 1;
+		csync_debug(2, "File has been moved: %s -> %s\n", t->value, file);
+		SQL("Adding move entry",
+		    "INSERT INTO move (filename, oldname) VALUES ('%s', '%s')",
+		    url_encode(file), url_encode(t->value));
+		return;
+	}
+}
+
+/*
+ * Regular files with more than one name are recorded in the hardlink table
+ * with their device and inode number, so the update can tell the peer to
+ * link a name to another one it has already (see hardlink_source()).
+ * Entries may be stale; they are checked with lstat() when used.
+ */
+static void csync_check_hardlink(const char *file, const struct stat *st, int changed)
+{
+	char inode[64];
+	int known = 0;
+
+	if (st->st_nlink < 2) {
+		if (changed)
+			SQL("Removing hardlink entry (if any)",
+			    "DELETE FROM hardlink WHERE filename = '%s'",
+			    url_encode(file));
+		return;
+	}
+
+	snprintf(inode, sizeof(inode), "%llx-%llx",
+			(unsigned long long)st->st_dev,
+			(unsigned long long)st->st_ino);
+
+	/* the other name may be new, while this one is unchanged */
+	SQL_BEGIN("Checking hardlink entry",
+		"SELECT inode FROM hardlink WHERE filename = '%s'",
+		url_encode(file))
+	{
+		known = !strcmp(SQL_V(0), inode);
+	} SQL_END;
+	if (known)
+		return;
+
+	csync_debug(2, "File has %d names: %s\n", (int)st->st_nlink, file);
+	SQL("Deleting old hardlink entry",
+	    "DELETE FROM hardlink WHERE filename = '%s'",
+	    url_encode(file));
+	SQL("Adding hardlink entry",
+	    "INSERT INTO hardlink (filename, inode) VALUES ('%s', '%s')",
+	    url_encode(file), inode);
+}
+
 void csync_check_del(const char *file, int recursive, int init_run)
 {
 	char *where_rec = "";
@@ -221,13 +325,13 @@ void csync_check_del(const char *file, int recursive, int init_run)
 		if ( !strcmp(file, "/") )
 		  ASPRINTF(&where_rec, "OR 1=1");
 		else
-		  ASPRINTF(&where_rec, "UNION ALL SELECT filename from file where filename > '%s/' "
+		  ASPRINTF(&where_rec, "UNION ALL SELECT filename, checktxt from file where filename > '%s/' "
 				"and filename < '%s0'",
 				url_encode(file), url_encode(file));
 	}
 
 	SQL_BEGIN("Checking for removed files",
-			"SELECT filename from file where "
+			"SELECT filename, checktxt from file where "
 			"filename = '%s' %s ORDER BY filename", url_encode(file), where_rec)
 	{
 		const char *filename = url_decode(SQL_V(0));
@@ -236,14 +340,32 @@ void csync_check_del(const char *file, int recursive, int init_run)
 			continue;
 
 		if ( lstat_strict(prefixsubst(filename), &st) != 0 || csync_check_pure(filename) )
-			textlist_add(&tl, filename, 0);
+			textlist_add2(&tl, filename, url_decode(SQL_V(1)), 0);
 	} SQL_END;
 
 	for (t = tl; t != 0; t = t->next) {
-		if (!init_run) csync_mark(t->value, 0, 0);
+		if (!init_run) {
+			csync_mark(t->value, 0, 0);
+			/* empty files are not worth it */
+			if ( strstr(t->value2, ":type=reg:") &&
+			     !strstr(t->value2, ":size=0") ) {
+				textlist_add2(&vanished, t->value, t->value2, 0);
+				free(vanished_index);
+				vanished_index = 0;
+			}
+		}
 		SQL("Removing file from DB. It isn't with us anymore.",
 		    "DELETE FROM file WHERE filename = '%s'",
 		    url_encode(t->value));
+		SQL("Removing move entry (if any)",
+		    "DELETE FROM move WHERE filename = '%s'",
+		    url_encode(t->value));
+		SQL("Removing hardlink entry (if any)",
+		    "DELETE FROM hardlink WHERE filename = '%s'",
+		    url_encode(t->value));
+		SQL("Removing chunk entries (if any)",
+		    "DELETE FROM chunk WHERE filename = '%s'",
+		    url_encode(t->value));
 	}
 
 	textlist_free(tl);
@@ -257,7 +379,7 @@ int csync_check_mod(const char *file, int recursive, int ignnoent, int init_run)
 	int check_type = csync_match_file(file);
 	int dirdump_this = 0, dirdump_parent = 0;
 	struct dirent **namelist;
-	int n, this_is_dirty = 0;
+	int n, this_is_dirty = 0, is_new = 0;
 	const char *checktxt;
 	struct stat st;
 
@@ -314,7 +436,7 @@ int csync_check_mod(const char *file, int recursive, int ignnoent, int init_run)
 		} SQL_FIN {
 			if ( SQL_COUNT == 0 ) {
 				csync_debug(2, "New file: %s\n", file);
-				this_is_dirty = 1;
+				this_is_dirty = is_new = 1;
 			}
 		} SQL_END;
 
@@ -327,8 +449,19 @@ int csync_check_mod(const char *file, int recursive, int ignnoent, int init_run)
 			    "INSERT INTO file (filename, checktxt) "
 			    "VALUES ('%s', '%s')",
 			    url_encode(file), url_encode(checktxt));
+			SQL("Removing move entry (if any)",
+			    "DELETE FROM move WHERE filename = '%s'",
+			    url_encode(file));
+			if (is_new && vanished && S_ISREG(st.st_mode))
+				csync_check_move(file, checktxt);
 			if (!init_run) csync_mark(file, 0, 0);
+			if (!init_run && S_ISREG(st.st_mode))
+				csync_rs_sigcache_prewarm(file);
+			if (csync_dedup(file))
+				csync_cdc_index(file);
 		}
+		if ( S_ISREG(st.st_mode) && !csync_compare_mode )
+			csync_check_hardlink(file, &st, this_is_dirty);
 		dirdump_this = 1;
 		dirdump_parent = 1;
 		/* fall thru */
@@ -416,5 +549,10 @@ void csync_check(const char *filename, int recursive, int init_run)
 			}
 			p = p->next;
 		}
+
+	free(vanished_index);
+	vanished_index = 0;
+	textlist_free(vanished);
+	vanished = 0;
 }
 
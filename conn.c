@@ -29,21 +29,69 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #ifdef HAVE_LIBGNUTLS
 #  include <gnutls/gnutls.h>
 #  include <gnutls/x509.h>
+#  if defined(HAVE_LINUX_TLS_H) && GNUTLS_VERSION_NUMBER >= 0x030603
+#    define WITH_KTLS 1
+#    include <linux/tls.h>
+#    ifndef SOL_TLS
+#      define SOL_TLS 282
+#    endif
+#    ifndef TCP_ULP
+#      define TCP_ULP 31
+#    endif
+#  endif
 #endif
 
 int conn_fd_in  = -1;
 int conn_fd_out = -1;
 int conn_clisok = 0;
 
+/* protocol features both sides agreed on with the FEATURES command */
+unsigned csync_conn_features = 0;
+
+static const char *feature_names[] = {
+	[CSYNC_FEATURE_RAW_BIT] = "raw",
+	[CSYNC_FEATURE_STREAM_BIT] = "stream",
+	[CSYNC_FEATURE_DIGEST_BIT] = "digest",
+	[CSYNC_FEATURE_BLOCKSIZE_BIT] = "blocksize",
+	[CSYNC_FEATURE_BLAKE2_BIT] = "blake2",
+	[CSYNC_FEATURE_PUT_BIT] = "put",
+	[CSYNC_FEATURE_SEGMENTS_BIT] = "segments",
+	[CSYNC_FEATURE_SIGLIST_BIT] = "siglist",
+	[CSYNC_FEATURE_SIZE_BIT] = "size",
+	[CSYNC_FEATURE_SPARSE_BIT] = "sparse",
+	[CSYNC_FEATURE_APPEND_BIT] = "append",
+	[CSYNC_FEATURE_INPLACE_BIT] = "inplace",
+	[CSYNC_FEATURE_RENAME_BIT] = "rename",
+	[CSYNC_FEATURE_LINK_BIT] = "link",
+	[CSYNC_FEATURE_BASIS_BIT] = "basis",
+	[CSYNC_FEATURE_CHUNKS_BIT] = "chunks",
+	[CSYNC_FEATURE_ATTRS_BIT] = "attrs",
+	[CSYNC_FEATURE_BUNDLE_BIT] = "bundle",
+	[CSYNC_FEATURE_MANIFEST_BIT] = "manifest",
+};
+
 #ifdef HAVE_LIBGNUTLS
 int csync_conn_usessl = 0;
 
 static gnutls_session_t conn_tls_session;
 static gnutls_certificate_credentials_t conn_x509_cred;
+
+/* set once the kernel encrypts what we write to conn_fd_out */
+static int conn_ktls_tx = 0;
+
+/* credentials are loaded once per process, for one role */
+static int conn_x509_cred_role = -1;
+static char *conn_peername = NULL;
 #endif
 
 static const char *__response[] = {
@@ -54,6 +102,10 @@ static const char *__response[] = {
 	[CR_OK_PATH_NOT_FOUND] = "OK (path_not_found).",
 	[CR_OK_CU_LATER] = "OK (cu_later).",
 	[CR_OK_ACTIVATING_SSL] = "OK (activating_ssl).",
+	[CR_OK_NOT_APPENDED] = "OK (not_appended).",
+	[CR_OK_SEND_DATA_INPLACE] = "OK (send_data_inplace).",
+	[CR_OK_NOT_RENAMED] = "OK (not_renamed).",
+	[CR_OK_NOT_LINKED] = "OK (not_linked).",
 
 	/* CR_ERROR: all sorts of strings; often strerror(errno) */
 
@@ -224,6 +276,11 @@ int conn_open(const char *peername)
 {
 	int on = 1;
 
+#ifdef HAVE_LIBGNUTLS
+	free(conn_peername);
+	conn_peername = strdup(peername);
+#endif
+
         conn_fd_in = conn_connect(peername);
         if (conn_fd_in < 0) {
                 csync_debug(1, "Can't create socket: %s\n", strerror(errno));
@@ -238,6 +295,7 @@ int conn_open(const char *peername)
 
 	conn_fd_out = conn_fd_in;
 	conn_clisok = 1;
+	csync_conn_features = 0;
 #ifdef HAVE_LIBGNUTLS
 	csync_conn_usessl = 0;
 #endif
@@ -251,8 +309,11 @@ int conn_set(int infd, int outfd)
 	conn_fd_in  = infd;
 	conn_fd_out = outfd;
 	conn_clisok = 1;
+	csync_conn_features = 0;
 #ifdef HAVE_LIBGNUTLS
 	csync_conn_usessl = 0;
+	free(conn_peername);
+	conn_peername = NULL;
 #endif
 
 	// when running in server mode, this has been done already
@@ -270,24 +331,170 @@ int conn_set(int infd, int outfd)
 static void ssl_log(int level, const char* msg)
 { csync_debug(level, "%s", msg); }
 
-int conn_activate_ssl(int server_role)
+/*
+ * TLS session resumption.
+ *
+ * Clients keep the session data of the last connection to each peer in
+ * DBDIR, and try to resume that session on the next connect. Servers
+ * hand out session tickets, encrypted with a key that is shared by all
+ * server processes through a file in DBDIR, and rotated once a day.
+ *
+ * The server does the handshake before it has read the config file, so
+ * there is no config statement for this location.
+ *
+ * All of this is best effort: if anything goes wrong here, we just do
+ * a full handshake.
+ */
+#define SSL_TICKET_KEY_MAX_AGE (24*60*60)
+
+static char *conn_ssl_cache_file(const char *peername)
+{
+	char *filename;
+	if (peername)
+		ASPRINTF(&filename, "%s/csync2_ssl_session_%s_%s", DBDIR, myhostname, peername);
+	else
+		ASPRINTF(&filename, "%s/csync2_ssl_ticket_key", DBDIR);
+	return filename;
+}
+
+static int conn_read_cache_file(const char *filename, gnutls_datum_t *data, time_t max_age)
+{
+	struct stat st;
+	int fd, rc;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > 64*1024 ||
+	    (max_age && st.st_mtime + max_age < time(NULL))) {
+		close(fd);
+		return -1;
+	}
+
+	data->size = st.st_size;
+	data->data = gnutls_malloc(data->size);
+	rc = data->data ? read(fd, data->data, data->size) : -1;
+	close(fd);
+
+	if (rc != data->size) {
+		gnutls_free(data->data);
+		data->data = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int conn_write_cache_file(const char *filename, const gnutls_datum_t *data)
+{
+	char *tmpname;
+	int fd, rc = -1;
+
+	/* mkstemp creates the file with mode 0600 */
+	ASPRINTF(&tmpname, "%s.XXXXXX", filename);
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		csync_debug(2, "SSL: can't create %s: %s\n", tmpname, strerror(errno));
+		free(tmpname);
+		return -1;
+	}
+
+	if (write(fd, data->data, data->size) == data->size && close(fd) == 0) {
+		fd = -1;
+		rc = rename(tmpname, filename);
+	}
+	if (rc < 0) {
+		csync_debug(2, "SSL: can't write %s: %s\n", filename, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		unlink(tmpname);
+	}
+	free(tmpname);
+	return rc;
+}
+
+static void conn_ssl_load_session()
+{
+	gnutls_datum_t data;
+	char *filename;
+
+	if (!conn_peername)
+		return;
+
+	filename = conn_ssl_cache_file(conn_peername);
+	if (!conn_read_cache_file(filename, &data, 0)) {
+		if (gnutls_session_set_data(conn_tls_session, data.data, data.size) != GNUTLS_E_SUCCESS)
+			csync_debug(2, "SSL: ignoring stale session data %s.\n", filename);
+		gnutls_free(data.data);
+	}
+	free(filename);
+}
+
+static void conn_ssl_save_session()
+{
+	gnutls_datum_t data;
+	char *filename;
+
+	if (!conn_peername)
+		return;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	/* with TLS 1.3, there is nothing to resume without a ticket */
+	if (gnutls_protocol_get_version(conn_tls_session) == GNUTLS_TLS1_3 &&
+	    !(gnutls_session_get_flags(conn_tls_session) & GNUTLS_SFLAGS_SESSION_TICKET))
+		return;
+#endif
+
+	if (gnutls_session_get_data2(conn_tls_session, &data) != GNUTLS_E_SUCCESS)
+		return;
+
+	filename = conn_ssl_cache_file(conn_peername);
+	conn_write_cache_file(filename, &data);
+	free(filename);
+	gnutls_free(data.data);
+}
+
+static void conn_ssl_enable_tickets()
+{
+	static gnutls_datum_t key;
+	char *filename;
+
+	if (!key.data) {
+		filename = conn_ssl_cache_file(NULL);
+		if (conn_read_cache_file(filename, &key, SSL_TICKET_KEY_MAX_AGE)) {
+			if (gnutls_session_ticket_key_generate(&key) != GNUTLS_E_SUCCESS) {
+				free(filename);
+				return;
+			}
+			csync_debug(2, "SSL: new session ticket key.\n");
+			conn_write_cache_file(filename, &key);
+		}
+		free(filename);
+	}
+
+	gnutls_session_ticket_enable_server(conn_tls_session, &key);
+}
+
+static void conn_load_credentials(int server_role)
 {
-	gnutls_alert_description_t alrt;
 	char *ssl_keyfile;
 	char *ssl_certfile;
 	int err;
-	int handshake_repeat = 0;
 
-	if (csync_conn_usessl)
-		return 0;
+	if (conn_x509_cred_role == server_role)
+		return;
+
+	if (conn_x509_cred_role < 0) {
+		gnutls_global_init();
+		gnutls_global_set_log_function(ssl_log);
+		gnutls_global_set_log_level(10);
+	} else
+		gnutls_certificate_free_credentials(conn_x509_cred);
+	conn_x509_cred_role = -1;
 
 	ASPRINTF(&ssl_keyfile, "%s/csync2_ssl_key.pem", systemdir);
 	ASPRINTF(&ssl_certfile, "%s/csync2_ssl_cert.pem", systemdir);
 
-	gnutls_global_init();
-	gnutls_global_set_log_function(ssl_log);
-	gnutls_global_set_log_level(10);
-
 	gnutls_certificate_allocate_credentials(&conn_x509_cred);
 
 	err = gnutls_certificate_set_x509_key_file(conn_x509_cred, ssl_certfile, ssl_keyfile, GNUTLS_X509_FMT_PEM);
@@ -319,6 +526,24 @@ int conn_activate_ssl(int server_role)
 	} else
 		gnutls_certificate_free_ca_names(conn_x509_cred);
 
+	free(ssl_keyfile);
+	free(ssl_certfile);
+	conn_x509_cred_role = server_role;
+}
+
+int conn_activate_ssl(int server_role)
+{
+	gnutls_alert_description_t alrt;
+	struct timeval tv_start, tv_end;
+	long usecs;
+	int err;
+	int handshake_repeat = 0;
+
+	if (csync_conn_usessl)
+		return 0;
+
+	conn_load_credentials(server_role);
+
 	gnutls_init(&conn_tls_session, (server_role ? GNUTLS_SERVER : GNUTLS_CLIENT));
 	gnutls_priority_set_direct(conn_tls_session, "PERFORMANCE", NULL);
 	gnutls_credentials_set(conn_tls_session, GNUTLS_CRD_CERTIFICATE, conn_x509_cred);
@@ -326,7 +551,9 @@ int conn_activate_ssl(int server_role)
 	if(server_role) {
 		gnutls_certificate_send_x509_rdn_sequence(conn_tls_session, 0);
 		gnutls_certificate_server_set_request(conn_tls_session, GNUTLS_CERT_REQUIRE);
-	}
+		conn_ssl_enable_tickets();
+	} else
+		conn_ssl_load_session();
 
 	gnutls_transport_set_ptr2(
 		conn_tls_session,
@@ -334,6 +561,7 @@ int conn_activate_ssl(int server_role)
 		(gnutls_transport_ptr_t)(long)conn_fd_out
 	);
 
+	gettimeofday(&tv_start, NULL);
 
 	do {
 		handshake_repeat = 0;
@@ -364,8 +592,6 @@ int conn_activate_ssl(int server_role)
 		default:
 			gnutls_bye(conn_tls_session, GNUTLS_SHUT_RDWR);
 			gnutls_deinit(conn_tls_session);
-			gnutls_certificate_free_credentials(conn_x509_cred);
-			gnutls_global_deinit();
 
 			csync_fatal(
 				"SSL: handshake failed: %s (%s)\n",
@@ -375,11 +601,136 @@ int conn_activate_ssl(int server_role)
 		}
 	} while (handshake_repeat);
 
+	gettimeofday(&tv_end, NULL);
+	usecs = (tv_end.tv_sec - tv_start.tv_sec) * 1000000L +
+		(tv_end.tv_usec - tv_start.tv_usec);
+	csync_debug(2, "SSL: %s handshake took %ld.%03ld ms.\n",
+		gnutls_session_is_resumed(conn_tls_session) ? "resumed" : "full",
+		usecs / 1000, usecs % 1000);
+
 	csync_conn_usessl = 1;
 
 	return 0;
 }
 
+#ifdef WITH_KTLS
+
+/*
+ * Hand the sending side of the TLS session to the kernel (kTLS), so
+ * plain write(), sendfile() and splice() on the socket are encrypted
+ * there, and we save the user space copies. Receiving is still done by
+ * GnuTLS. The key material layout is the one the kernel expects, see
+ * also lib/system/ktls.c of GnuTLS.
+ *
+ * From now on, GnuTLS must not send anything by itself, as it does not
+ * know about the records the kernel sent. That's why this is done after
+ * the config file has been read, when the TLS 1.3 tickets are long out,
+ * and why conn_shutdown() sends the close_notify itself.
+ *
+ * If the kernel does not support it (no "tls" ULP, or not this cipher),
+ * everything just stays in user space.
+ */
+int conn_activate_ktls()
+{
+	union {
+		struct tls12_crypto_info_aes_gcm_128 aes128;
+		struct tls12_crypto_info_aes_gcm_256 aes256;
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+	} ci;
+	gnutls_datum_t mac_key, iv, cipher_key;
+	unsigned char seq[8];
+	gnutls_protocol_t version;
+	int tls13, len;
+
+	if (!csync_conn_usessl || conn_ktls_tx || !csync_kernel_tls)
+		return -1;
+
+	version = gnutls_protocol_get_version(conn_tls_session);
+	if (version != GNUTLS_TLS1_2 && version != GNUTLS_TLS1_3)
+		return -1;
+	tls13 = version == GNUTLS_TLS1_3;
+
+	if (gnutls_record_get_state(conn_tls_session, 0, &mac_key, &iv, &cipher_key, seq) < 0)
+		return -1;
+
+	memset(&ci, 0, sizeof(ci));
+	switch (gnutls_cipher_get(conn_tls_session)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		ci.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(ci.aes128.key, cipher_key.data, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+		memcpy(ci.aes128.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+		memcpy(ci.aes128.iv, tls13 ? iv.data + 4 : seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+		memcpy(ci.aes128.rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+		len = sizeof(ci.aes128);
+		break;
+	case GNUTLS_CIPHER_AES_256_GCM:
+		ci.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(ci.aes256.key, cipher_key.data, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+		memcpy(ci.aes256.salt, iv.data, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+		memcpy(ci.aes256.iv, tls13 ? iv.data + 4 : seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+		memcpy(ci.aes256.rec_seq, seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+		len = sizeof(ci.aes256);
+		break;
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(ci.chacha.key, cipher_key.data, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+		memcpy(ci.chacha.iv, iv.data, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+		memcpy(ci.chacha.rec_seq, seq, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+		len = sizeof(ci.chacha);
+		break;
+	default:
+		csync_debug(2, "kTLS: cipher %s not supported.\n",
+			gnutls_cipher_get_name(gnutls_cipher_get(conn_tls_session)));
+		return -1;
+	}
+	/* same offset in all of them */
+	ci.aes128.info.version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+
+	if (setsockopt(conn_fd_out, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+		csync_debug(2, "kTLS: not available: %s\n", strerror(errno));
+		return -1;
+	}
+	if (setsockopt(conn_fd_out, SOL_TLS, TLS_TX, &ci, len) < 0) {
+		csync_debug(2, "kTLS: can't set up TX: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&ci, 0, sizeof(ci));
+
+	csync_debug(2, "kTLS: sending through the kernel.\n");
+	conn_ktls_tx = 1;
+	return 0;
+}
+
+/* a close_notify alert, as gnutls_bye() would have sent it */
+static void conn_ktls_close_notify()
+{
+	char alert[2] = { 1 /* warning */, 0 /* close_notify */ };
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*CMSG_DATA(cmsg) = 21; /* alert */
+
+	if (sendmsg(conn_fd_out, &msg, 0) < 0)
+		csync_debug(2, "kTLS: can't send close_notify: %s\n", strerror(errno));
+}
+
+#else
+
+int conn_activate_ktls()
+{
+	return -1;
+}
+
+#endif /* WITH_KTLS */
+
 int conn_check_peer_cert(const char *peername, int callfatal)
 {
 	const gnutls_datum_t *peercerts;
@@ -442,18 +793,33 @@ int conn_check_peer_cert(const char *peername, int callfatal)
 	return 1;
 }
 
+int conn_activate_ktls()
+{
+	return -1;
+}
+
 #endif /* HAVE_LIBGNUTLS */
 
-int conn_close()
+static int conn_shutdown(int send_bye)
 {
 	if ( !conn_clisok ) return -1;
 
 #ifdef HAVE_LIBGNUTLS
 	if ( csync_conn_usessl ) {
-		gnutls_bye(conn_tls_session, GNUTLS_SHUT_RDWR);
+		if (send_bye) {
+			/* by now, a TLS 1.3 session ticket has arrived */
+			if (conn_x509_cred_role == 0)
+				conn_ssl_save_session();
+#ifdef WITH_KTLS
+			if (conn_ktls_tx)
+				conn_ktls_close_notify();
+			else
+#endif
+			gnutls_bye(conn_tls_session, GNUTLS_SHUT_RDWR);
+		}
 		gnutls_deinit(conn_tls_session);
-		gnutls_certificate_free_credentials(conn_x509_cred);
-		gnutls_global_deinit();
+		csync_conn_usessl = 0;
+		conn_ktls_tx = 0;
 	}
 #endif
 
@@ -467,6 +833,20 @@ int conn_close()
 	return 0;
 }
 
+int conn_close()
+{
+	return conn_shutdown(1);
+}
+
+/*
+ * Drop a connection inherited from the parent process without
+ * talking to the peer, the parent still uses that connection.
+ */
+int conn_abandon()
+{
+	return conn_shutdown(0);
+}
+
 static inline int READ(void *buf, size_t count)
 {
 #ifdef HAVE_LIBGNUTLS
@@ -482,7 +862,7 @@ static inline int WRITE(const void *buf, size_t count)
 	static int n, total;
 
 #ifdef HAVE_LIBGNUTLS
-	if (csync_conn_usessl)
+	if (csync_conn_usessl && !conn_ktls_tx)
 		return gnutls_record_send(conn_tls_session, buf, count);
 	else
 #endif
@@ -506,11 +886,11 @@ static inline int WRITE(const void *buf, size_t count)
 	}
 }
 
+static char buffer[512];
+static int buf_start=0, buf_end=0;
+
 int conn_raw_read(void *buf, size_t count)
 {
-	static char buffer[512];
-	static int buf_start=0, buf_end=0;
-
 	if ( buf_start == buf_end ) {
 		if (count > 128)
 			return READ(buf, count);
@@ -534,6 +914,205 @@ int conn_raw_read(void *buf, size_t count)
 	return 0;
 }
 
+/*
+ * Bulk data transfer between files and the connection.
+ *
+ * As long as the data on the wire is not encrypted in user space (no SSL,
+ * or SSL with the sending side offloaded to the kernel), file data is sent
+ * with sendfile(). Received data is spliced from an unencrypted connection
+ * into the file. Otherwise, or if the kernel refuses, we copy the data
+ * through user space in TLS record sized chunks.
+ */
+#define CONN_BULK_CHUNK 16384
+
+static int conn_plain_out()
+{
+#ifdef HAVE_LIBGNUTLS
+	return !csync_conn_usessl || conn_ktls_tx;
+#else
+	return 1;
+#endif
+}
+
+static int conn_plain_in()
+{
+#ifdef HAVE_LIBGNUTLS
+	return !csync_conn_usessl;
+#else
+	return 1;
+#endif
+}
+
+/* Send size bytes from the current position of fd. */
+int conn_sendfile(int fd, long long size)
+{
+	char buf[CONN_BULK_CHUNK];
+	ssize_t rc;
+
+	csync_debug(3, "Sending %lld bytes from fd %d ..\n", size, fd);
+
+#ifdef HAVE_SENDFILE
+	if (conn_plain_out()) {
+		while (size > 0) {
+			rc = sendfile(conn_fd_out, fd, NULL,
+				size > 0x40000000 ? 0x40000000 : size);
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc <= 0)
+				break;
+			size -= rc;
+		}
+		if (size == 0)
+			return 0;
+		if (rc == 0) {
+			errno = EIO;
+			return -1;
+		}
+		if (errno != EINVAL && errno != ENOSYS)
+			return -1;
+		/* else: not supported for these fds, copy the rest */
+	}
+#endif
+
+	while (size > 0) {
+		rc = read(fd, buf, size > sizeof(buf) ? sizeof(buf) : size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			if (rc == 0)
+				errno = EIO;
+			return -1;
+		}
+		if (WRITE(buf, rc) != rc)
+			return -1;
+		size -= rc;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t count)
+{
+	while (count > 0) {
+		ssize_t rc = write(fd, buf, count);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -1;
+		buf += rc;
+		count -= rc;
+	}
+	return 0;
+}
+
+/* Receive size bytes and write them to the current position of fd. */
+int conn_recvfile(int fd, long long size)
+{
+	char buf[CONN_BULK_CHUNK];
+	ssize_t rc;
+
+	csync_debug(3, "Receiving %lld bytes to fd %d ..\n", size, fd);
+
+	/* whatever conn_gets() has read ahead already */
+	if (buf_start < buf_end && size > 0) {
+		size_t n = buf_end - buf_start;
+		if (n > size)
+			n = size;
+		if (write_all(fd, buffer + buf_start, n))
+			return -1;
+		buf_start += n;
+		size -= n;
+	}
+
+#ifdef HAVE_SPLICE
+	if (conn_plain_in() && size > 0) {
+		int pipefd[2];
+
+		if (pipe(pipefd) == 0) {
+			while (size > 0) {
+				ssize_t in, out;
+				in = splice(conn_fd_in, NULL, pipefd[1], NULL,
+					size > CONN_BULK_CHUNK*16 ? CONN_BULK_CHUNK*16 : size,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+				if (in < 0 && errno == EINTR)
+					continue;
+				if (in <= 0)
+					break;
+				while (in > 0) {
+					out = splice(pipefd[0], NULL, fd, NULL, in, SPLICE_F_MOVE);
+					if (out < 0 && errno == EINTR)
+						continue;
+					if (out <= 0) {
+						/* data is stuck in the pipe, no way to recover */
+						close(pipefd[0]);
+						close(pipefd[1]);
+						if (out == 0)
+							errno = EIO;
+						return -1;
+					}
+					in -= out;
+					size -= out;
+				}
+			}
+			close(pipefd[0]);
+			close(pipefd[1]);
+			if (size == 0)
+				return 0;
+			if (errno != EINVAL && errno != ENOSYS)
+				return -1;
+			/* else: not supported for these fds, copy the rest */
+		}
+	}
+#endif
+
+	while (size > 0) {
+		rc = READ(buf, size > sizeof(buf) ? sizeof(buf) : size);
+		if (rc <= 0) {
+			if (rc == 0)
+				errno = EIO;
+			return -1;
+		}
+		if (write_all(fd, buf, rc))
+			return -1;
+		size -= rc;
+	}
+	return 0;
+}
+
+/* comma separated list of feature names */
+const char *conn_features_string(unsigned features)
+{
+	static char str[256];
+	int i;
+
+	str[0] = 0;
+	for (i = 0; i < sizeof(feature_names)/sizeof(feature_names[0]); i++) {
+		if (!(features & (1 << i)) || !feature_names[i])
+			continue;
+		if (str[0])
+			strcat(str, ",");
+		strcat(str, feature_names[i]);
+	}
+	return str;
+}
+
+unsigned conn_features_parse(const char *list)
+{
+	unsigned features = 0;
+	int i, len;
+
+	while (*list) {
+		len = strcspn(list, ",\r\n");
+		for (i = 0; i < sizeof(feature_names)/sizeof(feature_names[0]); i++)
+			if (feature_names[i] && strlen(feature_names[i]) == len &&
+			    !strncmp(feature_names[i], list, len))
+				features |= 1 << i;
+		list += len;
+		if (*list)
+			list++;
+	}
+	return features;
+}
+
 struct conn_debug_buf {
 	char *pos;
 	size_t rlen;
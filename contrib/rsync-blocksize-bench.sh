@@ -0,0 +1,66 @@
+#!/bin/bash
+#
+# Compare librsync signature size, delta size and CPU time of the fixed
+# default block size with the block size csync2 picks by file size
+# (see csync_rs_block_len() in rsync.c), for MD4 and BLAKE2 signatures.
+#
+# Needs rdiff(1) from librsync >= 1.0.
+#
+# Usage: rsync-blocksize-bench.sh [max-block-size [size-in-MiB ...]]
+#
+# For each size, a file with random content is created, and a copy of it
+# with some scattered modifications. The delta is then computed from the
+# signature of the original to the modified version.
+
+set -e
+
+max_block=${1:-131072}
+shift || true
+sizes=${*:-1 16 256 1024}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+block_len()
+{
+	local size=$1 len
+	len=$(awk -v s=$size 'BEGIN { printf "%d", sqrt(s) }')
+	len=$(( len & ~127 ))
+	(( len < 2048 )) && len=2048
+	(( len > max_block )) && len=$max_block
+	echo $len
+}
+
+# user+sys CPU seconds of a command
+cpu()
+{
+	/usr/bin/time -f "%U %S" -o $tmp/time "$@" >/dev/null
+	awk '{ printf "%.2f", $1 + $2 }' $tmp/time
+}
+
+printf "%8s %7s %6s %8s %12s %12s %8s %8s\n" \
+	size hash block sig-cpu sig-bytes delta-bytes d-cpu p-cpu
+
+for mib in $sizes; do
+	dd if=/dev/urandom of=$tmp/old bs=1M count=$mib status=none
+	cp $tmp/old $tmp/new
+	# change 16 bytes at 64 places
+	for i in $(seq 64); do
+		dd if=/dev/urandom of=$tmp/new bs=16 count=1 conv=notrunc status=none \
+			seek=$(( (RANDOM * 32768 + RANDOM) % (mib * 65536) ))
+	done
+
+	size=$(stat -c %s $tmp/old)
+	for hash in md4 blake2; do
+		for block in 2048 $(block_len $size); do
+			sig_cpu=$(cpu rdiff -b $block -H $hash signature $tmp/old $tmp/sig)
+			delta_cpu=$(cpu rdiff delta $tmp/sig $tmp/new $tmp/delta)
+			patch_cpu=$(cpu rdiff patch $tmp/old $tmp/delta $tmp/out)
+			cmp -s $tmp/new $tmp/out || echo "patch result differs!" >&2
+			printf "%7sM %7s %6s %8s %12s %12s %8s %8s\n" \
+				$mib $hash $block $sig_cpu \
+				$(stat -c %s $tmp/sig) $(stat -c %s $tmp/delta) \
+				$delta_cpu $patch_cpu
+		done
+	done
+done
@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+# Compare the librsync delta path (signature from the peer, delta to the
+# peer, patch) with sending the whole file (PUT), by bytes on the wire and
+# CPU time, for new files, rewritten files and files with a small change.
+# Use it to pick a whole-file-threshold.
+#
+# Needs rdiff(1) from librsync.
+#
+# Usage: whole-file-bench.sh [size-in-KiB ...]
+
+set -e
+
+sizes=${*:-4 16 64 256 1024 16384}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# user+sys CPU seconds of a command
+cpu()
+{
+	/usr/bin/time -f "%U %S" -o $tmp/time "$@" >/dev/null
+	awk '{ printf "%.3f", $1 + $2 }' $tmp/time
+}
+
+printf "%8s %10s %12s %10s %12s %10s\n" \
+	size basis delta-bytes delta-cpu whole-bytes whole-cpu
+
+for kib in $sizes; do
+	dd if=/dev/urandom of=$tmp/new bs=1K count=$kib status=none
+	size=$(stat -c %s $tmp/new)
+
+	for basis in missing rewritten changed; do
+		case $basis in
+		missing)
+			: > $tmp/old ;;
+		rewritten)
+			dd if=/dev/urandom of=$tmp/old bs=1K count=$kib status=none ;;
+		changed)
+			cp $tmp/new $tmp/old
+			dd if=/dev/urandom of=$tmp/old bs=16 count=1 conv=notrunc \
+				status=none seek=$(( RANDOM % (kib * 64) )) ;;
+		esac
+
+		sig_cpu=$(cpu rdiff signature $tmp/old $tmp/sig)
+		delta_cpu=$(cpu rdiff delta $tmp/sig $tmp/new $tmp/delta)
+		patch_cpu=$(cpu rdiff patch $tmp/old $tmp/delta $tmp/out)
+		cmp -s $tmp/new $tmp/out || echo "patch result differs!" >&2
+		whole_cpu=$(cpu cp $tmp/new $tmp/out)
+
+		printf "%7sK %10s %12s %10s %12s %10s\n" $kib $basis \
+			$(( $(stat -c %s $tmp/sig) + $(stat -c %s $tmp/delta) )) \
+			$(awk -v a=$sig_cpu -v b=$delta_cpu -v c=$patch_cpu \
+				'BEGIN { printf "%.3f", a + b + c }') \
+			$size $whole_cpu
+	done
+done
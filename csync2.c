@@ -789,6 +789,7 @@ found_a_group:;
 			break;
 
 		case MODE_INETD:
+			conn_activate_ktls();
 			conn_resp(CR_OK_CMD_FINISHED);
 			csync_daemon_session();
 			break;
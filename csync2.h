@@ -32,10 +32,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <errno.h>
 
 
-#define DB_SCHEMA_VERSION 0
+#define DB_SCHEMA_VERSION 3
 
 /* asprintf with test for no memory */
 
@@ -74,6 +75,9 @@ extern int csync_match_file_host(const char *file, const char *myname, const cha
 extern struct peer *csync_find_peers(const char *file, const char *thispeer);
 extern const char *csync_key(const char *hostname, const char *filename);
 extern int csync_perm(const char *filename, const char *key, const char *hostname);
+extern int csync_append_only(const char *filename);
+extern int csync_inplace(const char *filename);
+extern int csync_dedup(const char *filename);
 
 
 /* error.c */
@@ -93,7 +97,9 @@ extern int conn_open(const char *peername);
 extern int conn_set(int infd, int outfd);
 extern int conn_activate_ssl(int server_role);
 extern int conn_check_peer_cert(const char *peername, int callfatal);
+extern int conn_activate_ktls();
 extern int conn_close();
+extern int conn_abandon();
 
 extern int conn_read(void *buf, size_t count);
 extern int conn_write(const void *buf, size_t count);
@@ -102,6 +108,64 @@ extern void conn_printf(const char *fmt, ...);
 extern int conn_fgets(char *s, int size);
 extern size_t conn_gets(char *s, size_t size);
 
+extern int conn_sendfile(int fd, long long size);
+extern int conn_recvfile(int fd, long long size);
+
+/*
+ * Optional protocol features, negotiated with the FEATURES command right
+ * after the connection has been set up. Peers which do not know about the
+ * FEATURES command get none of them.
+ */
+#define CSYNC_FEATURE_RAW_BIT		0
+#define CSYNC_FEATURE_STREAM_BIT	1
+#define CSYNC_FEATURE_DIGEST_BIT	2
+#define CSYNC_FEATURE_BLOCKSIZE_BIT	3
+#define CSYNC_FEATURE_BLAKE2_BIT	4
+#define CSYNC_FEATURE_PUT_BIT		5
+#define CSYNC_FEATURE_SEGMENTS_BIT	6
+#define CSYNC_FEATURE_SIGLIST_BIT	7
+#define CSYNC_FEATURE_SIZE_BIT		8
+#define CSYNC_FEATURE_SPARSE_BIT	9
+#define CSYNC_FEATURE_APPEND_BIT	10
+#define CSYNC_FEATURE_INPLACE_BIT	11
+#define CSYNC_FEATURE_RENAME_BIT	12
+#define CSYNC_FEATURE_LINK_BIT		13
+#define CSYNC_FEATURE_BASIS_BIT		14
+#define CSYNC_FEATURE_CHUNKS_BIT	15
+#define CSYNC_FEATURE_ATTRS_BIT		16
+#define CSYNC_FEATURE_BUNDLE_BIT	17
+#define CSYNC_FEATURE_MANIFEST_BIT	18
+#define CSYNC_FEATURE_RAW	(1 << CSYNC_FEATURE_RAW_BIT)	/* raw-stream file contents */
+#define CSYNC_FEATURE_STREAM	(1 << CSYNC_FEATURE_STREAM_BIT)	/* chunked-stream sigs and deltas */
+#define CSYNC_FEATURE_DIGEST	(1 << CSYNC_FEATURE_DIGEST_BIT)	/* DIGEST command */
+#define CSYNC_FEATURE_BLOCKSIZE	(1 << CSYNC_FEATURE_BLOCKSIZE_BIT)	/* sig block size by file size */
+#define CSYNC_FEATURE_BLAKE2	(1 << CSYNC_FEATURE_BLAKE2_BIT)	/* BLAKE2 instead of MD4 sigs */
+#define CSYNC_FEATURE_PUT	(1 << CSYNC_FEATURE_PUT_BIT)	/* PUT command */
+#define CSYNC_FEATURE_SEGMENTS	(1 << CSYNC_FEATURE_SEGMENTS_BIT)	/* segmented sigs and deltas */
+#define CSYNC_FEATURE_SIGLIST	(1 << CSYNC_FEATURE_SIGLIST_BIT)	/* SIGLIST command */
+#define CSYNC_FEATURE_SIZE	(1 << CSYNC_FEATURE_SIZE_BIT)	/* file size in delta headers */
+#define CSYNC_FEATURE_SPARSE	(1 << CSYNC_FEATURE_SPARSE_BIT)	/* sparse-stream file contents */
+#define CSYNC_FEATURE_APPEND	(1 << CSYNC_FEATURE_APPEND_BIT)	/* APPEND command */
+#define CSYNC_FEATURE_INPLACE	(1 << CSYNC_FEATURE_INPLACE_BIT)	/* inplace-stream patches */
+#define CSYNC_FEATURE_RENAME	(1 << CSYNC_FEATURE_RENAME_BIT)	/* RENAME command */
+#define CSYNC_FEATURE_LINK	(1 << CSYNC_FEATURE_LINK_BIT)	/* LINK command */
+#define CSYNC_FEATURE_BASIS	(1 << CSYNC_FEATURE_BASIS_BIT)	/* new files patched from a similar one */
+#define CSYNC_FEATURE_CHUNKS	(1 << CSYNC_FEATURE_CHUNKS_BIT)	/* CHUNKS command */
+#define CSYNC_FEATURE_ATTRS	(1 << CSYNC_FEATURE_ATTRS_BIT)	/* ATTRS command */
+#define CSYNC_FEATURE_BUNDLE	(1 << CSYNC_FEATURE_BUNDLE_BIT)	/* BUNDLE command */
+#define CSYNC_FEATURE_MANIFEST	(1 << CSYNC_FEATURE_MANIFEST_BIT)	/* MANIFEST command */
+
+/* depends on GnuTLS and the librsync version, see rsync.c */
+extern const unsigned csync_features_supported;
+#define CSYNC_FEATURES_SUPPORTED	csync_features_supported
+
+/* the largest file sent with BUNDLE (bundle-threshold) */
+#define CSYNC_BUNDLE_MAX_FILE_SIZE	(1 << 20)
+
+extern unsigned csync_conn_features;
+extern const char *conn_features_string(unsigned features);
+extern unsigned conn_features_parse(const char *list);
+
 /* Protocol encodes responses in plain text,
  * everything starting with "OK (" is, well, OK.
  *
@@ -125,6 +189,10 @@ enum connection_response {
 	CR_OK_PATH_NOT_FOUND,		/* "OK (path_not_found).", */
 	CR_OK_CU_LATER,			/* "OK (cu_later).", */
 	CR_OK_ACTIVATING_SSL,		/* "OK (activating_ssl).", */
+	CR_OK_NOT_APPENDED,		/* "OK (not_appended).", */
+	CR_OK_SEND_DATA_INPLACE,	/* "OK (send_data_inplace).", */
+	CR_OK_NOT_RENAMED,		/* "OK (not_renamed).", */
+	CR_OK_NOT_LINKED,		/* "OK (not_linked).", */
 
 	CR_ERROR,
 	/* special error codes, MUST NOT start with "OK (" */
@@ -230,14 +298,51 @@ extern int db_sync_mode;
 
 /* rsync.c */
 
-extern int csync_rs_check(const char *filename, int isreg);
+extern int csync_rs_check(const char *filename, int isreg, int known_diff);
+extern int csync_rs_check_siglist(const char *filename, int isreg, int known_diff);
 extern void csync_rs_sig(const char *filename);
+extern void csync_rs_patch_sig(const char *filename);
+extern void csync_rs_siglist(const char *filename);
 extern int csync_rs_delta(const char *filename);
+extern int csync_rs_delta_inplace(const char *filename);
+extern int csync_rs_put(const char *filename);
+extern int csync_rs_append_check(const char *filename, long long offset, char *check, size_t size);
+extern int csync_rs_append_send(const char *filename, long long offset);
+extern int csync_rs_append(const char *filename, long long offset);
 extern int csync_rs_patch(const char *filename);
+extern int csync_rs_patch_inplace(const char *filename);
+extern void csync_rs_sigcache_prewarm(const char *filename);
+extern int csync_rs_digest(const char *filename, int isreg, char *digest, size_t size);
+extern void csync_rs_use_basis(const char *path);
+extern void csync_cdc_index(const char *filename);
+extern int csync_cdc_send(const char *filename);
+extern int csync_cdc_patch(const char *filename, const char *key, const char *peer);
+extern int csync_rs_install_data(const char *filename, const char *data, size_t len,
+		const struct stat *attrs);
 extern int mkpath(const char *path, mode_t mode);
+extern int csync_copy_data(int fd_in, int fd_out);
 extern void split_dirname_basename(char *dirname, char* basename, const char *filepath);
 
 
+/* sigcache.c */
+
+struct csync_sig_params {
+	uint32_t sig_magic;
+	uint32_t block_len;
+	uint32_t strong_len;
+};
+
+/* not a librsync signature, but a whole file digest */
+#define CSYNC_DIGEST_SHA256	0x73686132
+
+extern int csync_sigcache_lookup(const struct stat *st,
+		const struct csync_sig_params *params, long long *sig_len);
+extern int csync_sigcache_create(char *tmpname);
+extern int csync_sigcache_commit(int fd, const char *tmpname, const struct stat *st,
+		const struct csync_sig_params *params, long long *sig_len);
+extern void csync_sigcache_abort(int fd, const char *tmpname);
+
+
 /* checktxt.c */
 
 extern const char *csync_genchecktxt(const struct stat *st, const char *filename, int ign_mtime);
@@ -381,6 +486,9 @@ struct csync_group {
 	int auto_method, local_slave;
 	const char *backup_directory;
 	int backup_generations;
+	struct csync_group_action_pattern *append_only;
+	struct csync_group_action_pattern *inplace;
+	struct csync_group_action_pattern *dedup;
 	int hasactivepeers;
 };
 
@@ -419,7 +527,18 @@ extern struct csync_prefix *csync_prefix;
 extern struct csync_nossl  *csync_nossl;
 
 extern unsigned csync_lock_timeout;
+extern unsigned csync_parallel_peers;
+extern unsigned csync_parallel_connections;
+extern int csync_kernel_tls;
 extern char *csync_tempdir;
+extern char *csync_sigcache_dir;
+extern unsigned csync_sigcache_size;
+extern int csync_sigcache_prewarm;
+extern unsigned csync_rsync_max_block_size;
+extern long long csync_whole_file_threshold;
+extern long long csync_bundle_threshold;
+extern unsigned csync_rsync_segment_size;
+extern int csync_rsync_threads;
 
 extern char *csync_database;
 
@@ -32,6 +32,9 @@
 #include <errno.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/param.h>
 
 #ifdef __CYGWIN__
 #include <w32api/windows.h>
@@ -82,6 +85,9 @@ void csync_file_update(const char *filename, const char *peername)
 		SQL("Removing file from file db",
 			"delete from file where filename = '%s'",
 			url_encode(filename));
+		SQL("Removing chunk entries (if any)",
+			"DELETE FROM chunk WHERE filename = '%s'",
+			url_encode(filename));
 	} else {
 		const char *checktxt = csync_genchecktxt(&st, filename, 0);
 
@@ -103,7 +109,12 @@ void csync_file_flush(const char *filename)
 		url_encode(filename));
 }
 
-int csync_file_backup(const char *filepath)
+/*
+ * Back up the file before it is changed. If it is going to be replaced by
+ * rename() or removed (replaced), nothing writes to its inode anymore, so
+ * a hardlink is all the backup it needs.
+ */
+int csync_file_backup(const char *filepath, int replaced)
 {
 	static char error_buffer[1024];
 	const struct csync_group *g = NULL;
@@ -201,7 +212,15 @@ int csync_file_backup(const char *filepath)
 
 			/* strcpy(backup_filename+bak_dir_len+filename_len, ""); */
 
-			fd_out = open(backup_filename, O_WRONLY | O_CREAT, 0600);
+			unlink(backup_filename);
+			if (replaced && !lstat(filename, &buf) && S_ISREG(buf.st_mode) &&
+			    !link(filename, backup_filename)) {
+				csync_debug(1, "Linked %s as backup file %s \n", filename, backup_filename);
+				close(fd_in);
+				continue;
+			}
+
+			fd_out = open(backup_filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
 			if (fd_out < 0) {
 				snprintf(error_buffer, 1024, "Open error while backing up '%s': %s\n", filename, strerror(errno));
@@ -229,30 +248,210 @@ int csync_file_backup(const char *filepath)
 	return 0;
 }
 
-int csync_copy_file(int fd_in, int fd_out)
+/*
+ * The file has not been replaced after all (e.g. the patch failed): a
+ * backup linked to it by csync_file_backup() gets its own copy, so later
+ * changes to the file do not change the backup as well.
+ */
+static void csync_file_backup_unshare(const char *filepath)
 {
-	char buffer[512];
-	int read_len = read(fd_in, buffer, 512);
+	const struct csync_group *g = NULL;
+	const char *filename = prefixsubst(filepath);
+	struct stat st, bst;
+
+	if (lstat(filename, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink < 2)
+		return;
+
+	while ((g = csync_find_next(g, filepath))) {
+		if (g->backup_directory && g->backup_generations > 1) {
+			char backup_filename[strlen(g->backup_directory) + strlen(filename) + 12];
+			char tmp_filename[sizeof(backup_filename) + 8];
+			int fd_in, fd_out;
 
-	while (read_len > 0) {
-		int write_len = 0;
+			sprintf(backup_filename, "%s%s", g->backup_directory, filename);
+			if (lstat(backup_filename, &bst) != 0 ||
+			    bst.st_dev != st.st_dev || bst.st_ino != st.st_ino)
+				continue;
 
-		while (write_len < read_len) {
-			int rc = write(fd_out, buffer + write_len,
-				       read_len - write_len);
-			if (rc == -1) {
-				close(fd_in);
-				close(fd_out);
-				//TODO verify return code.
-				return errno;
+			sprintf(tmp_filename, "%s.tmp", backup_filename);
+			fd_in = open(filename, O_RDONLY);
+			fd_out = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+			if (fd_in < 0 || fd_out < 0) {
+				if (fd_in >= 0) close(fd_in);
+				if (fd_out >= 0) close(fd_out);
+				continue;
 			}
-			write_len += rc;
+			csync_debug(1, "Copying %s to backup file %s, it has not been replaced\n",
+					filename, backup_filename);
+			if (csync_copy_file(fd_in, fd_out) || rename(tmp_filename, backup_filename))
+				unlink(tmp_filename);
+			else
+				csync_setBackupFileStatus(backup_filename, strlen(g->backup_directory));
+		}
+	}
+}
+
+/*
+ * How alike two file names are: the length of their common prefix and
+ * suffix, e.g. 12 for app-1.2.2.jar and app-1.2.3.jar.
+ */
+static int basis_name_score(const char *a, const char *b)
+{
+	int la = strlen(a), lb = strlen(b);
+	int min = la < lb ? la : lb;
+	int p = 0, s = 0;
+
+	while (p < min && a[p] == b[p])
+		p++;
+	while (s < min - p && a[la - 1 - s] == b[lb - 1 - s])
+		s++;
+	return p + s;
+}
+
+struct basis_candidate {
+	char path[MAXPATHLEN];
+	int score;
+	long long size_diff;
+};
+
+/*
+ * Whether the peer may not access the file entry in logical_dir. In the
+ * backup directory, "<file>.<n>" may be a backup generation of <file> as
+ * well, so the peer must be allowed to access both.
+ */
+static int basis_perm(const char *logical_dir, const char *entry, int backup,
+		const char *key, const char *peer)
+{
+	char logical[strlen(logical_dir) + strlen(entry) + 2];
+	char *dot;
+
+	sprintf(logical, "%s/%s", logical_dir, entry);
+	if ( csync_perm(logical, key, peer) )
+		return 1;
+	if ( !backup )
+		return 0;
+
+	dot = strrchr(logical, '.');
+	if ( !dot || dot < logical + strlen(logical_dir) + 2 || !dot[1] ||
+	     strspn(dot + 1, "0123456789") != strlen(dot + 1) )
+		return 0;
+	*dot = 0;
+	return csync_perm(logical, key, peer) != 0;
+}
+
+/*
+ * Look for a regular file in dir with a name like name, and a size like
+ * size. dir is logical_dir, or the same directory in the backup directory
+ * if backup is set. Files are only used if the peer may access them.
+ */
+static void basis_scan_dir(struct basis_candidate *c, const char *dir,
+		const char *logical_dir, int backup, const char *name,
+		long long size, const char *key, const char *peer)
+{
+	int name_len = strlen(name);
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+
+	while ((de = readdir(d))) {
+		char path[MAXPATHLEN];
+		long long diff;
+		int score;
+
+		if ( !strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") )
+			continue;
+		/* temp files of transfers in progress */
+		if ( de->d_name[0] == '.' && name[0] != '.' )
+			continue;
+		score = basis_name_score(name, de->d_name);
+		if ( score * 2 < name_len || score < c->score )
+			continue;
+		if ( snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path) ||
+		     lstat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+		     st.st_size < size / 2 || st.st_size > size * 2 )
+			continue;
+		diff = st.st_size > size ? st.st_size - size : size - st.st_size;
+		if ( score == c->score && diff >= c->size_diff )
+			continue;
+		if ( basis_perm(logical_dir, de->d_name, backup, key, peer) )
+			continue;
+		strcpy(c->path, path);
+		c->score = score;
+		c->size_diff = diff;
+	}
+	closedir(d);
+}
+
+/*
+ * For a file which does not exist here yet, another file which is most
+ * likely similar, to patch it from instead of from nothing: the newest
+ * backup of it (it has been deleted before), or the sibling or backup of a
+ * sibling which is most alike in name and size (the previous version of
+ * a versioned file name, or a rotated file). Return: its path, or NULL.
+ */
+static const char *csync_basis_candidate(const char *filepath, long long size,
+		const char *key, const char *peer)
+{
+	static struct basis_candidate c;
+	const struct csync_group *g = NULL;
+	const char *filename = prefixsubst(filepath);
+	const char *name = strrchr(filename, '/');
+	const char *logical_name = strrchr(filepath, '/');
+	struct stat st;
+	int dir_len;
+
+	if ( !name || !logical_name || lstat(filename, &st) == 0 || errno != ENOENT )
+		return NULL;
+	name++;
+	dir_len = name - filename - 1;
+
+	while ((g = csync_find_next(g, filepath))) {
+		if (!g->backup_directory || g->backup_generations <= 1)
+			continue;
+		snprintf(c.path, sizeof(c.path), "%s%s", g->backup_directory, filename);
+		if ( lstat(c.path, &st) == 0 && S_ISREG(st.st_mode) )
+			return c.path;
+	}
+
+	c.path[0] = 0;
+	c.score = 0;
+	c.size_diff = LLONG_MAX;
+	{
+		char dir[dir_len + 2];
+		char logical_dir[logical_name - filepath + 1];
+
+		if (dir_len)
+			snprintf(dir, sizeof(dir), "%.*s", dir_len, filename);
+		else
+			strcpy(dir, "/");
+		snprintf(logical_dir, sizeof(logical_dir), "%.*s",
+				(int)(logical_name - filepath), filepath);
+		basis_scan_dir(&c, dir, logical_dir, 0, name, size, key, peer);
+
+		while ((g = csync_find_next(g, filepath))) {
+			char backup_dir[MAXPATHLEN];
+
+			if (!g->backup_directory || g->backup_generations <= 1)
+				continue;
+			snprintf(backup_dir, sizeof(backup_dir), "%s%.*s",
+					g->backup_directory, dir_len, filename);
+			basis_scan_dir(&c, backup_dir, logical_dir, 1, name, size, key, peer);
 		}
-		read_len = read(fd_in, buffer, 512);
 	}
+	return c.score ? c.path : NULL;
+}
+
+int csync_copy_file(int fd_in, int fd_out)
+{
+	int rc = csync_copy_data(fd_in, fd_out) ? errno : 0;
+
 	close(fd_in);
 	close(fd_out);
-	return 0;
+	return rc;
 }
 
 /* get the mode from the orig directory.
@@ -290,14 +489,16 @@ struct csync_command {
 };
 
 enum {
-	A_SIG, A_FLUSH, A_MARK, A_TYPE, A_GETTM, A_GETSZ, A_DEL, A_PATCH,
-	A_MKDIR, A_MKCHR, A_MKBLK, A_MKFIFO, A_MKLINK, A_MKSOCK,
-	A_SETOWN, A_SETMOD, A_SETIME, A_LIST, A_GROUP,
-	A_DEBUG, A_HELLO, A_BYE
+	A_SIG, A_SIGLIST, A_DIGEST, A_FLUSH, A_MARK, A_TYPE, A_GETTM, A_GETSZ, A_DEL, A_PATCH,
+	A_PUT, A_APPEND, A_RENAME, A_LINK, A_CHUNKS, A_MKDIR, A_MKCHR, A_MKBLK, A_MKFIFO, A_MKLINK, A_MKSOCK,
+	A_SETOWN, A_SETMOD, A_SETIME, A_ATTRS, A_BUNDLE, A_MANIFEST, A_LIST, A_GROUP,
+	A_DEBUG, A_HELLO, A_FEATURES, A_BYE
 };
 
 struct csync_command cmdtab[] = {
 	{ "sig",	1, 0, 0, 0, 1, A_SIG	},
+	{ "siglist",	1, 0, 0, 0, 1, A_SIGLIST },
+	{ "digest",	1, 0, 0, 0, 1, A_DIGEST	},
 	{ "mark",	1, 0, 0, 0, 1, A_MARK	},
 	{ "type",	2, 0, 0, 0, 1, A_TYPE	},
 	{ "gettm",	1, 0, 0, 0, 1, A_GETTM	},
@@ -305,6 +506,11 @@ struct csync_command cmdtab[] = {
 	{ "flush",	1, 1, 0, 0, 1, A_FLUSH	},
 	{ "del",	1, 1, 0, 1, 1, A_DEL	},
 	{ "patch",	1, 1, 2, 1, 1, A_PATCH	},
+	{ "put",	1, 1, 2, 1, 1, A_PUT	},
+	{ "append",	1, 1, 0, 1, 1, A_APPEND	},
+	{ "rename",	1, 1, 0, 1, 1, A_RENAME	},
+	{ "link",	1, 1, 0, 1, 1, A_LINK	},
+	{ "chunks",	1, 1, 2, 1, 1, A_CHUNKS	},
 	{ "mkdir",	1, 1, 1, 1, 1, A_MKDIR	},
 	{ "mkchr",	1, 1, 1, 1, 1, A_MKCHR	},
 	{ "mkblk",	1, 1, 1, 1, 1, A_MKBLK	},
@@ -314,12 +520,16 @@ struct csync_command cmdtab[] = {
 	{ "setown",	1, 1, 0, 2, 1, A_SETOWN	},
 	{ "setmod",	1, 1, 0, 2, 1, A_SETMOD	},
 	{ "setime",	1, 0, 0, 2, 1, A_SETIME	},
+	{ "attrs",	1, 1, 0, 2, 1, A_ATTRS	},
+	{ "bundle",	0, 0, 0, 0, 1, A_BUNDLE	},
+	{ "manifest",	0, 0, 0, 0, 1, A_MANIFEST },
 	{ "list",	0, 0, 0, 0, 1, A_LIST	},
 #if 0
 	{ "debug",	0, 0, 0, 0, 1, A_DEBUG	},
 #endif
 	{ "group",	0, 0, 0, 0, 0, A_GROUP	},
 	{ "hello",	0, 0, 0, 0, 0, A_HELLO	},
+	{ "features",	0, 0, 0, 0, 0, A_FEATURES },
 	{ "bye",	0, 0, 0, 0, 0, A_BYE	},
 	{ 0,		0, 0, 0, 0, 0, 0	}
 };
@@ -473,6 +683,135 @@ static void destroy_tag(char *tag[32])
 	for (i = 0; i < 32; i++)
 		free(tag[i]);
 }
+/*
+ * BUNDLE <count>: <count> small regular files follow, each announced by
+ * "<key> <filename> <uid> <gid> <mode> <mtime> <size>\n" and followed by
+ * <size> bytes of data (none if <size> is -1, the sender could not read
+ * it). Each file is checked like with PATCH, and installed with its owner,
+ * mode and mtime. The answer has one character per file: '+' if it has
+ * been updated, '-' if the peer may not update it, '!' if it is dirty
+ * here as well, '?' on other errors. The peer syncs those one by one.
+ */
+static void csync_daemon_bundle(int count, const char *peer)
+{
+	static char line[4 * 4096];
+	char result[count > 0 ? count + 1 : 1];
+	char *etag[32], *data;
+	long long size, done;
+	struct stat st;
+	int i, rc, perm;
+
+	if ( count < 0 || count > 65536 )
+		csync_fatal("Format-error while receiving data.\n");
+
+	data = malloc(CSYNC_BUNDLE_MAX_FILE_SIZE + 1);
+	if ( !data )
+		csync_fatal("Out of memory.\n");
+
+	for (i = 0; i < count; i++) {
+		if ( !conn_gets(line, sizeof(line)) || !setup_tag(etag, line) )
+			csync_fatal("Format-error while receiving data.\n");
+		size = atoll(etag[6]);
+		if ( size > CSYNC_BUNDLE_MAX_FILE_SIZE )
+			csync_fatal("Format-error while receiving data.\n");
+		for (done = 0; done < size; done += rc) {
+			rc = conn_read(data + done, size - done);
+			if ( rc <= 0 )
+				csync_fatal("Read-error while receiving data.\n");
+		}
+
+		on_cygwin_lowercase(etag[1]);
+		result[i] = '?';
+		perm = csync_perm(etag[1], etag[0], peer);
+		if ( perm ) {
+			if ( perm == 2 )
+				csync_mark(etag[1], peer, 0);
+			result[i] = '-';
+		} else if ( csync_check_dirty(etag[1], peer, 0) )
+			result[i] = '!';
+		else if ( size >= 0 &&
+			  (lstat_strict(prefixsubst(etag[1]), &st) != 0 || S_ISREG(st.st_mode)) &&
+			  !csync_file_backup(etag[1], 1) ) {
+			st.st_uid = atoi(etag[2]);
+			st.st_gid = atoi(etag[3]);
+			st.st_mode = atoi(etag[4]);
+			st.st_mtime = atoll(etag[5]);
+			if ( !csync_rs_install_data(etag[1], data, size, &st) ) {
+				csync_file_update(etag[1], peer);
+				csync_debug(1, "Updated %s from %s.\n", etag[1], peer);
+				if ( csync_dedup(etag[1]) )
+					csync_cdc_index(etag[1]);
+				csync_schedule_commands(etag[1], 0);
+				result[i] = '+';
+			} else
+				csync_file_backup_unshare(etag[1]);
+		}
+		/* the file is synced on its own then, with its own error */
+		cmd_error = 0;
+		destroy_tag(etag);
+	}
+	result[count > 0 ? count : 0] = 0;
+	free(data);
+
+	conn_resp(CR_OK_DATA_FOLLOWS);
+	conn_printf("%s\n", result);
+}
+
+/*
+ * MANIFEST <count>: <count> lines follow, "<key> <filename> <checktxt>
+ * <digest> <mtime>", with the checktxt (without mtime) and DIGEST of the
+ * peer's version of a dirty file, and its mtime ("-" for symlinks). If
+ * ours is the same, its mtime is set, like with SETIME. The answer has
+ * one character per file: '=' if it is the same, '*' if it differs or
+ * is missing, '-' if the peer may not access it, '?' on other errors.
+ * The peer syncs the files which are not the same one by one.
+ */
+static void csync_daemon_manifest(int count, const char *peer)
+{
+	static char line[4 * 4096];
+	char result[count > 0 ? count + 1 : 1];
+	char *etag[32], digest[100];
+	struct stat st;
+	int i;
+
+	if ( count < 0 || count > 65536 )
+		csync_fatal("Format-error while receiving data.\n");
+
+	for (i = 0; i < count; i++) {
+		if ( !conn_gets(line, sizeof(line)) || !setup_tag(etag, line) )
+			csync_fatal("Format-error while receiving data.\n");
+
+		on_cygwin_lowercase(etag[1]);
+		result[i] = '*';
+		if ( csync_perm(etag[1], etag[0], peer) )
+			result[i] = '-';
+		else if ( lstat_strict(prefixsubst(etag[1]), &st) == 0 &&
+			  !csync_check_pure(etag[1]) &&
+			  !strcmp(csync_genchecktxt(&st, etag[1], 1), etag[2]) ) {
+			/* the checktxt is cheap, the digest only if needed */
+			if ( csync_rs_digest(etag[1], S_ISREG(st.st_mode), digest, sizeof(digest)) )
+				result[i] = '?';
+			else if ( !strcmp(digest, etag[3]) ) {
+				result[i] = '=';
+				if ( strcmp(etag[4], "-") && !S_ISLNK(st.st_mode) ) {
+					struct utimbuf utb;
+					utb.actime = atoll(etag[4]);
+					utb.modtime = atoll(etag[4]);
+					if ( utime(prefixsubst(etag[1]), &utb) )
+						result[i] = '?';
+				}
+				if ( result[i] == '=' )
+					csync_file_update(etag[1], peer);
+			}
+		}
+		destroy_tag(etag);
+	}
+	result[count > 0 ? count : 0] = 0;
+
+	conn_resp(CR_OK_DATA_FOLLOWS);
+	conn_printf("%s\n", result);
+}
+
 void csync_daemon_session()
 {
 	static char line[4 * 4096];
@@ -551,6 +890,7 @@ void csync_daemon_session()
 		switch ( cmdtab[cmdnr].action )
 		{
 		case A_SIG:
+		case A_SIGLIST:
 			{
 				struct stat st;
 
@@ -574,10 +914,48 @@ void csync_daemon_session()
 				conn_resp(CR_OK_DATA_FOLLOWS);
 				conn_printf("%s\n", csync_genchecktxt(&st, tag[2], 1));
 
-				if ( S_ISREG(st.st_mode) )
-					csync_rs_sig(tag[2]);
-				else
+				if ( !S_ISREG(st.st_mode) )
 					conn_printf("octet-stream 0\n");
+				else if ( cmdtab[cmdnr].action == A_SIGLIST )
+					csync_rs_siglist(tag[2]);
+				else
+					csync_rs_sig(tag[2]);
+			}
+			break;
+		case A_DIGEST:
+			{
+				struct stat st;
+				char digest[100];
+
+				/* like A_SIG, but with a whole file digest instead of the signature */
+				if ( lstat_strict(prefixsubst(tag[2]), &st) != 0 ) {
+					if ( errno == ENOENT ) {
+						struct stat sb;
+						char parent_dirname[strlen(tag[2])];
+						split_dirname_basename(parent_dirname, NULL, tag[2]);
+						if ( lstat_strict(prefixsubst(parent_dirname), &sb) != 0 )
+							cmd_error = conn_response(CR_ERR_PARENT_DIR_MISSING);
+						else
+							conn_printf("%s\n---\n-\n", conn_response(CR_OK_PATH_NOT_FOUND));
+					} else
+						cmd_error = strerror(errno);
+					break;
+				} else
+					if ( csync_check_pure(tag[2]) ) {
+						conn_printf("%s\n---\n-\n", conn_response(CR_OK_NOT_FOUND));
+						break;
+					}
+				/* if the peer told us the size of its version and ours
+				 * differs, it will not look at the digest anyways */
+				if ( tag[3][0] && S_ISREG(st.st_mode) && atoll(tag[3]) != st.st_size )
+					strcpy(digest, "-");
+				else if ( csync_rs_digest(tag[2], S_ISREG(st.st_mode), digest, sizeof(digest)) ) {
+					cmd_error = strerror(errno);
+					break;
+				}
+				conn_resp(CR_OK_DATA_FOLLOWS);
+				conn_printf("%s\n", csync_genchecktxt(&st, tag[2], 1));
+				conn_printf("%s\n", digest);
 			}
 			break;
 		case A_MARK:
@@ -591,15 +969,12 @@ void csync_daemon_session()
 					f = fopen("/dev/null", "rb");
 
 				if (f) {
-					char buffer[512];
-					size_t rc;
+					struct stat sbuf;
 
 					conn_resp(CR_OK_DATA_FOLLOWS);
-					while ( (rc=fread(buffer, 1, 512, f)) > 0 )
-						if ( conn_write(buffer, rc) != rc ) {
-							conn_printf("[[ %s ]]", strerror(errno));
-							break;
-						}
+					if (fstat(fileno(f), &sbuf) ||
+					    conn_sendfile(fileno(f), sbuf.st_size))
+						conn_printf("[[ %s ]]", strerror(errno));
 					fclose(f);
 					return;
 				}
@@ -625,15 +1000,149 @@ void csync_daemon_session()
 				url_encode(tag[2]));
 			break;
 		case A_DEL:
-			if (!csync_file_backup(tag[2]))
+			if (!csync_file_backup(tag[2], 1))
 				csync_unlink(tag[2], 0);
 			break;
 		case A_PATCH:
-			if (!csync_file_backup(tag[2])) {
+			if ( (csync_conn_features & CSYNC_FEATURE_INPLACE) &&
+			     csync_inplace(tag[2]) ) {
+				struct stat st;
+
+				if ( lstat_strict(prefixsubst(tag[2]), &st) == 0 &&
+				     S_ISREG(st.st_mode) ) {
+					/* written to in place: the backup needs a copy */
+					if (!csync_file_backup(tag[2], 0)) {
+						conn_resp(CR_OK_SEND_DATA_INPLACE);
+						csync_rs_sig(tag[2]);
+						if (csync_rs_patch_inplace(tag[2]))
+							cmd_error = strerror(errno);
+					}
+					break;
+				}
+			}
+			if (!csync_file_backup(tag[2], 1)) {
+				/* a new file, the peer told us its size */
+				const char *basis = tag[3][0] &&
+					(csync_conn_features & CSYNC_FEATURE_BASIS) ?
+					csync_basis_candidate(tag[2], atoll(tag[3]), tag[1], peer) : NULL;
+				int rc;
+
+				if (basis)
+					csync_debug(2, "Patching new file %s from %s.\n", tag[2], basis);
+				csync_rs_use_basis(basis);
 				conn_resp(CR_OK_SEND_DATA);
-				csync_rs_sig(tag[2]);
-				if (csync_rs_patch(tag[2]))
+				csync_rs_patch_sig(tag[2]);
+				rc = csync_rs_patch(tag[2]);
+				csync_rs_use_basis(NULL);
+				if (rc) {
 					cmd_error = strerror(errno);
+					csync_file_backup_unshare(tag[2]);
+				}
+			}
+			break;
+		case A_PUT:
+			/* like A_PATCH, but the whole file follows right away */
+			if (!csync_file_backup(tag[2], 1)) {
+				conn_resp(CR_OK_SEND_DATA);
+				if (csync_rs_patch(tag[2])) {
+					cmd_error = strerror(errno);
+					csync_file_backup_unshare(tag[2]);
+				}
+			}
+			break;
+		case A_APPEND:
+			/* like A_PATCH, but only the data past the old end follows,
+			 * if the file is what the peer's version has grown from */
+			{
+				long long offset = atoll(tag[3]);
+				char check[100];
+				struct stat st;
+
+				if ( lstat_strict(prefixsubst(tag[2]), &st) != 0 ||
+				     !S_ISREG(st.st_mode) || st.st_size != offset ||
+				     csync_rs_append_check(tag[2], offset, check, sizeof(check)) ||
+				     strcmp(check, tag[4]) ) {
+					csync_debug(1, "Not appending to %s, it has changed.\n", tag[2]);
+					conn_resp(CR_OK_NOT_APPENDED);
+					goto next_cmd;
+				}
+				if (!csync_file_backup(tag[2], 0)) {
+					conn_resp(CR_OK_SEND_DATA);
+					if (csync_rs_append(tag[2], offset))
+						cmd_error = strerror(errno);
+				}
+			}
+			break;
+		case A_RENAME:
+			/* like A_DEL of the old name and A_PUT of the new one,
+			 * if our old file is exactly what the peer has moved */
+			{
+				char digest[100];
+				struct stat st;
+				int renamed;
+
+				on_cygwin_lowercase(tag[3]);
+				renamed = !csync_perm(tag[3], tag[1], peer) &&
+					!csync_check_dirty(tag[3], peer, 0) &&
+					lstat_strict(prefixsubst(tag[3]), &st) == 0 &&
+					S_ISREG(st.st_mode) && !csync_check_pure(tag[3]) &&
+					csync_cmpchecktxt(csync_genchecktxt(&st, tag[3], 0), tag[4]) &&
+					!csync_rs_digest(tag[3], 1, digest, sizeof(digest)) &&
+					!strcmp(digest, tag[5]) &&
+					lstat_strict(prefixsubst(tag[2]), &st) != 0;
+				if ( renamed && rename(prefixsubst(tag[3]), prefixsubst(tag[2])) ) {
+					/* the whole directory has been moved: its
+					 * owner and mode are set when it is updated */
+					renamed = errno == ENOENT &&
+						!mkpath(prefixsubst(tag[2]), 0700) &&
+						!rename(prefixsubst(tag[3]), prefixsubst(tag[2]));
+				}
+				if ( !renamed ) {
+					csync_debug(1, "Not renaming %s to %s.\n", tag[3], tag[2]);
+					conn_resp(CR_OK_NOT_RENAMED);
+					goto next_cmd;
+				}
+				csync_file_update(tag[3], peer);
+				csync_schedule_commands(tag[3], 0);
+			}
+			break;
+		case A_LINK:
+			/* like A_PUT, if our copy of the other name is exactly
+			 * what the peer has linked this one to */
+			{
+				char digest[100];
+				struct stat st, st2;
+
+				on_cygwin_lowercase(tag[3]);
+				if ( csync_perm(tag[3], tag[1], peer) ||
+				     csync_check_dirty(tag[3], peer, 0) ||
+				     lstat_strict(prefixsubst(tag[3]), &st) != 0 ||
+				     !S_ISREG(st.st_mode) || csync_check_pure(tag[3]) ||
+				     !csync_cmpchecktxt(csync_genchecktxt(&st, tag[3], 0), tag[4]) ||
+				     csync_rs_digest(tag[3], 1, digest, sizeof(digest)) ||
+				     strcmp(digest, tag[5]) ) {
+					csync_debug(1, "Not linking %s to %s.\n", tag[2], tag[3]);
+					conn_resp(CR_OK_NOT_LINKED);
+					goto next_cmd;
+				}
+				if ( lstat_strict(prefixsubst(tag[2]), &st2) == 0 &&
+				     st2.st_dev == st.st_dev && st2.st_ino == st.st_ino )
+					break;
+				if ( csync_file_backup(tag[2], 1) || csync_unlink(tag[2], 0) )
+					break;
+				if ( link(prefixsubst(tag[3]), prefixsubst(tag[2])) )
+					cmd_error = strerror(errno);
+			}
+			break;
+		case A_CHUNKS:
+			/* like A_PATCH, but against the chunks we have of the
+			 * file, wherever they are */
+			if (!csync_file_backup(tag[2], 1)) {
+				conn_resp(CR_OK_SEND_DATA);
+				if (csync_cdc_patch(tag[2], tag[1], peer)) {
+					cmd_error = strerror(errno);
+					csync_file_backup_unshare(tag[2]);
+				}
 			}
 			break;
 		case A_MKDIR:
@@ -709,6 +1218,39 @@ void csync_daemon_session()
 					cmd_error = strerror(errno);
 			}
 			break;
+		case A_ATTRS:
+			/* A_SETOWN, A_SETMOD and A_SETIME in one go; mode
+			 * and mtime are "-" for symlinks */
+			if ( !csync_ignore_uid || !csync_ignore_gid ) {
+				int uid = csync_ignore_uid ? -1 : atoi(tag[3]);
+				int gid = csync_ignore_gid ? -1 : atoi(tag[4]);
+				if ( lchown(prefixsubst(tag[2]), uid, gid) ) {
+					cmd_error = strerror(errno);
+					break;
+				}
+			}
+			if ( !csync_ignore_mod && strcmp(tag[5], "-") ) {
+				if ( chmod(prefixsubst(tag[2]), atoi(tag[5])) ) {
+					cmd_error = strerror(errno);
+					break;
+				}
+			}
+			if ( strcmp(tag[6], "-") ) {
+				struct utimbuf utb;
+				utb.actime = atoll(tag[6]);
+				utb.modtime = atoll(tag[6]);
+				if ( utime(prefixsubst(tag[2]), &utb) )
+					cmd_error = strerror(errno);
+			}
+			break;
+		case A_BUNDLE:
+			conn_resp(CR_OK_SEND_DATA);
+			csync_daemon_bundle(atoi(tag[1]), peer);
+			break;
+		case A_MANIFEST:
+			conn_resp(CR_OK_SEND_DATA);
+			csync_daemon_manifest(atoi(tag[1]), peer);
+			break;
 		case A_LIST:
 			SQL_BEGIN("DB Dump - Files for sync pair",
 				"SELECT checktxt, filename FROM file %s%s%s ORDER BY filename",
@@ -779,6 +1321,14 @@ found_asactive: ;
 				}
 			}
 			break;
+		case A_FEATURES:
+			csync_conn_features = conn_features_parse(tag[1]) &
+				CSYNC_FEATURES_SUPPORTED;
+			csync_debug(2, "Protocol features: %s\n",
+					conn_features_string(csync_conn_features));
+			conn_resp(CR_OK_DATA_FOLLOWS);
+			conn_printf("%s\n", conn_features_string(csync_conn_features));
+			goto next_cmd;
 		case A_BYE:
 			for (i=0; i<32; i++)
 				free(tag[i]);
@@ -792,6 +1342,8 @@ found_asactive: ;
 		if ( cmdtab[cmdnr].update == 1 ) {
 			csync_debug(1, "Updated %s from %s.\n",
 					tag[2], peer ? peer : "???");
+			if ( csync_dedup(tag[2]) )
+				csync_cdc_index(tag[2]);
 			csync_schedule_commands(tag[2], 0);
 		}
 
@@ -133,6 +133,7 @@ void csync_db_maycommit()
 void csync_db_open(const char *file)
 {
         int rc = db_open(file, db_type, &db);
+	int version;
 	if ( rc != DB_OK )
 		csync_fatal("Can't open database: %s\n", file);
 
@@ -141,8 +142,9 @@ void csync_db_open(const char *file)
 	/* ignore errors on table creation */
 	in_sql_query++;
 
-	if (db_schema_version(db) < DB_SCHEMA_VERSION)
-		if (db_upgrade_to_schema(db, DB_SCHEMA_VERSION) != DB_OK)
+	version = db_schema_version(db);
+	if (version < DB_SCHEMA_VERSION)
+		if (db_upgrade_to_schema(db, version, DB_SCHEMA_VERSION) != DB_OK)
 			csync_fatal("Cannot create database tables (version requested = %d): %s\n", DB_SCHEMA_VERSION, db_errmsg(db));
 
 	if (!db_sync_mode)
@@ -262,13 +262,41 @@ int db_schema_version(db_conn_p db)
 		version = 0;
 	} SQL_END;
 
+	/* version 1 added the move table */
+	if (version == 0) {
+		SQL_BEGIN(NULL,		/* ignore errors */
+			  "SELECT count(*) from move") {
+			version = 1;
+		} SQL_END;
+	}
+
+	/* version 2 added the hardlink table */
+	if (version == 1) {
+		SQL_BEGIN(NULL,		/* ignore errors */
+			  "SELECT count(*) from hardlink") {
+			version = 2;
+		} SQL_END;
+	}
+
+	/* version 3 added the chunk table */
+	if (version == 2) {
+		SQL_BEGIN(NULL,		/* ignore errors */
+			  "SELECT count(*) from chunk") {
+			version = 3;
+		} SQL_END;
+	}
+
 	return version;
 }
 
-int db_upgrade_to_schema(db_conn_p db, int version)
+/*
+ * Create the tables added after schema version from (-1 for a new
+ * database) up to version.
+ */
+int db_upgrade_to_schema(db_conn_p db, int from, int version)
 {
 	if (db && db->upgrade_to_schema)
-		return db->upgrade_to_schema(version);
+		return db->upgrade_to_schema(from, version);
 
 	return DB_ERROR;
 }
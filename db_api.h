@@ -26,7 +26,7 @@ struct db_conn_t {
   void      (*close)  (db_conn_p conn);
   void      (*logger) (int lv, const char *fmt, ...);
   const char* (*errmsg) (db_conn_p conn);
-  int       (*upgrade_to_schema) (int version);
+  int       (*upgrade_to_schema) (int from, int version);
 };
 
 struct db_stmt_t {
@@ -67,7 +67,7 @@ int       db_stmt_close(db_stmt_p stmt);
 
 void db_set_logger(db_conn_p conn, void (*logger)(int lv, const char *fmt, ...));
 int db_schema_version(db_conn_p db);
-int db_upgrade_to_schema(db_conn_p db, int version);
+int db_upgrade_to_schema(db_conn_p db, int from, int version);
 const char *db_errmsg(db_conn_p conn);
 
 #endif
@@ -312,55 +312,92 @@ int db_mysql_stmt_close(db_stmt_p stmt)
  * We should be able to get away with just "key",
  * typically the code does "delete from" before "insert into" anyways.
  * */
-int db_mysql_upgrade_to_schema(int version)
+int db_mysql_upgrade_to_schema(int from, int version)
 {
 	if (version < 0)
 		return DB_OK;
 
-	if (version > 0)
+	if (version > 3)
 		return DB_ERROR;
 
-	csync_debug(2, "Upgrading database schema to version %d.\n", version);
+	csync_debug(2, "Upgrading database schema from version %d to %d.\n",
+			from, version);
 
 	/* *INDENT-OFF* */
-	csync_db_sql("Creating action table",
-		     "CREATE TABLE action ("
-		     "  filename TEXT NOT NULL,"
-		     "  command TEXT NOT NULL,"
-		     "  logfile TEXT NOT NULL,"
-		     "  KEY filename (filename(255)),"
-		     "  KEY command (command(255))"
-		     ");");
-
-	csync_db_sql("Creating dirty table",
-		     "CREATE TABLE dirty ("
-		     "  filename TEXT NOT NULL,"
-		     "  forced INTEGER NOT NULL,"
-		     "  myname TEXT NOT NULL,"
-		     "  peername TEXT NOT NULL,"
-		     "  KEY filename (filename(255)),"
-		     "  KEY dirty_host (peername(255))"
-		     ");");
-
-	csync_db_sql("Creating file table",
-		     "CREATE TABLE file ("
-		     "  filename TEXT NOT NULL,"
-		     "  checktxt TEXT NOT NULL,"
-		     "  KEY filename (filename(255))"
-		     ");");
-
-	csync_db_sql("Creating hint table",
-		     "CREATE TABLE hint ("
-		     "  filename TEXT NOT NULL,"
-		     "  recursive INTEGER NOT NULL"
-		     ");");
-
-	csync_db_sql("Creating x509_cert table",
-		     "CREATE TABLE x509_cert ("
-		     "  peername TEXT NOT NULL,"
-		     "  certdata TEXT NOT NULL,"
-		     "  KEY peername (peername(255))"
-		     ");");
+	if (from < 0) {
+		csync_db_sql("Creating action table",
+			     "CREATE TABLE action ("
+			     "  filename TEXT NOT NULL,"
+			     "  command TEXT NOT NULL,"
+			     "  logfile TEXT NOT NULL,"
+			     "  KEY filename (filename(255)),"
+			     "  KEY command (command(255))"
+			     ");");
+
+		csync_db_sql("Creating dirty table",
+			     "CREATE TABLE dirty ("
+			     "  filename TEXT NOT NULL,"
+			     "  forced INTEGER NOT NULL,"
+			     "  myname TEXT NOT NULL,"
+			     "  peername TEXT NOT NULL,"
+			     "  KEY filename (filename(255)),"
+			     "  KEY dirty_host (peername(255))"
+			     ");");
+
+		csync_db_sql("Creating file table",
+			     "CREATE TABLE file ("
+			     "  filename TEXT NOT NULL,"
+			     "  checktxt TEXT NOT NULL,"
+			     "  KEY filename (filename(255))"
+			     ");");
+
+		csync_db_sql("Creating hint table",
+			     "CREATE TABLE hint ("
+			     "  filename TEXT NOT NULL,"
+			     "  recursive INTEGER NOT NULL"
+			     ");");
+
+		csync_db_sql("Creating x509_cert table",
+			     "CREATE TABLE x509_cert ("
+			     "  peername TEXT NOT NULL,"
+			     "  certdata TEXT NOT NULL,"
+			     "  KEY peername (peername(255))"
+			     ");");
+	}
+
+	/* version 1 */
+	if (from < 1 && version >= 1) {
+		csync_db_sql("Creating move table",
+			     "CREATE TABLE move ("
+			     "  filename TEXT NOT NULL,"
+			     "  oldname TEXT NOT NULL,"
+			     "  KEY filename (filename(255)),"
+			     "  KEY oldname (oldname(255))"
+			     ");");
+	}
+
+	/* version 2 */
+	if (from < 2 && version >= 2) {
+		csync_db_sql("Creating hardlink table",
+			     "CREATE TABLE hardlink ("
+			     "  filename TEXT NOT NULL,"
+			     "  inode VARCHAR(40) NOT NULL,"
+			     "  KEY filename (filename(255)),"
+			     "  KEY inode (inode)"
+			     ");");
+	}
+
+	/* version 3 */
+	if (from < 3 && version >= 3) {
+		csync_db_sql("Creating chunk table",
+			     "CREATE TABLE chunk ("
+			     "  hash CHAR(64) NOT NULL,"
+			     "  filename TEXT NOT NULL,"
+			     "  pos BIGINT NOT NULL,"
+			     "  KEY hash (hash),"
+			     "  KEY filename (filename(255))"
+			     ");");
+	}
 	/* *INDENT-ON* */
 
 	return DB_OK;
@@ -355,53 +355,95 @@ int db_postgres_stmt_close(db_stmt_p stmt)
 	return DB_OK;
 }
 
-int db_postgres_upgrade_to_schema(int version)
+int db_postgres_upgrade_to_schema(int from, int version)
 {
 	if (version < 0)
 		return DB_OK;
 
-	if (version > 0)
+	if (version > 3)
 		return DB_ERROR;
 
-	csync_debug(2, "Upgrading database schema to version %d.\n", version);
+	csync_debug(2, "Upgrading database schema from version %d to %d.\n",
+			from, version);
 
 	/* *INDENT-OFF* */
-	csync_db_sql("Creating action table",
-		     "CREATE TABLE action ("
-		     "  filename TEXT NOT NULL,"
-		     "  command TEXT NOT NULL,"
-		     "  logfile TEXT NOT NULL,"
-		     "  UNIQUE (filename,command)"
-		     ");");
-
-	csync_db_sql("Creating dirty table",
-		     "CREATE TABLE dirty ("
-		     "  filename TEXT NOT NULL,"
-		     "  forced INTEGER NOT NULL,"
-		     "  myname TEXT NOT NULL,"
-		     "  peername TEXT NOT NULL,"
-		     "  UNIQUE (filename,peername)"
-		     ");");
-
-	csync_db_sql("Creating file table",
-		     "CREATE TABLE file ("
-		     "  filename TEXT NOT NULL,"
-		     "  checktxt TEXT NOT NULL,"
-		     "  UNIQUE (filename)"
-		     ");");
-
-	csync_db_sql("Creating hint table",
-		     "CREATE TABLE hint ("
-		     "  filename TEXT NOT NULL,"
-		     "  recursive INTEGER NOT NULL"
-		     ");");
-
-	csync_db_sql("Creating x509_cert table",
-		     "CREATE TABLE x509_cert ("
-		     "  peername TEXT NOT NULL,"
-		     "  certdata TEXT NOT NULL,"
-		     "  UNIQUE (peername)"
-		     ");");
+	if (from < 0) {
+		csync_db_sql("Creating action table",
+			     "CREATE TABLE action ("
+			     "  filename TEXT NOT NULL,"
+			     "  command TEXT NOT NULL,"
+			     "  logfile TEXT NOT NULL,"
+			     "  UNIQUE (filename,command)"
+			     ");");
+
+		csync_db_sql("Creating dirty table",
+			     "CREATE TABLE dirty ("
+			     "  filename TEXT NOT NULL,"
+			     "  forced INTEGER NOT NULL,"
+			     "  myname TEXT NOT NULL,"
+			     "  peername TEXT NOT NULL,"
+			     "  UNIQUE (filename,peername)"
+			     ");");
+
+		csync_db_sql("Creating file table",
+			     "CREATE TABLE file ("
+			     "  filename TEXT NOT NULL,"
+			     "  checktxt TEXT NOT NULL,"
+			     "  UNIQUE (filename)"
+			     ");");
+
+		csync_db_sql("Creating hint table",
+			     "CREATE TABLE hint ("
+			     "  filename TEXT NOT NULL,"
+			     "  recursive INTEGER NOT NULL"
+			     ");");
+
+		csync_db_sql("Creating x509_cert table",
+			     "CREATE TABLE x509_cert ("
+			     "  peername TEXT NOT NULL,"
+			     "  certdata TEXT NOT NULL,"
+			     "  UNIQUE (peername)"
+			     ");");
+	}
+
+	/* version 1 */
+	if (from < 1 && version >= 1) {
+		csync_db_sql("Creating move table",
+			     "CREATE TABLE move ("
+			     "  filename TEXT NOT NULL,"
+			     "  oldname TEXT NOT NULL,"
+			     "  UNIQUE (filename)"
+			     ");");
+	}
+
+	/* version 2 */
+	if (from < 2 && version >= 2) {
+		csync_db_sql("Creating hardlink table",
+			     "CREATE TABLE hardlink ("
+			     "  filename TEXT NOT NULL,"
+			     "  inode TEXT NOT NULL,"
+			     "  UNIQUE (filename)"
+			     ");");
+
+		csync_db_sql("Creating hardlink index",
+			     "CREATE INDEX hardlink_inode ON hardlink (inode);");
+	}
+
+	/* version 3 */
+	if (from < 3 && version >= 3) {
+		csync_db_sql("Creating chunk table",
+			     "CREATE TABLE chunk ("
+			     "  hash TEXT NOT NULL,"
+			     "  filename TEXT NOT NULL,"
+			     "  pos BIGINT NOT NULL"
+			     ");");
+
+		csync_db_sql("Creating chunk index",
+			     "CREATE INDEX chunk_hash ON chunk (hash);");
+
+		csync_db_sql("Creating chunk filename index",
+			     "CREATE INDEX chunk_filename ON chunk (filename);");
+	}
 	/* *INDENT-ON* */
 
 	return DB_OK;
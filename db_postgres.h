@@ -15,6 +15,6 @@ const void* db_postgres_stmt_get_column_blob(db_stmt_p stmt, int column);
 const char *db_postgres_stmt_get_column_text(db_stmt_p stmt, int column);
 int   db_postgres_stmt_get_column_int(db_stmt_p stmt, int column);
 int   db_postgres_stmt_close(db_stmt_p stmt);
-int   db_postgres_upgrade_to_schema(int version);
+int   db_postgres_upgrade_to_schema(int from, int version);
 
 #endif
@@ -14,6 +14,6 @@ const void* db_sqlite_stmt_get_column_blob(db_stmt_p stmt, int column);
 int   db_sqlite_stmt_get_column_int(db_stmt_p stmt, int column);
 int   db_sqlite_stmt_close(db_stmt_p stmt);
 const char *db_sqlite_errmsg(db_conn_p conn);
-int db_sqlite_upgrade_to_schema(int version);
+int db_sqlite_upgrade_to_schema(int from, int version);
 
 #endif
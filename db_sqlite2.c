@@ -215,46 +215,81 @@ int db_sqlite2_stmt_close(db_stmt_p stmt)
 	return rc;
 }
 
-int db_sqlite2_upgrade_to_schema(int version)
+int db_sqlite2_upgrade_to_schema(int from, int version)
 {
 	if (version < 0)
 		return DB_OK;
 
-	if (version > 0)
+	if (version > 3)
 		return DB_ERROR;
 
-	csync_debug(2, "Upgrading database schema to version %d.\n", version);
+	csync_debug(2, "Upgrading database schema from version %d to %d.\n",
+			from, version);
 
 	/* *INDENT-OFF* */
-	csync_db_sql("Creating file table",
-		"CREATE TABLE file ("
-		"	filename, checktxt,"
-		"	UNIQUE ( filename ) ON CONFLICT REPLACE"
-		")");
-
-	csync_db_sql("Creating dirty table",
-		"CREATE TABLE dirty ("
-		"	filename, forced, myname, peername,"
-		"	UNIQUE ( filename, peername ) ON CONFLICT IGNORE"
-		")");
-
-	csync_db_sql("Creating hint table",
-		"CREATE TABLE hint ("
-		"	filename, recursive,"
-		"	UNIQUE ( filename, recursive ) ON CONFLICT IGNORE"
-		")");
-
-	csync_db_sql("Creating action table",
-		"CREATE TABLE action ("
-		"	filename, command, logfile,"
-		"	UNIQUE ( filename, command ) ON CONFLICT IGNORE"
-		")");
-
-	csync_db_sql("Creating x509_cert table",
-		"CREATE TABLE x509_cert ("
-		"	peername, certdata,"
-		"	UNIQUE ( peername ) ON CONFLICT IGNORE"
-		")");
+	if (from < 0) {
+		csync_db_sql("Creating file table",
+			"CREATE TABLE file ("
+			"	filename, checktxt,"
+			"	UNIQUE ( filename ) ON CONFLICT REPLACE"
+			")");
+
+		csync_db_sql("Creating dirty table",
+			"CREATE TABLE dirty ("
+			"	filename, forced, myname, peername,"
+			"	UNIQUE ( filename, peername ) ON CONFLICT IGNORE"
+			")");
+
+		csync_db_sql("Creating hint table",
+			"CREATE TABLE hint ("
+			"	filename, recursive,"
+			"	UNIQUE ( filename, recursive ) ON CONFLICT IGNORE"
+			")");
+
+		csync_db_sql("Creating action table",
+			"CREATE TABLE action ("
+			"	filename, command, logfile,"
+			"	UNIQUE ( filename, command ) ON CONFLICT IGNORE"
+			")");
+
+		csync_db_sql("Creating x509_cert table",
+			"CREATE TABLE x509_cert ("
+			"	peername, certdata,"
+			"	UNIQUE ( peername ) ON CONFLICT IGNORE"
+			")");
+	}
+
+	/* version 1 */
+	if (from < 1 && version >= 1) {
+		csync_db_sql("Creating move table",
+			"CREATE TABLE move ("
+			"	filename, oldname,"
+			"	UNIQUE ( filename ) ON CONFLICT REPLACE"
+			")");
+	}
+
+	/* version 2 */
+	if (from < 2 && version >= 2) {
+		csync_db_sql("Creating hardlink table",
+			"CREATE TABLE hardlink ("
+			"	filename, inode,"
+			"	UNIQUE ( filename ) ON CONFLICT REPLACE"
+			")");
+		csync_db_sql("Creating hardlink index",
+			"CREATE INDEX hardlink_inode ON hardlink ( inode )");
+	}
+
+	/* version 3 */
+	if (from < 3 && version >= 3) {
+		csync_db_sql("Creating chunk table",
+			"CREATE TABLE chunk ("
+			"	hash, filename, pos"
+			")");
+		csync_db_sql("Creating chunk index",
+			"CREATE INDEX chunk_hash ON chunk ( hash )");
+		csync_db_sql("Creating chunk filename index",
+			"CREATE INDEX chunk_filename ON chunk ( filename )");
+	}
 	/* *INDENT-ON* */
 
 	return DB_OK;
@@ -13,6 +13,6 @@ const char* db_sqlite2_stmt_get_column_text(db_stmt_p stmt, int column);
 const void* db_sqlite2_stmt_get_column_blob(db_stmt_p stmt, int column);
 int   db_sqlite2_stmt_get_column_int(db_stmt_p stmt, int column);
 int   db_sqlite2_stmt_close(db_stmt_p stmt);
-int   db_sqlite2_upgrade_to_schema(int version);
+int   db_sqlite2_upgrade_to_schema(int from, int version);
 
 #endif
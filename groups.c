@@ -219,6 +219,59 @@ const char *csync_key(const char *hostname, const char *filename)
 	return 0;
 }
 
+static int match_file_patterns(const struct csync_group_action_pattern *p,
+		const char *filename)
+{
+	for (; p; p = p->next) {
+		int fnm_pathname = p->star_matches_slashes ? 0 : FNM_PATHNAME;
+		if ( !fnmatch(p->pattern, filename, FNM_LEADING_DIR|fnm_pathname) )
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Is the file declared append-only (by the append-only statement of one of
+ * its groups), so that when it grows, the old content may be taken as is?
+ */
+int csync_append_only(const char *filename)
+{
+	const struct csync_group *g = NULL;
+
+	while ( (g=csync_find_next(g, filename)) )
+		if ( match_file_patterns(g->append_only, filename) )
+			return 1;
+
+	return 0;
+}
+
+/* Is the file to be patched in place (inplace statement of one of its groups)? */
+int csync_inplace(const char *filename)
+{
+	const struct csync_group *g = NULL;
+
+	while ( (g=csync_find_next(g, filename)) )
+		if ( match_file_patterns(g->inplace, filename) )
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Is the file to be sent by content-defined chunks, and kept in the chunk
+ * index (dedup statement of one of its groups)?
+ */
+int csync_dedup(const char *filename)
+{
+	const struct csync_group *g = NULL;
+
+	while ( (g=csync_find_next(g, filename)) )
+		if ( match_file_patterns(g->dedup, filename) )
+			return 1;
+
+	return 0;
+}
+
 int csync_perm(const char *filename, const char *key, const char *hostname)
 {
 	const struct csync_group *g = NULL;
@@ -24,11 +24,19 @@
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
 
 /* for tmpfile replacement: */
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>	/* FICLONE */
+#endif
 
 /* for MAXPATHLEN */
 #include <sys/param.h>
@@ -38,6 +46,11 @@
 #include <w32api/windows.h>
 #endif
 
+#ifdef HAVE_LIBGNUTLS
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#endif
+
 
 /* This has been taken from rsync:lib/compat.c */
 
@@ -364,498 +377,3265 @@ static FILE* open_temp_file(char *fnametmp, const char *fname)
  * In which case csync2 would be the wrong tool anyways.
  */
 
-void csync_send_file(FILE *in)
+void csync_send_file(FILE *in, long long file_size)
 {
-	char buffer[512];
-	int rc, chunk;
 	long size;
 
 	fflush(in);
 	size = ftell(in);
 	rewind(in);
 
-	conn_printf("octet-stream %ld\n", size);
+	if (file_size >= 0)
+		conn_printf("octet-stream %ld %lld\n", size, file_size);
+	else
+		conn_printf("octet-stream %ld\n", size);
 
-	while ( size > 0 ) {
-		chunk = size > 512 ? 512 : size;
-		rc = fread(buffer, 1, chunk, in);
+	if (lseek(fileno(in), 0, SEEK_SET) < 0 ||
+	    conn_sendfile(fileno(in), size))
+		csync_fatal("Error '%s' while sending data.\n", strerror(errno));
+}
 
-		if ( rc <= 0 )
-			csync_fatal("Read-error while sending data.\n");
-		chunk = rc;
+/*
+ * Data on the wire is announced by one of these headers:
+ *
+ *   octet-stream <size>	<size> bytes (a signature or delta) follow
+ *   raw-stream <size>		the whole file follows, instead of a delta
+ *				against a missing or much smaller basis
+ *				(CSYNC_FEATURE_RAW), or for PUT
+ *   chunked-stream		the data follows in chunks, each announced by
+ *				"<len>\n", ended by "0\n", or by "-1\n" if the
+ *				sender ran into an error (CSYNC_FEATURE_STREAM)
+ *   sparse-stream <size>	like raw-stream, but only the data of a sparse
+ *				file follows, in extents announced by
+ *				"<offset> <len>\n", ended by "0 0\n", or by
+ *				"-1 -1\n" on error; the rest is holes
+ *				(CSYNC_FEATURE_SPARSE)
+ *   segmented-stream <segment size> <count>
+ *				<count> of the above follow, one per segment
+ *				of the file (CSYNC_FEATURE_SEGMENTS); an error
+ *				in one of them ends the segmented stream
+ *   inplace-stream <size>	records to patch the file in place, see
+ *				csync_rs_patch_inplace() (CSYNC_FEATURE_INPLACE)
+ *   ERROR, or a negative size	the sender could not provide the data
+ *
+ * With CSYNC_FEATURE_SIZE, octet-, chunked- and segmented-streams of a
+ * delta carry the size of the resulting file as an additional field, so
+ * the receiver can preallocate it.
+ *
+ * Chunked streams let us produce signatures and deltas while sending them,
+ * without knowing their size in advance.
+ */
+enum { STREAM_OCTET, STREAM_RAW, STREAM_CHUNKED, STREAM_SEGMENTED, STREAM_SPARSE,
+	STREAM_INPLACE };
+
+struct csync_stream {
+	int type;
+	long long left;		/* in the stream, or in the current chunk;
+				 * segments still to come if segmented */
+	long long offset;	/* of the current extent, if sparse */
+	long long segment_size;
+	long long file_size;	/* of the resulting file, -1 if unknown */
+	long long total;	/* bytes read so far */
+	int eof;
+	int error;		/* the sender reported an error */
+	unsigned char head[12];	/* the first bytes, e.g. a signature header */
+};
+
+static int csync_recv_header(struct csync_stream *s)
+{
+	char buffer[100];
 
-		rc = conn_write(buffer, chunk);
-		if ( rc != chunk )
-			csync_fatal("Write-error while sending data.\n");
+	memset(s, 0, sizeof(*s));
+	s->file_size = -1;
+	if ( !conn_gets(buffer, 100) )
+		csync_fatal("Format-error while receiving data.\n");
+	if ( sscanf(buffer, "octet-stream %lld %lld\n", &s->left, &s->file_size) >= 1 )
+		s->type = STREAM_OCTET;
+	else if ( sscanf(buffer, "raw-stream %lld\n", &s->left) == 1 ) {
+		s->type = STREAM_RAW;
+		s->file_size = s->left;
+	} else if ( sscanf(buffer, "sparse-stream %lld\n", &s->file_size) == 1 ) {
+		s->type = STREAM_SPARSE;
+		s->left = s->file_size < 0 ? -1 : 0;
+	} else if ( sscanf(buffer, "inplace-stream %lld\n", &s->file_size) == 1 ) {
+		s->type = STREAM_INPLACE;
+		s->left = s->file_size < 0 ? -1 : 0;
+	} else if ( !strcmp(buffer, "chunked-stream\n") ||
+		    sscanf(buffer, "chunked-stream %lld\n", &s->file_size) == 1 )
+		s->type = STREAM_CHUNKED;
+	else if ( sscanf(buffer, "segmented-stream %lld %lld %lld\n",
+			&s->segment_size, &s->left, &s->file_size) >= 2 &&
+		  s->segment_size > 0 )
+		s->type = STREAM_SEGMENTED;
+	else if ( !strcmp(buffer, "ERROR\n") )
+		s->left = -1;
+	else
+		csync_fatal("Format-error while receiving data.\n");
 
-		size -= chunk;
-	}
+	if (s->left < 0) { errno=EIO; return -1; }
+	return s->type;
 }
 
-int csync_recv_file(FILE *out)
+/*
+ * Get to the data of the stream: with chunked and sparse streams, read the
+ * header of the next chunk or extent, if the current one is used up.
+ * Return: 1 if there is data to read, 0 at the end of the stream,
+ * -1 (errno=EIO) if the sender reported an error.
+ */
+static int csync_stream_next(struct csync_stream *s)
 {
-	char buffer[512];
-	int rc, chunk;
-	long size;
+	char line[100];
+	int ok;
 
-	if ( !conn_gets(buffer, 100) || sscanf(buffer, "octet-stream %ld\n", &size) != 1 ) {
-		if (!strcmp(buffer, "ERROR\n")) { errno=EIO; return -1; }
-		csync_fatal("Format-error while receiving data.\n");
+	if ( s->eof ) {
+		if ( s->error ) { errno=EIO; return -1; }
+		return 0;
+	}
+
+	if ( (s->type == STREAM_CHUNKED || s->type == STREAM_SPARSE) && s->left == 0 ) {
+		if ( !conn_gets(line, 100) )
+			csync_fatal("Format-error while receiving data.\n");
+		if ( s->type == STREAM_SPARSE )
+			ok = sscanf(line, "%lld %lld\n", &s->offset, &s->left) == 2;
+		else
+			ok = sscanf(line, "%lld\n", &s->left) == 1;
+		if ( !ok )
+			csync_fatal("Format-error while receiving data.\n");
+		if ( s->left < 0 ) { s->eof = s->error = 1; errno=EIO; return -1; }
+	}
+	if ( s->left == 0 ) {
+		s->eof = 1;
+		return 0;
 	}
-	if (size < 0) { errno=EIO; return -1; }
+	return 1;
+}
+
+/*
+ * Read the next part of the stream.
+ * Return: number of bytes, 0 at the end of the stream,
+ * -1 (errno=EIO) if the sender reported an error.
+ */
+static int csync_stream_read(struct csync_stream *s, char *buf, size_t len)
+{
+	int rc;
+
+	rc = csync_stream_next(s);
+	if ( rc <= 0 )
+		return rc;
+
+	if ( len > s->left )
+		len = s->left;
+	rc = conn_read(buf, len);
+	if ( rc <= 0 )
+		csync_fatal("Read-error while receiving data.\n");
+
+	if ( s->total < sizeof(s->head) )
+		memcpy(s->head + s->total, buf,
+			MIN(rc, sizeof(s->head) - s->total));
+	s->left -= rc;
+	s->total += rc;
+	return rc;
+}
+
+/* Skip the rest of the stream. Return -1 if it ended with an error. */
+static int csync_stream_drain(struct csync_stream *s)
+{
+	char buffer[4096];
+	int rc;
 
-	csync_debug(3, "Receiving %ld bytes ..\n", size);
+	while ( (rc = csync_stream_read(s, buffer, sizeof(buffer))) > 0 )
+		;
+	return rc;
+}
 
-	while ( size > 0 ) {
-		chunk = size > 512 ? 512 : size;
-		rc = conn_read(buffer, chunk);
+/*
+ * Skip the rest of a segmented stream: the rest of the current segment,
+ * if any, and the segments still to come.
+ */
+static void csync_segmented_drain(struct csync_stream *s, struct csync_stream *cur)
+{
+	struct csync_stream seg;
 
-		if ( rc <= 0 )
-			csync_fatal("Read-error while receiving data.\n");
-		chunk = rc;
+	if ( cur && csync_stream_drain(cur) < 0 )
+		return;
+	while ( s->left > 0 ) {
+		s->left--;
+		if ( csync_recv_header(&seg) < 0 || csync_stream_drain(&seg) < 0 )
+			return;
+	}
+}
 
-		rc = fwrite(buffer, chunk, 1, out);
-		if ( rc != 1 )
-			csync_fatal("Write-error while receiving data.\n");
+/*
+ * Receive a sparse-stream to the current position of out: the extents are
+ * written where they belong, everything in between is left as a hole.
+ */
+static int csync_recv_sparse(FILE *out, struct csync_stream *s)
+{
+	int fd = fileno(out), rc;
+	off_t base = lseek(fd, 0, SEEK_CUR), end = 0;
+	struct stat st;
 
-		size -= chunk;
-		csync_debug(3, "Got %d bytes, %ld bytes left ..\n",
-				chunk, size);
+	if ( base < 0 )
+		csync_fatal("Error '%s' while receiving data.\n", strerror(errno));
+	while ( (rc = csync_stream_next(s)) > 0 ) {
+		if ( s->offset < end || s->offset + s->left > s->file_size )
+			csync_fatal("Format-error while receiving data.\n");
+		if ( lseek(fd, base + s->offset, SEEK_SET) < 0 ||
+		     conn_recvfile(fd, s->left) )
+			csync_fatal("Error '%s' while receiving data.\n", strerror(errno));
+		end = s->offset + s->left;
+		s->total += s->left;
+		s->left = 0;
 	}
+	if ( rc < 0 )
+		return -1;
+
+	/* a hole at the end does not make the file any longer by itself */
+	if ( fstat(fd, &st) < 0 ||
+	     (st.st_size < base + s->file_size && ftruncate(fd, base + s->file_size) < 0) )
+		csync_fatal("Error '%s' while receiving data.\n", strerror(errno));
+	return 0;
+}
+
+static int csync_recv_data(FILE *out, struct csync_stream *s)
+{
+	char buffer[4096];
+	int rc;
 
 	fflush(out);
+	if ( s->type == STREAM_SPARSE ) {
+		if ( csync_recv_sparse(out, s) < 0 )
+			return -1;
+	} else if ( s->type != STREAM_CHUNKED ) {
+		if ( conn_recvfile(fileno(out), s->left) )
+			csync_fatal("Error '%s' while receiving data.\n", strerror(errno));
+		s->total += s->left;
+		s->left = 0;
+		s->eof = 1;
+	} else {
+		while ( (rc = csync_stream_read(s, buffer, sizeof(buffer))) > 0 )
+			if ( fwrite(buffer, rc, 1, out) != 1 )
+				csync_fatal("Write-error while receiving data.\n");
+		if ( rc < 0 )
+			return -1;
+		fflush(out);
+	}
 	rewind(out);
 	return 0;
 }
 
-/*
- * Return:
- * 	0, *sig_file == NULL: base file does not exist, empty sig.
- * 	0, *sig_file != NULL: sig_file contains the sig
- *     -1, *sig_file == NULL: "IO Error"
- *     -1, *sig_file != NULL: librsync error
- */
-int csync_rs_sigfile(const char *filename, FILE **sig_file_out)
+static int csync_stream_write(void *ctx, const char *buf, size_t len)
 {
-	char tmpfname[MAXPATHLEN];
-	struct stat st;
-	FILE *basis_file;
-	FILE *sig_file = NULL;
-	int r = -1;
-	rs_result result;
-	rs_stats_t stats;
+	conn_printf("%ld\n", (long)len);
+	if ( conn_write(buf, len) != len )
+		csync_fatal("Write-error while sending data.\n");
+	return 0;
+}
 
-	csync_debug(3, "Opening basis_file and sig_file for %s\n", filename);
-	*sig_file_out = NULL;
+/* The size of the new file for a delta header, or -1 if the peer does not want it. */
+static long long csync_size_hint(off_t size)
+{
+	return (csync_conn_features & CSYNC_FEATURE_SIZE) ? size : -1;
+}
 
-	basis_file = fopen(prefixsubst(filename), "rb");
-	if (!basis_file && errno == ENOENT) {
-		csync_debug(3, "Basis file does not exist.\n");
-		return 0;
+#ifdef SEEK_HOLE
+/*
+ * Send size bytes from pos on as sparse-stream: the data, but not the holes.
+ * Return: 0, or -1 (errno=EIO) if we had to end the stream with an error.
+ */
+static int csync_send_sparse(int fd, off_t pos, off_t size)
+{
+	off_t end = pos + size, data, hole = pos;
+
+	csync_debug(3, "Sending data of sparse file to peer..\n");
+	conn_printf("sparse-stream %lld\n", (long long)size);
+	while ( hole < end ) {
+		data = lseek(fd, hole, SEEK_DATA);
+		if ( data < 0 && errno == ENXIO )
+			break;	/* only a hole is left */
+		if ( data < 0 )
+			goto error;
+		if ( data >= end )
+			break;
+		hole = lseek(fd, data, SEEK_HOLE);
+		if ( hole < 0 || lseek(fd, data, SEEK_SET) < 0 )
+			goto error;
+		hole = MIN(hole, end);
+		conn_printf("%lld %lld\n", (long long)(data - pos), (long long)(hole - data));
+		if ( conn_sendfile(fd, hole - data) )
+			csync_fatal("Error '%s' while sending data.\n", strerror(errno));
 	}
-	if (!basis_file || fstat(fileno(basis_file), &st) || !S_ISREG(st.st_mode))
-		goto out;
+	conn_printf("0 0\n");
+	csync_debug(3, "File has been sent successfully.\n");
+	return 0;
 
-	sig_file = open_temp_file(tmpfname, prefixsubst(filename));
-	if (!sig_file)
-		goto out;
-	if (unlink(tmpfname) < 0)
-		goto out;
+error:
+	csync_debug(0, "I/O Error '%s' while looking for holes in file.\n", strerror(errno));
+	conn_printf("-1 -1\n");
+	errno = EIO;
+	return -1;
+}
+#endif
 
-	csync_debug(3, "Running rs_sig_file() from librsync....\n");
-/* see upstream
- * https://github.com/librsync/librsync/commit/152323729ac831727032daf50a10c1448b48f252
- * as reaction to SECURITY: CVE-2014-8242
+/*
+ * Send the complete file (size bytes from the current position of fd on)
+ * as raw-stream, or as sparse-stream if it has holes, see csync_recv_header().
+ * Return: 0, or -1 (errno=EIO) if the stream has been ended with an error.
  */
-#ifdef RS_DEFAULT_STRONG_LEN
-	result = rs_sig_file(basis_file, sig_file, RS_DEFAULT_BLOCK_LEN, RS_DEFAULT_STRONG_LEN, &stats);
-#else
-	/* For backward compatibility, for now hardcode RS_MD4_SIG_MAGIC.
-	 * TODO: allow changing to RS_BLAKE2_SIG_MAGIC. */
-	result = rs_sig_file(basis_file, sig_file, RS_DEFAULT_BLOCK_LEN, 0, RS_MD4_SIG_MAGIC, &stats);
+static int csync_send_raw(int fd, off_t size)
+{
+#ifdef SEEK_HOLE
+	off_t pos, hole;
+
+	if ( (csync_conn_features & CSYNC_FEATURE_SPARSE) && size > 0 &&
+	     (pos = lseek(fd, 0, SEEK_CUR)) >= 0 ) {
+		hole = lseek(fd, pos, SEEK_HOLE);
+		if ( hole >= 0 && hole < pos + size )
+			return csync_send_sparse(fd, pos, size);
+		if ( lseek(fd, pos, SEEK_SET) < 0 )
+			csync_fatal("Error '%s' while sending data.\n", strerror(errno));
+	}
 #endif
-	*sig_file_out = sig_file;
-	sig_file = NULL;
-	if (result != RS_DONE)
-		csync_debug(0, "Internal error from rsync library!\n");
-	else
-		r = 0;
-out:
-	if (basis_file)
-		fclose(basis_file);
-	if (sig_file)
-		fclose(sig_file);
-	return r;
+	csync_debug(3, "Sending whole file to peer..\n");
+	conn_printf("raw-stream %lld\n", (long long)size);
+	if (conn_sendfile(fd, size))
+		csync_fatal("Error '%s' while sending data.\n", strerror(errno));
+	csync_debug(3, "File has been sent successfully.\n");
+	return 0;
 }
 
-int csync_rs_check(const char *filename, int isreg)
+/* The data for PUT: the whole file, without asking for a signature. */
+int csync_rs_put(const char *filename)
 {
-	FILE *sig_file = 0;
-	char buffer1[512], buffer2[512];
-	int rc, chunk, found_diff = 0;
-	int backup_errno;
-	long size;
-	long my_size = 0;
-
-	csync_debug(3, "Csync2 / Librsync: csync_rs_check('%s', %d [%s])\n",
-		    filename, isreg, isreg ? "regular file" : "non-regular file");
+	struct stat st;
+	int fd, rc;
 
-	csync_debug(3, "Reading signature size from peer....\n");
-	if (!conn_gets(buffer1, 100) || sscanf(buffer1, "octet-stream %ld\n", &size) != 1)
-		csync_fatal("Format-error while receiving data.\n");
+	csync_debug(3, "Csync2 / Librsync: csync_rs_put('%s')\n", filename);
 
-	if (size < 0) {
-		errno = EIO;
-		goto io_error;
+	fd = open(prefixsubst(filename), O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		int backup_errno = errno;
+		csync_debug(0, "I/O Error '%s' while %s in rsync-put: %s\n",
+				strerror(errno), "opening data file for reading", filename);
+		conn_printf("octet-stream -1\n");
+		if (fd >= 0)
+			close(fd);
+		errno = backup_errno;
+		return -1;
 	}
 
-	csync_debug(3, "Receiving %ld bytes ..\n", size);
-
-	if (isreg) {
-		if (csync_rs_sigfile(filename, &sig_file)) {
-			if (!sig_file)
-				goto io_error;
-			goto error;
-		}
-		if (sig_file) {
-			fflush(sig_file);
-			my_size = ftell(sig_file);
-			rewind(sig_file);
-		}
-	}
+	rc = csync_send_raw(fd, st.st_size);
+	close(fd);
+	return rc;
+}
 
-	if (size != my_size) {
-		csync_debug(2, "Signature size differs: local=%d, peer=%d\n", my_size, size);
-		found_diff = 1;
-	}
+#define RS_JOB_BUFSIZE 65536
 
-	while (size > 0) {
-		chunk = size > 512 ? 512 : size;
-		rc = conn_read(buffer1, chunk);
+/*
+ * Run a librsync job, feeding it from in() and passing its output to out().
+ * in() returns the number of bytes read, 0 at EOF, or -1 on error; out()
+ * returns -1 on error. Either one may be NULL, if the job has no input or
+ * output.
+ */
+static rs_result csync_rs_run_job(rs_job_t *job,
+		int (*in)(void *ctx, char *buf, size_t len), void *in_ctx,
+		int (*out)(void *ctx, const char *buf, size_t len), void *out_ctx)
+{
+	char inbuf[RS_JOB_BUFSIZE], outbuf[RS_JOB_BUFSIZE];
+	rs_buffers_t buf;
+	rs_result result;
+	int rc;
 
-		if (rc <= 0)
-			csync_fatal("Read-error while receiving data.\n");
-		chunk = rc;
+	memset(&buf, 0, sizeof(buf));
+	buf.next_in = inbuf;
+	buf.eof_in = !in;
 
-		if (sig_file) {
-			if (fread(buffer2, chunk, 1, sig_file) != 1) {
-				csync_debug(2, "Found EOF in local sig file.\n");
-				found_diff = 1;
-			}
-			if (memcmp(buffer1, buffer2, chunk)) {
-				csync_debug(2, "Found diff in sig at -%d:-%d\n", size, size - chunk);
-				found_diff = 1;
-			}
-		} /* else just drain */
+	do {
+		if ( !buf.eof_in && buf.avail_in < sizeof(inbuf) ) {
+			memmove(inbuf, buf.next_in, buf.avail_in);
+			buf.next_in = inbuf;
+			rc = in(in_ctx, inbuf + buf.avail_in, sizeof(inbuf) - buf.avail_in);
+			if ( rc < 0 )
+				return RS_IO_ERROR;
+			if ( rc == 0 )
+				buf.eof_in = 1;
+			buf.avail_in += rc;
+		}
 
-		size -= chunk;
-		csync_debug(3, "Got %d bytes, %ld bytes left ..\n", chunk, size);
-	}
+		buf.next_out = outbuf;
+		buf.avail_out = sizeof(outbuf);
+		result = rs_job_iter(job, &buf);
+		if ( result != RS_DONE && result != RS_BLOCKED )
+			return result;
 
-	csync_debug(3, "File has been checked successfully (%s).\n", found_diff ? "difference found" : "files are equal");
-	if (sig_file)
-		fclose(sig_file);
-	return found_diff;
+		if ( out && buf.next_out > outbuf &&
+		     out(out_ctx, outbuf, buf.next_out - outbuf) < 0 )
+			return RS_IO_ERROR;
+	} while ( result == RS_BLOCKED );
 
-io_error:
-	csync_debug(0, "I/O Error '%s' in rsync-check: %s\n", strerror(errno), prefixsubst(filename));
-error:
-	backup_errno = errno;
+	return RS_DONE;
+}
 
-	/* drain response */
-	while (size > 0) {
-		chunk = size > 512 ? 512 : size;
-		rc = conn_read(buffer1, chunk);
-		if (rc <= 0)
-			csync_fatal("Read-error while receiving data.\n");
-		size -= rc;
-	}
+static int csync_rs_read_fd(void *ctx, char *buf, size_t len)
+{
+	int rc;
 
-	if (sig_file)
-		fclose(sig_file);
-	errno = backup_errno;
-	return -1;
+	do {
+		rc = read(*(int *)ctx, buf, len);
+	} while ( rc < 0 && errno == EINTR );
+	return rc;
 }
 
-void csync_rs_sig(const char *filename)
+static int csync_rs_read_stream(void *ctx, char *buf, size_t len)
 {
-	FILE *sig_file;
+	return csync_stream_read(ctx, buf, len);
+}
 
-	csync_debug(3, "Csync2 / Librsync: csync_rs_sig('%s')\n", filename);
+static int csync_rs_write_file(void *ctx, const char *buf, size_t len)
+{
+	return fwrite(buf, len, 1, ctx) == 1 ? 0 : -1;
+}
 
-	if (csync_rs_sigfile(filename, &sig_file)) {
-		/* error */
-		if (sig_file)
-			csync_fatal("Got an error from librsync, too bad!\n");
-		csync_debug(0, "I/O Error '%s' in rsync-sig: %s\n",
-				strerror(errno), prefixsubst(filename));
+const unsigned csync_features_supported =
+	CSYNC_FEATURE_RAW | CSYNC_FEATURE_STREAM | CSYNC_FEATURE_BLOCKSIZE |
+	CSYNC_FEATURE_PUT | CSYNC_FEATURE_SEGMENTS | CSYNC_FEATURE_SIGLIST |
+	CSYNC_FEATURE_SIZE | CSYNC_FEATURE_APPEND | CSYNC_FEATURE_INPLACE |
+	CSYNC_FEATURE_BASIS | CSYNC_FEATURE_ATTRS | CSYNC_FEATURE_BUNDLE
+#ifdef SEEK_HOLE
+	| CSYNC_FEATURE_SPARSE
+#endif
+#ifdef HAVE_LIBGNUTLS
+	/* the digests are computed with GnuTLS; RENAME, LINK and MANIFEST
+	 * compare them, CHUNKS identifies chunks by them */
+	| CSYNC_FEATURE_DIGEST | CSYNC_FEATURE_RENAME | CSYNC_FEATURE_LINK
+	| CSYNC_FEATURE_CHUNKS | CSYNC_FEATURE_MANIFEST
+#endif
+#ifndef RS_DEFAULT_STRONG_LEN
+	| CSYNC_FEATURE_BLAKE2
+#endif
+	;
 
-		/* FIXME.
-		 * Peer expected some sort of sig,
-		 * we need to communicate an error instead. */
-		conn_printf("octet-stream -1\n");
-		return;
+static unsigned long isqrt(unsigned long long x)
+{
+	unsigned long long r = x, y;
+
+	if (x < 2)
+		return x;
+	/* Newton, starting above the root */
+	y = (r + 1) / 2;
+	while (y < r) {
+		r = y;
+		y = (r + x / r) / 2;
 	}
+	return r;
+}
 
-	/* no error */
-	csync_debug(3, "Sending sig_file to peer..\n");
-	if (sig_file) {
-		csync_send_file(sig_file);
-		fclose(sig_file);
-	} else {
-		/* This is the signature for an "empty" file
-		 * as returned by rs_sig_file(/dev/null).
-		 * No point in re-calculating it over and over again. */
-		conn_printf("octet-stream 12\n");
-		conn_write("rs\0016\000\000\010\000\000\000\000\010", 12);
-	}
-	csync_debug(3, "Signature has been successfully sent.\n");
+/*
+ * Like rsync, use blocks of about sqrt(size) bytes: the signature and the
+ * hash table then grow with sqrt(size) only, while small files keep the
+ * finer granularity of the default block size.
+ */
+static size_t csync_rs_block_len(off_t size)
+{
+	size_t len = isqrt(size) & ~127UL;
+	size_t max = csync_rsync_max_block_size;
+
+	if (max < RS_DEFAULT_BLOCK_LEN)
+		max = RS_DEFAULT_BLOCK_LEN;
+	if (len < RS_DEFAULT_BLOCK_LEN)
+		len = RS_DEFAULT_BLOCK_LEN;
+	if (len > max)
+		len = max;
+	return len;
+}
+
+/*
+ * Signature parameters for a basis of the given size. Both sides of a
+ * connection must use the same, or csync_rs_check() finds differences
+ * where there are none.
+ */
+static void csync_rs_sig_params(struct csync_sig_params *p, off_t size, unsigned features)
+{
+	p->block_len = (features & CSYNC_FEATURE_BLOCKSIZE) ?
+		csync_rs_block_len(size) : RS_DEFAULT_BLOCK_LEN;
+/* see upstream
+ * https://github.com/librsync/librsync/commit/152323729ac831727032daf50a10c1448b48f252
+ * as reaction to SECURITY: CVE-2014-8242
+ */
+#ifdef RS_DEFAULT_STRONG_LEN
+	p->sig_magic = 0;
+	p->strong_len = RS_DEFAULT_STRONG_LEN;
+#else
+	/* For backward compatibility, MD4 unless the peer knows better. */
+	p->sig_magic = (features & CSYNC_FEATURE_BLAKE2) ?
+		RS_BLAKE2_SIG_MAGIC : RS_MD4_SIG_MAGIC;
+	p->strong_len = 0;
+#endif
 }
 
+static void csync_rs_basis_params(int basis_fd, struct csync_sig_params *p, unsigned features)
+{
+	struct stat st;
 
+	if (fstat(basis_fd, &st) < 0)
+		st.st_size = 0;
+	csync_rs_sig_params(p, st.st_size, features);
+}
 
-int csync_rs_delta(const char *filename)
+static rs_job_t *csync_rs_sig_begin(const struct csync_sig_params *p)
 {
-	FILE *sig_file = 0, *new_file = 0, *delta_file = 0;
-	rs_result result;
-	rs_signature_t *sumset;
-	rs_stats_t stats;
-	char tmpfname[MAXPATHLEN];
+#ifdef RS_DEFAULT_STRONG_LEN
+	return rs_sig_begin(p->block_len, p->strong_len);
+#else
+	return rs_sig_begin(p->block_len, p->strong_len, p->sig_magic);
+#endif
+}
 
-	csync_debug(3, "Csync2 / Librsync: csync_rs_delta('%s')\n", filename);
+/*
+ * Another file to use as the basis of the next signature and patch, set
+ * by csync_rs_use_basis() for a file which does not exist here yet.
+ */
+static char *basis_path;
 
-	csync_debug(3, "Receiving sig_file from peer..\n");
-	sig_file = open_temp_file(tmpfname, prefixsubst(filename));
-	if ( !sig_file ) goto io_error;
-	if (unlink(tmpfname) < 0) goto io_error;
+void csync_rs_use_basis(const char *path)
+{
+	free(basis_path);
+	basis_path = path ? strdup(path) : NULL;
+}
+
+/*
+ * Open filename as basis for a signature.
+ * Return: fd, or -1 (errno == ENOENT if it does not exist)
+ */
+static int csync_rs_open_basis(const char *filename)
+{
+	struct stat st;
+	int fd;
 
-	if ( csync_recv_file(sig_file) ) {
-		fclose(sig_file);
+	csync_debug(3, "Opening basis_file for %s\n", filename);
+	fd = open(basis_path ? basis_path : prefixsubst(filename), O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			csync_debug(3, "Basis file does not exist.\n");
 		return -1;
 	}
-	result = rs_loadsig_file(sig_file, &sumset, &stats);
-	if (result != RS_DONE)
-		csync_fatal("Got an error from librsync, too bad!\n");
-	fclose(sig_file);
-
-	csync_debug(3, "Opening new_file and delta_file..\n");
-	new_file = fopen(prefixsubst(filename), "rb");
-	if ( !new_file ) {
+	if (fstat(fd, &st) < 0) {
 		int backup_errno = errno;
-		const char *errstr = strerror(errno);
-		csync_debug(0, "I/O Error '%s' while %s in rsync-delta: %s\n",
-				errstr, "opening data file for reading", filename);
-		conn_printf("%s\n", errstr);
-		fclose(new_file);
+		close(fd);
 		errno = backup_errno;
 		return -1;
 	}
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	return fd;
+}
 
-	delta_file = open_temp_file(tmpfname, prefixsubst(filename));
-	if ( !delta_file ) goto io_error;
-	if (unlink(tmpfname) < 0) goto io_error;
-
-	csync_debug(3, "Running rs_build_hash_table() from librsync..\n");
-	result = rs_build_hash_table(sumset);
-	if (result != RS_DONE)
-		csync_fatal("Got an error from librsync, too bad!\n");
+static int csync_rs_write_fd(void *ctx, const char *buf, size_t len)
+{
+	int rc;
 
-	csync_debug(3, "Running rs_delta_file() from librsync..\n");
-	result = rs_delta_file(sumset, new_file, delta_file, &stats);
-	if (result != RS_DONE)
-		csync_fatal("Got an error from librsync, too bad!\n");
+	while (len > 0) {
+		rc = write(*(int *)ctx, buf, len);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		buf += rc;
+		len -= rc;
+	}
+	return 0;
+}
 
-	csync_debug(3, "Sending delta_file to peer..\n");
-	csync_send_file(delta_file);
+static int same_version(const struct stat *a, const struct stat *b)
+{
+	return a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+		a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+		a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
 
-	csync_debug(3, "Delta has been created successfully.\n");
-	rs_free_sumset(sumset);
-	fclose(delta_file);
-	fclose(new_file);
+/*
+ * Get the signature of the basis from the signature cache, or create it
+ * and add it to the cache.
+ * Return: fd positioned at the start of the signature, or -1 if the cache
+ * is disabled or the signature could not be cached. The basis_fd is
+ * rewound in that case.
+ */
+static int csync_rs_cached_sig(int basis_fd, unsigned features, long long *sig_len)
+{
+	struct csync_sig_params params;
+	char tmpname[MAXPATHLEN];
+	struct stat st, st2;
+	rs_job_t *job;
+	rs_result result;
+	int fd;
 
-	return 0;
+	if (!csync_sigcache_dir || fstat(basis_fd, &st) < 0)
+		return -1;
 
-io_error:
-	csync_debug(0, "I/O Error '%s' in rsync-delta: %s\n",
-			strerror(errno), prefixsubst(filename));
+	csync_rs_sig_params(&params, st.st_size, features);
+	fd = csync_sigcache_lookup(&st, &params, sig_len);
+	if (fd >= 0)
+		return fd;
 
-	if (new_file) fclose(new_file);
-	if (delta_file) fclose(delta_file);
-	if (sig_file) fclose(sig_file);
+	fd = csync_sigcache_create(tmpname);
+	if (fd < 0)
+		return -1;
 
-	return -1;
+	csync_debug(3, "Running rs_sig_begin() from librsync for the cache..\n");
+	job = csync_rs_sig_begin(&params);
+	result = csync_rs_run_job(job, csync_rs_read_fd, &basis_fd,
+			csync_rs_write_fd, &fd);
+	rs_job_free(job);
+
+	/* do not cache the signature of a file which changed meanwhile */
+	if (result != RS_DONE || fstat(basis_fd, &st2) < 0 || !same_version(&st, &st2)) {
+		csync_sigcache_abort(fd, tmpname);
+		fd = -1;
+	} else if (csync_sigcache_commit(fd, tmpname, &st, &params, sig_len))
+		fd = -1;
+
+	if (fd < 0)
+		lseek(basis_fd, 0, SEEK_SET);
+	return fd;
 }
 
-/* The "temporary" newfname typically has been created as "-rw------- root:root".
- * Before we rename it into place, "clone" the permissions and ownership of the
- * old file to avoid files already with the "correct name", but root owned and
- * unreadable by the applications, if even for a short time.
- * If the old file does not exist (or cannot be stat()ed), ignore.
- * If we cannot rename into place, but have to truncate/rewrite,
- * we keep the existing file anyways, so no ownership/permission change happens.
- * If permissions and/or ownership has also changed, in addition to
- * content, those will be explicitly synced "soon".
- * If there are errors while cloning the ownership or permissions, so what?
- * Ignore, it stays at root:root 0600, and won't be worse than before.
- *
- * Can we do better?
- * Until we change the ugly ad-hoc csync2 "protocol" to use "transaction" like
- * semantics, and know all of the changed content, plus ownership, permissions,
- * mtime, ACLs and other meta data as context information before starting to
- * act on it on the receiving side, I don't see how.
- */
-static void clone_ownership_and_permissions(const char *newfname, const char *oldfname)
+/* Make sure the signature of a changed file is in the cache. */
+void csync_rs_sigcache_prewarm(const char *filename)
 {
-	struct stat sbuf;
-	int uid, gid;
-	if (stat(oldfname, &sbuf))
-		return; /* At least we tried */
-	uid = csync_ignore_uid ? -1 : sbuf.st_uid;
-	gid = csync_ignore_gid ? -1 : sbuf.st_gid;
-	csync_debug(3, "Cloning ownership and permissions to tmp file: 0o%03o %d:%d %s [%s]\n",
-			sbuf.st_mode, uid, gid, newfname, oldfname);
-	if (chown(newfname, uid, gid))
-		csync_debug(3, "Error '%s' for chown(%s,%d,%d) rsync-patch: %s\n",
-				strerror(errno), newfname, uid, gid, oldfname);
-	if (chmod(newfname, sbuf.st_mode))
-		csync_debug(3, "Error '%s' for chmod(%s,0o%03o) rsync-patch: %s\n",
-				strerror(errno), newfname, sbuf.st_mode, oldfname);
+	long long sig_len;
+	int basis_fd, sig_fd;
 
-	/* FIXME also "clone" acls;
-	 * as long as csync2 is no acl aware, there is no point, though */
+	if (!csync_sigcache_dir || !csync_sigcache_prewarm)
+		return;
+
+	basis_fd = csync_rs_open_basis(filename);
+	if (basis_fd < 0)
+		return;
+	/* for peers as recent as we are */
+	sig_fd = csync_rs_cached_sig(basis_fd, CSYNC_FEATURES_SUPPORTED, &sig_len);
+	if (sig_fd >= 0)
+		close(sig_fd);
+	close(basis_fd);
 }
 
-int csync_rs_patch(const char *filename)
+#define SHA256_LEN 32
+
+/*
+ * Whole file digest for the DIGEST command, as "sha256 <hex>", or "-" if
+ * there is no regular file. Cached in the signature cache.
+ * Return: 0, or -1 on error.
+ */
+int csync_rs_digest(const char *filename, int isreg, char *digest, size_t size)
+{
+#ifdef HAVE_LIBGNUTLS
+	struct csync_sig_params params = { CSYNC_DIGEST_SHA256, 0, 0 };
+	unsigned char md[SHA256_LEN];
+	char buffer[RS_JOB_BUFSIZE];
+	char tmpname[MAXPATHLEN];
+	struct stat st, st2;
+	gnutls_hash_hd_t hash;
+	long long len;
+	int fd, cfd, rc, i;
+
+	if (!isreg) {
+		snprintf(digest, size, "-");
+		return 0;
+	}
+	fd = csync_rs_open_basis(filename);
+	if (fd < 0) {
+		if (errno != ENOENT && errno != EINVAL)
+			return -1;
+		snprintf(digest, size, "-");
+		return 0;
+	}
+	if (fstat(fd, &st) < 0)
+		goto error;
+
+	cfd = csync_sigcache_lookup(&st, &params, &len);
+	if (cfd >= 0) {
+		rc = len == SHA256_LEN ? read(cfd, md, SHA256_LEN) : -1;
+		close(cfd);
+		if (rc == SHA256_LEN)
+			goto found;
+	}
+
+	if (gnutls_hash_init(&hash, GNUTLS_DIG_SHA256) < 0) {
+		errno = ENOSYS;
+		goto error;
+	}
+	while ((rc = csync_rs_read_fd(&fd, buffer, sizeof(buffer))) > 0)
+		gnutls_hash(hash, buffer, rc);
+	gnutls_hash_deinit(hash, md);
+	if (rc < 0)
+		goto error;
+
+	/* do not cache the digest of a file which changed meanwhile */
+	if (fstat(fd, &st2) == 0 && same_version(&st, &st2)) {
+		cfd = csync_sigcache_create(tmpname);
+		if (cfd >= 0) {
+			if (write(cfd, md, SHA256_LEN) != SHA256_LEN)
+				csync_sigcache_abort(cfd, tmpname);
+			else if (!csync_sigcache_commit(cfd, tmpname, &st, &params, &len))
+				close(cfd);
+		}
+	}
+
+found:
+	close(fd);
+	rc = snprintf(digest, size, "sha256 ");
+	for (i = 0; i < SHA256_LEN && rc + 2 < size; i++)
+		rc += snprintf(digest + rc, size - rc, "%02x", md[i]);
+	return 0;
+
+error:
+	rc = errno;
+	close(fd);
+	errno = rc;
+	return -1;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* This is the signature for an "empty" file
+ * as returned by rs_sig_file(/dev/null). */
+static const char csync_empty_sig[12] = "rs\0016\000\000\010\000\000\000\000\010";
+
+struct csync_rs_compare {
+	struct csync_stream *peer;
+	int found_diff;
+};
+
+/* Compare our signature with the one from the peer, while it is created. */
+static int csync_rs_compare_sig(void *ctx, const char *buf, size_t len)
+{
+	struct csync_rs_compare *c = ctx;
+	char buffer[RS_JOB_BUFSIZE];
+	int rc;
+
+	while (len > 0) {
+		rc = csync_stream_read(c->peer, buffer, len > sizeof(buffer) ? sizeof(buffer) : len);
+		if (rc < 0)
+			return -1;
+		if (rc == 0) {
+			csync_debug(2, "Found EOF in peer sig.\n");
+			c->found_diff = 1;
+			return -1;
+		}
+		if (memcmp(buffer, buf, rc)) {
+			csync_debug(2, "Found diff in sig at %lld:%lld\n",
+					c->peer->total - rc, c->peer->total);
+			c->found_diff = 1;
+			/* no need to look at the rest */
+			return -1;
+		}
+		buf += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/*
+ * Pass the signature of the basis to out(), from the signature cache, or
+ * while creating it. The basis_fd is closed.
+ */
+static rs_result csync_rs_sig_to(int basis_fd,
+		int (*out)(void *ctx, const char *buf, size_t len), void *ctx)
+{
+	struct csync_sig_params params;
+	char buffer[RS_JOB_BUFSIZE];
+	long long sig_len;
+	int sig_fd, rc, backup_errno;
+	rs_job_t *job;
+	rs_result result = RS_DONE;
+
+	sig_fd = csync_rs_cached_sig(basis_fd, csync_conn_features, &sig_len);
+	if (sig_fd >= 0) {
+		while ((rc = csync_rs_read_fd(&sig_fd, buffer, sizeof(buffer))) != 0)
+			if (rc < 0 || out(ctx, buffer, rc) < 0) {
+				result = RS_IO_ERROR;
+				break;
+			}
+		backup_errno = errno;
+		close(sig_fd);
+	} else {
+		csync_rs_basis_params(basis_fd, &params, csync_conn_features);
+		job = csync_rs_sig_begin(&params);
+		result = csync_rs_run_job(job, csync_rs_read_fd, &basis_fd, out, ctx);
+		backup_errno = errno;
+		rs_job_free(job);
+	}
+	close(basis_fd);
+	errno = backup_errno;
+	return result;
+}
+
+/*
+ * Compare the signature from a SIG response with ours. If the caller
+ * already knows the file is different (known_diff), ours is not needed.
+ * Return: 1 if they differ, 0 if they are equal, -1 on error.
+ */
+int csync_rs_check(const char *filename, int isreg, int known_diff)
 {
-	FILE *basis_file = 0, *delta_file = 0, *new_file = 0;
+	struct csync_stream peer;
+	struct csync_rs_compare c = { &peer, known_diff };
+	int basis_fd = -1;
 	int backup_errno;
-	rs_stats_t stats;
 	rs_result result;
-	char *errstr = "?";
-	char tmpfname[MAXPATHLEN], newfname[MAXPATHLEN];
+	char dummy;
 
-	csync_debug(3, "Csync2 / Librsync: csync_rs_patch('%s')\n", filename);
+	csync_debug(3, "Csync2 / Librsync: csync_rs_check('%s', %d [%s])\n",
+		    filename, isreg, isreg ? "regular file" : "non-regular file");
 
-	csync_debug(3, "Receiving delta_file from peer..\n");
-	delta_file = open_temp_file(tmpfname, prefixsubst(filename));
-	if ( !delta_file ) { errstr="creating delta temp file"; goto io_error; }
-	if (unlink(tmpfname) < 0) { errstr="removing delta temp file"; goto io_error; }
-	if ( csync_recv_file(delta_file) ) goto error;
+	csync_debug(3, "Reading signature header from peer....\n");
+	if (csync_recv_header(&peer) < 0)
+		goto io_error;
 
-	csync_debug(3, "Opening to be patched file on local host..\n");
-	basis_file = fopen(prefixsubst(filename), "rb");
-	if ( !basis_file ) {
-		basis_file = open_temp_file(tmpfname, prefixsubst(filename));
-		if ( !basis_file ) { errstr="opening data file for reading"; goto io_error; }
-		if (unlink(tmpfname) < 0) { errstr="removing data temp file"; goto io_error; }
+	if (isreg && !known_diff) {
+		basis_fd = csync_rs_open_basis(filename);
+		if (basis_fd < 0 && errno != ENOENT)
+			goto io_error;
 	}
 
-	csync_debug(3, "Opening temp file for new data on local host..\n");
-	new_file = open_temp_file(newfname, prefixsubst(filename));
-	if ( !new_file ) { errstr="creating new data temp file"; goto io_error; }
+	/* A missing or non-regular local file has an empty signature. */
+	if (basis_fd >= 0) {
+		result = csync_rs_sig_to(basis_fd, csync_rs_compare_sig, &c);
+		if (result != RS_DONE && !c.found_diff) {
+			if (result == RS_IO_ERROR)
+				goto io_error;
+			csync_debug(0, "Internal error from rsync library!\n");
+			goto error;
+		}
+	}
 
-	csync_debug(3, "Running rs_patch_file() from librsync..\n");
-	result = rs_patch_file(basis_file, delta_file, new_file, &stats);
-	if (result != RS_DONE) {
-		csync_debug(0, "Internal error from rsync library!\n");
-		goto error;
+	if (!c.found_diff && csync_stream_read(&peer, &dummy, 1) != 0) {
+		csync_debug(2, "Peer sig is longer than local sig (%lld bytes).\n",
+				peer.total - 1);
+		c.found_diff = 1;
 	}
 
-	csync_debug(3, "Renaming tmp file to data file..\n");
-	fclose(basis_file);
-	basis_file = NULL;
+	if (csync_stream_drain(&peer) < 0)
+		goto io_error;
 
-#ifdef __CYGWIN__
+	csync_debug(3, "File has been checked successfully (%s).\n", c.found_diff ? "difference found" : "files are equal");
+	return c.found_diff;
 
-/* TODO: needed? */
-	// This creates the file using the native windows API, bypassing
-	// the cygwin wrappers and so making sure that we do not mess up the
-	// permissions..
-	{
-		char winfilename[MAX_PATH];
-		HANDLE winfh;
+io_error:
+	csync_debug(0, "I/O Error '%s' in rsync-check: %s\n", strerror(errno), prefixsubst(filename));
+error:
+	backup_errno = errno;
 
-		cygwin_conv_to_win32_path(prefixsubst(filename), winfilename);
+	/* drain response */
+	csync_stream_drain(&peer);
 
-		winfh = CreateFile(TEXT(winfilename),
-				GENERIC_WRITE,          // open for writing
-				0,                      // do not share
-				NULL,                   // default security
-				CREATE_ALWAYS,          // overwrite existing
-				FILE_ATTRIBUTE_NORMAL | // normal file
-				FILE_FLAG_OVERLAPPED,   // asynchronous I/O
-				NULL);                  // no attr. template
+	errno = backup_errno;
+	return -1;
+}
 
-		if (winfh == INVALID_HANDLE_VALUE) {
-			csync_debug(0, "Win32 I/O Error %d in rsync-patch: %s\n",
-					(int)GetLastError(), winfilename);
-			errno = EACCES;
-			goto error;
+/*
+ * Instead of the signature itself, SIGLIST sends its length (8 bytes, in
+ * network byte order) and the MD4 digest of every CSYNC_SIGLIST_CHUNK
+ * bytes of it. The peer compares them with its own signature while it is
+ * created, from memory, and stops at the first difference.
+ */
+#define CSYNC_SIGLIST_CHUNK 65536
+#define MD4_LEN 16
+
+struct csync_siglist {
+	rs_mdfour_t md;
+	size_t fill;			/* bytes in the current chunk */
+	long long len;			/* of the signature */
+	unsigned char *list;		/* the digests */
+	int n, alloc;
+	const unsigned char *peer;	/* if set, compare with these */
+	int peer_n;
+	int found_diff;
+};
+
+static int csync_siglist_chunk_done(struct csync_siglist *l)
+{
+	unsigned char md[MD4_LEN];
+
+	rs_mdfour_result(&l->md, md);
+	rs_mdfour_begin(&l->md);
+	l->fill = 0;
+
+	if (l->peer) {
+		if (l->n >= l->peer_n || memcmp(md, l->peer + l->n * MD4_LEN, MD4_LEN)) {
+			csync_debug(2, "Found diff in sig chunk %d.\n", l->n);
+			l->found_diff = 1;
+			/* no need to look at the rest */
+			return -1;
 		}
-		CloseHandle(winfh);
-		goto copy;
+	} else {
+		if (l->n == l->alloc) {
+			l->alloc = l->alloc ? l->alloc * 2 : 64;
+			l->list = realloc(l->list, l->alloc * MD4_LEN);
+		}
+		memcpy(l->list + l->n * MD4_LEN, md, MD4_LEN);
 	}
-#endif
+	l->n++;
+	return 0;
+}
+
+static int csync_siglist_add(void *ctx, const char *buf, size_t len)
+{
+	struct csync_siglist *l = ctx;
+	size_t n;
+
+	while (len > 0) {
+		n = MIN(len, CSYNC_SIGLIST_CHUNK - l->fill);
+		rs_mdfour_update(&l->md, buf, n);
+		l->fill += n;
+		l->len += n;
+		buf += n;
+		len -= n;
+		if (l->fill == CSYNC_SIGLIST_CHUNK && csync_siglist_chunk_done(l) < 0)
+			return -1;
+	}
+	return 0;
+}
 
-	clone_ownership_and_permissions(newfname, prefixsubst(filename));
+static int csync_siglist_finish(struct csync_siglist *l)
+{
+	return l->fill ? csync_siglist_chunk_done(l) : 0;
+}
 
-	if (rename(newfname, prefixsubst(filename))) {
-		char buffer[512];
-		int rc;
+void csync_rs_siglist(const char *filename)
+{
+	struct csync_siglist l;
+	unsigned char len[8];
+	int basis_fd, i;
 
-		if (errno != EXDEV) {
-			errstr="renaming tmp file to to be patched file";
+	csync_debug(3, "Csync2 / Librsync: csync_rs_siglist('%s')\n", filename);
+
+	memset(&l, 0, sizeof(l));
+	rs_mdfour_begin(&l.md);
+
+	basis_fd = csync_rs_open_basis(filename);
+	if (basis_fd < 0) {
+		if (errno != ENOENT)
 			goto io_error;
-		}
-#ifdef __CYGWIN__
-copy:
-#endif
-		csync_debug(1, "rename not possible! Will truncate and copy instead.\n");
-		basis_file = fopen(prefixsubst(filename), "wb");
-		if ( !basis_file ) {
-			errstr="opening data file for writing";
+		csync_siglist_add(&l, csync_empty_sig, sizeof(csync_empty_sig));
+	} else if (csync_rs_sig_to(basis_fd, csync_siglist_add, &l) != RS_DONE)
+		goto io_error;
+	csync_siglist_finish(&l);
+
+	for (i = 0; i < 8; i++)
+		len[i] = l.len >> (56 - 8 * i);
+	conn_printf("octet-stream %d\n", 8 + l.n * MD4_LEN);
+	conn_write(len, 8);
+	conn_write(l.list, l.n * MD4_LEN);
+	free(l.list);
+	csync_debug(3, "Signature digests have been successfully sent.\n");
+	return;
+
+io_error:
+	csync_debug(0, "I/O Error '%s' in rsync-siglist: %s\n",
+			strerror(errno), prefixsubst(filename));
+	conn_printf("octet-stream -1\n");
+	free(l.list);
+}
+
+/*
+ * Like csync_rs_check(), for a SIGLIST response.
+ * Return: 1 if they differ, 0 if they are equal, -1 on error.
+ */
+int csync_rs_check_siglist(const char *filename, int isreg, int known_diff)
+{
+	struct csync_stream peer;
+	struct csync_siglist l;
+	unsigned char *list = NULL;
+	long long peer_len = 0;
+	int basis_fd = -1, rc, i;
+	rs_result result;
+
+	csync_debug(3, "Csync2 / Librsync: csync_rs_check_siglist('%s', %d)\n",
+			filename, isreg);
+
+	if (csync_recv_header(&peer) < 0)
+		goto io_error;
+	if (peer.type != STREAM_OCTET || peer.left > INT_MAX) {
+		errno = EIO;
+		goto io_error;
+	}
+	list = malloc(peer.left + 1);
+	while ((rc = csync_stream_read(&peer, (char *)list + peer.total, peer.left)) > 0)
+		;
+	if (rc < 0)
+		goto io_error;
+
+	memset(&l, 0, sizeof(l));
+	rs_mdfour_begin(&l.md);
+	if (peer.total >= 8) {
+		for (i = 0; i < 8; i++)
+			peer_len = (peer_len << 8) | list[i];
+		l.peer = list + 8;
+		l.peer_n = (peer.total - 8) / MD4_LEN;
+	}
+	l.found_diff = known_diff;
+
+	if (isreg && !known_diff) {
+		basis_fd = csync_rs_open_basis(filename);
+		if (basis_fd < 0 && errno != ENOENT)
 			goto io_error;
-		}
+	}
 
-		/* FIXME
-		 * Can easily lead to partially transfered files on the receiving side!
-		 * Think truncate, then connection loss.
-		 * Or any other failure scenario.
-		 * Need better error checks!
-		 */
-		rewind(new_file);
-		while ( (rc = fread(buffer, 1, 512, new_file)) > 0
-			&& fwrite(buffer, 1, rc, basis_file) == rc )
-			;
-		/* at least retain the temp file, if something went wrong. */
-		if (ferror(new_file) || ferror(basis_file)) {
-			csync_debug(0, "ERROR while copying temp file '%s' to basis file '%s'; "
-					"basis file may be corrupted; temp file has been retained.\n",
-					newfname, prefixsubst(filename));
+	/* A missing or non-regular local file has an empty signature. */
+	if (basis_fd >= 0) {
+		/* without a list from the peer, we do not get far */
+		if (!l.peer)
+			l.peer = list;
+		result = csync_rs_sig_to(basis_fd, csync_siglist_add, &l);
+		if (result != RS_DONE && !l.found_diff) {
+			if (result == RS_IO_ERROR)
+				goto io_error;
+			csync_debug(0, "Internal error from rsync library!\n");
 			goto error;
 		}
-		unlink(newfname);
-		fclose(basis_file);
-		basis_file = NULL;
+		if (!l.found_diff)
+			csync_siglist_finish(&l);
 	}
 
-	csync_debug(3, "File has been patched successfully.\n");
-	fclose(delta_file);
-	fclose(new_file);
+	if (!l.found_diff && (l.len != peer_len || l.n != l.peer_n)) {
+		csync_debug(2, "Peer sig has a different length (%lld, local %lld bytes).\n",
+				peer_len, l.len);
+		l.found_diff = 1;
+	}
 
-	return 0;
+	free(list);
+	csync_debug(3, "File has been checked successfully (%s).\n", l.found_diff ? "difference found" : "files are equal");
+	return l.found_diff;
 
 io_error:
-	backup_errno = errno;
-	csync_debug(0, "I/O Error '%s' while %s in rsync-patch: %s\n",
-			strerror(errno), errstr, prefixsubst(filename));
-	errno = backup_errno;
-error:;
-	backup_errno = errno;
-	if ( delta_file ) fclose(delta_file);
-	if ( basis_file ) fclose(basis_file);
-	if ( new_file )   fclose(new_file);
-	errno = backup_errno;
+	csync_debug(0, "I/O Error '%s' in rsync-check: %s\n", strerror(errno), prefixsubst(filename));
+error:
+	rc = errno;
+	csync_stream_drain(&peer);
+	free(list);
+	errno = rc;
 	return -1;
 }
 
+void csync_rs_sig(const char *filename)
+{
+	struct csync_sig_params params;
+	char tmpfname[MAXPATHLEN];
+	FILE *sig_file;
+	rs_job_t *job;
+	rs_result result;
+	long long sig_len;
+	int basis_fd, sig_fd;
+
+	csync_debug(3, "Csync2 / Librsync: csync_rs_sig('%s')\n", filename);
+
+	basis_fd = csync_rs_open_basis(filename);
+	if (basis_fd < 0) {
+		if (errno == ENOENT)
+			goto empty_sig;
+		goto io_error;
+	}
+
+	sig_fd = csync_rs_cached_sig(basis_fd, csync_conn_features, &sig_len);
+	if (sig_fd >= 0) {
+		close(basis_fd);
+		conn_printf("octet-stream %lld\n", sig_len);
+		if (conn_sendfile(sig_fd, sig_len))
+			csync_fatal("Error '%s' while sending data.\n", strerror(errno));
+		close(sig_fd);
+		csync_debug(3, "Signature has been successfully sent.\n");
+		return;
+	}
+
+	csync_rs_basis_params(basis_fd, &params, csync_conn_features);
+	job = csync_rs_sig_begin(&params);
+
+	if (csync_conn_features & CSYNC_FEATURE_STREAM) {
+		conn_printf("chunked-stream\n");
+		result = csync_rs_run_job(job, csync_rs_read_fd, &basis_fd,
+				csync_stream_write, NULL);
+		rs_job_free(job);
+		close(basis_fd);
+
+		if (result != RS_DONE) {
+			csync_debug(0, "Error '%s' from librsync in rsync-sig: %s\n",
+					rs_strerror(result), prefixsubst(filename));
+			conn_printf("-1\n");
+			return;
+		}
+		conn_printf("0\n");
+		csync_debug(3, "Signature has been successfully sent.\n");
+		return;
+	}
+
+	/* The peer needs to know the size in advance. */
+	sig_file = open_temp_file(tmpfname, prefixsubst(filename));
+	if (!sig_file || unlink(tmpfname) < 0) {
+		rs_job_free(job);
+		close(basis_fd);
+		if (sig_file)
+			fclose(sig_file);
+		goto io_error;
+	}
+
+	csync_debug(3, "Running rs_sig_begin() from librsync....\n");
+	result = csync_rs_run_job(job, csync_rs_read_fd, &basis_fd,
+			csync_rs_write_file, sig_file);
+	rs_job_free(job);
+	close(basis_fd);
+	if (result != RS_DONE)
+		csync_fatal("Got an error from librsync, too bad!\n");
+
+	csync_debug(3, "Sending sig_file to peer..\n");
+	csync_send_file(sig_file, -1);
+	fclose(sig_file);
+	csync_debug(3, "Signature has been successfully sent.\n");
+	return;
+
+empty_sig:
+	/* No point in re-calculating it over and over again. */
+	conn_printf("octet-stream %d\n", (int)sizeof(csync_empty_sig));
+	conn_write(csync_empty_sig, sizeof(csync_empty_sig));
+	csync_debug(3, "Signature has been successfully sent.\n");
+	return;
+
+io_error:
+	csync_debug(0, "I/O Error '%s' in rsync-sig: %s\n",
+			strerror(errno), prefixsubst(filename));
+
+	/* FIXME.
+	 * Peer expected some sort of sig,
+	 * we need to communicate an error instead. */
+	conn_printf("octet-stream -1\n");
+}
+
+
+
+/*
+ * Large files are handled in segments of rsync-segment-size megabytes, if
+ * the peer supports it (CSYNC_FEATURE_SEGMENTS): each segment of the basis
+ * gets its own signature, and each segment of the new file is sent as a
+ * delta against the signature of the basis segment at the same offset, or
+ * as raw-stream beyond the end of the basis. This way the signatures and
+ * deltas of the segments can be created by a pool of threads. They are
+ * written to temp files and sent in order; at most two per thread are
+ * waiting to be sent at any time.
+ */
+struct csync_segment {
+	off_t offset, len;
+	off_t sig_offset, sig_len;	/* the signature of the basis segment,
+					 * in csync_segments.sigs (delta) */
+	FILE *out;		/* the signature or delta to send */
+	int done;
+	rs_result result;
+};
+
+struct csync_segments {
+	int fd;			/* the basis (signature) or new file (delta) */
+	char *path;		/* for temp file names */
+	struct csync_sig_params params;
+	FILE *sigs;		/* the received signatures (delta) */
+	struct csync_segment *seg;
+	int count;		/* segments of the file */
+	int jobs;		/* segments to be done by the threads */
+	rs_result (*work)(struct csync_segments *s, struct csync_segment *seg);
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads, window;
+	int next;		/* the next job to be taken by a thread */
+	int admitted;		/* jobs which may be taken */
+	int stop;
+};
+
+/* A part of a file, read with pread(), so threads can share the fd. */
+struct csync_range {
+	int fd;
+	off_t pos, end;
+};
+
+static int csync_rs_read_range(void *ctx, char *buf, size_t len)
+{
+	struct csync_range *r = ctx;
+	ssize_t rc;
+
+	if ( len > r->end - r->pos )
+		len = r->end - r->pos;
+	if ( len == 0 )
+		return 0;
+	do {
+		rc = pread(r->fd, buf, len, r->pos);
+	} while ( rc < 0 && errno == EINTR );
+	if ( rc > 0 )
+		r->pos += rc;
+	return rc;
+}
+
+static rs_result csync_segment_sig(struct csync_segments *s, struct csync_segment *seg)
+{
+	struct csync_range r = { s->fd, seg->offset, seg->offset + seg->len };
+	rs_job_t *job;
+	rs_result result;
+
+	job = csync_rs_sig_begin(&s->params);
+	result = csync_rs_run_job(job, csync_rs_read_range, &r,
+			csync_rs_write_file, seg->out);
+	rs_job_free(job);
+	return result;
+}
+
+static rs_result csync_segment_delta(struct csync_segments *s, struct csync_segment *seg)
+{
+	struct csync_range r = { s->fd, seg->offset, seg->offset + seg->len };
+	struct csync_range sig = { fileno(s->sigs), seg->sig_offset,
+		seg->sig_offset + seg->sig_len };
+	rs_signature_t *sumset = NULL;
+	rs_job_t *job;
+	rs_result result;
+
+	job = rs_loadsig_begin(&sumset);
+	result = csync_rs_run_job(job, csync_rs_read_range, &sig, NULL, NULL);
+	rs_job_free(job);
+	if ( result == RS_DONE )
+		result = rs_build_hash_table(sumset);
+	if ( result == RS_DONE ) {
+		job = rs_delta_begin(sumset);
+		result = csync_rs_run_job(job, csync_rs_read_range, &r,
+				csync_rs_write_file, seg->out);
+		rs_job_free(job);
+	}
+	if ( sumset )
+		rs_free_sumset(sumset);
+	return result;
+}
+
+static void *csync_segments_thread(void *arg)
+{
+	struct csync_segments *s = arg;
+	struct csync_segment *seg;
+	rs_result result;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while ( !s->stop && s->next == s->admitted && s->next < s->jobs )
+			pthread_cond_wait(&s->cond, &s->lock);
+		if ( s->stop || s->next >= s->jobs )
+			break;
+		seg = &s->seg[s->next++];
+		pthread_mutex_unlock(&s->lock);
+
+		result = s->work(s, seg);
+
+		pthread_mutex_lock(&s->lock);
+		seg->result = result;
+		seg->done = 1;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static void csync_segments_init(struct csync_segments *s, int fd,
+		const char *filename, off_t size, off_t segment_size)
+{
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->path = strdup(prefixsubst(filename));
+	s->count = size ? (size + segment_size - 1) / segment_size : 1;
+	s->seg = calloc(s->count, sizeof(*s->seg));
+	for (i = 0; i < s->count; i++) {
+		s->seg[i].offset = i * segment_size;
+		s->seg[i].len = MIN(segment_size, size - s->seg[i].offset);
+	}
+	s->jobs = s->count;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+}
+
+static void csync_segments_start(struct csync_segments *s)
+{
+	long n = csync_rsync_threads;
+	int i, rc;
+
+	if ( n <= 0 )
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	n = MAX(1, MIN(n, s->jobs));
+
+	s->threads = calloc(n, sizeof(*s->threads));
+	for (i = 0; i < n; i++) {
+		rc = pthread_create(&s->threads[i], NULL, csync_segments_thread, s);
+		if ( rc ) {
+			csync_debug(1, "Can not create thread: %s\n", strerror(rc));
+			break;
+		}
+	}
+	s->nthreads = i;
+	s->window = 2 * MAX(1, s->nthreads);
+	csync_debug(3, "Processing %d segments with %d threads.\n", s->jobs, s->nthreads);
+}
+
+/* Let the threads take the jobs up to limit. */
+static int csync_segments_admit(struct csync_segments *s, int limit)
+{
+	char tmpfname[MAXPATHLEN];
+	struct csync_segment *seg;
+
+	limit = MIN(limit, s->jobs);
+	while ( s->admitted < limit ) {
+		seg = &s->seg[s->admitted];
+		seg->out = open_temp_file(tmpfname, s->path);
+		if ( !seg->out )
+			return -1;
+		unlink(tmpfname);
+
+		pthread_mutex_lock(&s->lock);
+		s->admitted++;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+	return 0;
+}
+
+static rs_result csync_segments_wait(struct csync_segments *s, int i)
+{
+	struct csync_segment *seg = &s->seg[i];
+
+	/* no threads at all: do it ourselves */
+	if ( !s->nthreads && !seg->done ) {
+		seg->result = s->work(s, seg);
+		seg->done = 1;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	while ( !seg->done )
+		pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+	return seg->result;
+}
+
+static void csync_segments_stop(struct csync_segments *s)
+{
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	for (i = 0; i < s->nthreads; i++)
+		pthread_join(s->threads[i], NULL);
+
+	for (i = 0; i < s->count; i++)
+		if ( s->seg[i].out )
+			fclose(s->seg[i].out);
+	if ( s->sigs )
+		fclose(s->sigs);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s->threads);
+	free(s->seg);
+	free(s->path);
+}
+
+/* The signature for PATCH: in segments, if the basis is large enough. */
+void csync_rs_patch_sig(const char *filename)
+{
+	off_t segment_size = (off_t)csync_rsync_segment_size << 20;
+	struct csync_segments s;
+	struct stat st;
+	int basis_fd, i;
+
+	if ( !(csync_conn_features & CSYNC_FEATURE_SEGMENTS) )
+		goto whole;
+	basis_fd = csync_rs_open_basis(filename);
+	if ( basis_fd < 0 )
+		goto whole;
+	if ( fstat(basis_fd, &st) < 0 || st.st_size <= segment_size ) {
+		close(basis_fd);
+		goto whole;
+	}
+
+	csync_debug(3, "Csync2 / Librsync: csync_rs_patch_sig('%s')\n", filename);
+	csync_segments_init(&s, basis_fd, filename, st.st_size, segment_size);
+	csync_rs_sig_params(&s.params, segment_size, csync_conn_features);
+	s.work = csync_segment_sig;
+	csync_segments_start(&s);
+
+	conn_printf("segmented-stream %lld %d\n", (long long)segment_size, s.count);
+	for (i = 0; i < s.count; i++) {
+		if ( csync_segments_admit(&s, i + s.window) < 0 ||
+		     csync_segments_wait(&s, i) != RS_DONE ) {
+			csync_debug(0, "Error in segment %d of rsync-sig: %s\n",
+					i, prefixsubst(filename));
+			conn_printf("octet-stream -1\n");
+			break;
+		}
+		csync_send_file(s.seg[i].out, -1);
+		fclose(s.seg[i].out);
+		s.seg[i].out = NULL;
+	}
+
+	csync_segments_stop(&s);
+	close(basis_fd);
+	csync_debug(3, "Signature has been successfully sent.\n");
+	return;
+
+whole:
+	csync_rs_sig(filename);
+}
+
+/* Receive the segmented signature in sig, and send the delta in segments. */
+static int csync_rs_delta_segments(const char *filename, struct csync_stream *sig)
+{
+	struct csync_segments s;
+	struct csync_stream seg;
+	char tmpfname[MAXPATHLEN];
+	struct stat st;
+	int new_fd, i, nsigs = sig->left;
+
+	csync_debug(3, "Opening new_file..\n");
+	new_fd = open(prefixsubst(filename), O_RDONLY);
+	if ( new_fd < 0 || fstat(new_fd, &st) < 0 ) {
+		int backup_errno = errno;
+		const char *errstr = strerror(errno);
+		csync_debug(0, "I/O Error '%s' while %s in rsync-delta: %s\n",
+				errstr, "opening data file for reading", filename);
+		csync_segmented_drain(sig, NULL);
+		conn_printf("octet-stream -1\n");
+		if ( new_fd >= 0 )
+			close(new_fd);
+		errno = backup_errno;
+		return -1;
+	}
+
+	csync_segments_init(&s, new_fd, filename, st.st_size, sig->segment_size);
+	s.jobs = MIN(s.count, nsigs);
+	s.work = csync_segment_delta;
+	csync_segments_start(&s);
+
+	s.sigs = open_temp_file(tmpfname, s.path);
+	if ( !s.sigs ) {
+		csync_segmented_drain(sig, NULL);
+		goto sig_error;
+	}
+	unlink(tmpfname);
+
+	/* The threads start on the first segments while we receive the rest. */
+	csync_debug(3, "Receiving %d signature segments from peer..\n", nsigs);
+	for (i = 0; i < nsigs; i++) {
+		sig->left--;
+		if ( csync_recv_header(&seg) < 0 )
+			goto sig_error;
+		if ( i >= s.jobs ) {
+			if ( csync_stream_drain(&seg) < 0 )
+				goto sig_error;
+			continue;
+		}
+		fseek(s.sigs, 0, SEEK_END);
+		s.seg[i].sig_offset = ftell(s.sigs);
+		if ( csync_recv_data(s.sigs, &seg) < 0 )
+			goto sig_error;
+		fseek(s.sigs, 0, SEEK_END);
+		s.seg[i].sig_len = ftell(s.sigs) - s.seg[i].sig_offset;
+		if ( csync_segments_admit(&s, MIN(i + 1, s.window)) < 0 ) {
+			csync_segmented_drain(sig, NULL);
+			goto sig_error;
+		}
+	}
+
+	csync_debug(3, "Sending delta segments to peer..\n");
+	if ( csync_size_hint(st.st_size) >= 0 )
+		conn_printf("segmented-stream %lld %d %lld\n", sig->segment_size,
+				s.count, (long long)st.st_size);
+	else
+		conn_printf("segmented-stream %lld %d\n", sig->segment_size, s.count);
+	for (i = 0; i < s.count; i++) {
+		if ( i >= s.jobs ) {
+			/* beyond the end of the basis */
+			if ( lseek(new_fd, s.seg[i].offset, SEEK_SET) < 0 )
+				goto io_error;
+			if ( csync_send_raw(new_fd, s.seg[i].len) < 0 )
+				goto sent_error;
+			continue;
+		}
+		if ( csync_segments_admit(&s, i + s.window) < 0 ||
+		     csync_segments_wait(&s, i) != RS_DONE )
+			goto io_error;
+		csync_send_file(s.seg[i].out, -1);
+		fclose(s.seg[i].out);
+		s.seg[i].out = NULL;
+	}
+
+	csync_debug(3, "Delta has been created successfully.\n");
+	csync_segments_stop(&s);
+	close(new_fd);
+	return 0;
+
+io_error:
+	csync_debug(0, "Error in segment %d of rsync-delta: %s\n",
+			i, prefixsubst(filename));
+	conn_printf("octet-stream -1\n");
+sent_error:
+	csync_segments_stop(&s);
+	close(new_fd);
+	errno = EIO;
+	return -1;
+
+sig_error:
+	conn_printf("octet-stream -1\n");
+	csync_segments_stop(&s);
+	close(new_fd);
+	errno = EIO;
+	return -1;
+}
+
+/*
+ * The size of the basis a signature has been made of, as far as it can be
+ * told: number of blocks times block length.
+ */
+static long long csync_sig_basis_size(struct csync_stream *sig)
+{
+	unsigned long block_len, strong_len;
+
+	if ( sig->total <= sizeof(sig->head) )
+		return 0;
+	/* magic, block length and strong sum length, in network byte order */
+	block_len = (sig->head[4] << 24) | (sig->head[5] << 16) |
+		(sig->head[6] << 8) | sig->head[7];
+	strong_len = (sig->head[8] << 24) | (sig->head[9] << 16) |
+		(sig->head[10] << 8) | sig->head[11];
+	return (sig->total - sizeof(sig->head)) / (4 + strong_len) * block_len;
+}
+
+int csync_rs_delta(const char *filename)
+{
+	FILE *delta_file = 0;
+	struct csync_stream sig;
+	rs_job_t *job;
+	rs_result result;
+	rs_signature_t *sumset = NULL;
+	char tmpfname[MAXPATHLEN];
+	struct stat st;
+	int new_fd = -1, type, rc;
+
+	csync_debug(3, "Csync2 / Librsync: csync_rs_delta('%s')\n", filename);
+
+	csync_debug(3, "Receiving signature from peer..\n");
+	type = csync_recv_header(&sig);
+	if ( type < 0 )
+		return -1;
+	if ( type == STREAM_SEGMENTED )
+		return csync_rs_delta_segments(filename, &sig);
+
+	job = rs_loadsig_begin(&sumset);
+	result = csync_rs_run_job(job, csync_rs_read_stream, &sig, NULL, NULL);
+	rs_job_free(job);
+	if ( csync_stream_drain(&sig) < 0 ) {
+		if ( sumset )
+			rs_free_sumset(sumset);
+		errno = EIO;
+		return -1;
+	}
+
+	csync_debug(3, "Opening new_file..\n");
+	new_fd = open(prefixsubst(filename), O_RDONLY);
+	if ( new_fd < 0 || fstat(new_fd, &st) < 0 ) {
+		int backup_errno = errno;
+		const char *errstr = strerror(errno);
+		csync_debug(0, "I/O Error '%s' while %s in rsync-delta: %s\n",
+				errstr, "opening data file for reading", filename);
+		conn_printf("%s\n", errstr);
+		if ( sumset )
+			rs_free_sumset(sumset);
+		if ( new_fd >= 0 )
+			close(new_fd);
+		errno = backup_errno;
+		return -1;
+	}
+
+	/* The signature of an empty (or missing) basis is just a header, and
+	 * if the basis is much smaller than the file, the delta will be mostly
+	 * literal data anyways. Send the whole file then. */
+	if ( (csync_conn_features & CSYNC_FEATURE_RAW) &&
+	     csync_sig_basis_size(&sig) * 8 <= st.st_size ) {
+		if ( sumset )
+			rs_free_sumset(sumset);
+		rc = csync_send_raw(new_fd, st.st_size);
+		close(new_fd);
+		return rc;
+	}
+
+	if (result != RS_DONE)
+		csync_fatal("Got an error from librsync, too bad!\n");
+
+	csync_debug(3, "Running rs_build_hash_table() from librsync..\n");
+	result = rs_build_hash_table(sumset);
+	if (result != RS_DONE)
+		csync_fatal("Got an error from librsync, too bad!\n");
+
+	if (csync_conn_features & CSYNC_FEATURE_STREAM) {
+		csync_debug(3, "Sending delta to peer while creating it..\n");
+		if (csync_size_hint(st.st_size) >= 0)
+			conn_printf("chunked-stream %lld\n", (long long)st.st_size);
+		else
+			conn_printf("chunked-stream\n");
+		job = rs_delta_begin(sumset);
+		result = csync_rs_run_job(job, csync_rs_read_fd, &new_fd,
+				csync_stream_write, NULL);
+		rs_job_free(job);
+		if (result != RS_DONE) {
+			conn_printf("-1\n");
+			goto io_error;
+		}
+		conn_printf("0\n");
+	} else {
+		delta_file = open_temp_file(tmpfname, prefixsubst(filename));
+		if ( !delta_file ) goto io_error;
+		if (unlink(tmpfname) < 0) goto io_error;
+
+		csync_debug(3, "Running rs_delta_begin() from librsync..\n");
+		job = rs_delta_begin(sumset);
+		result = csync_rs_run_job(job, csync_rs_read_fd, &new_fd,
+				csync_rs_write_file, delta_file);
+		rs_job_free(job);
+		if (result != RS_DONE)
+			csync_fatal("Got an error from librsync, too bad!\n");
+
+		csync_debug(3, "Sending delta_file to peer..\n");
+		csync_send_file(delta_file, csync_size_hint(st.st_size));
+		fclose(delta_file);
+	}
+
+	csync_debug(3, "Delta has been created successfully.\n");
+	rs_free_sumset(sumset);
+	close(new_fd);
+
+	return 0;
+
+io_error:
+	csync_debug(0, "I/O Error '%s' in rsync-delta: %s\n",
+			strerror(errno), prefixsubst(filename));
+
+	rs_free_sumset(sumset);
+	if (new_fd >= 0) close(new_fd);
+	if (delta_file) fclose(delta_file);
+
+	return -1;
+}
+
+/*
+ * Open a file for the new version of fname in the same directory, so it
+ * can be renamed into place: an unnamed O_TMPFILE, if the filesystem
+ * supports it, which is only linked to a name once it is complete (see
+ * csync_link_tmpfile()); newfname is empty then. Otherwise a temp file.
+ */
+static FILE *open_install_file(char *newfname, const char *fname)
+{
+	FILE *f;
+	int fd = -1;
+
+#ifdef O_TMPFILE
+	char dir[MAXPATHLEN];
+
+	split_dirname_basename(dir, NULL, fname);
+	fd = open(dir[0] ? dir : ".", O_TMPFILE | O_RDWR, S_IRUSR|S_IWUSR);
+	if (fd >= 0)
+		newfname[0] = 0;
+	else
+		csync_debug(3, "Can not use O_TMPFILE in %s: %s\n", dir, strerror(errno));
+#endif
+	if (fd < 0) {
+		if (!get_tmpname(newfname, NULL, fname))
+			return NULL;
+		fd = do_mkstemp(newfname, S_IRUSR|S_IWUSR);
+		if (fd < 0) {
+			csync_debug(3, "mkstemp %s failed: %s\n", newfname, strerror(errno));
+			return NULL;
+		}
+	}
+
+	f = fdopen(fd, "wb+");
+	if (!f) {
+		close(fd);
+		if (newfname[0])
+			unlink(newfname);
+	}
+	return f;
+}
+
+/* Where the new version of fname is written to while receiving it. */
+static FILE *open_new_file(char *newfname, const char *fname)
+{
+	FILE *f = open_install_file(newfname, fname);
+
+	return f ? f : open_temp_file(newfname, fname);
+}
+
+/* Give an O_TMPFILE a temporary name next to fname, to rename it from. */
+static int csync_link_tmpfile(int fd, char *newfname, const char *fname)
+{
+	char proc[64];
+	int i;
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	for (i = 0; i < 100; i++) {
+		if (!get_tmpname(newfname, NULL, fname))
+			break;
+		/* fill in the XXXXXX of the template */
+		snprintf(newfname + strlen(newfname) - 6, 7, "%06lx",
+				(random() ^ getpid()) & 0xffffff);
+		if (!linkat(AT_FDCWD, proc, AT_FDCWD, newfname, AT_SYMLINK_FOLLOW))
+			return 0;
+		if (errno != EEXIST)
+			break;
+	}
+	newfname[0] = 0;
+	return -1;
+}
+
+/*
+ * Allocate the space for the new file in advance, if we know its size,
+ * so large files do not end up fragmented.
+ */
+static void csync_preallocate(FILE *f, long long size)
+{
+#ifdef HAVE_FALLOCATE
+	if (size > 0 && fallocate(fileno(f), FALLOC_FL_KEEP_SIZE, 0, size) < 0)
+		csync_debug(3, "Can not preallocate %lld bytes: %s\n", size, strerror(errno));
+#endif
+}
+
+/*
+ * Copy the contents of fd_in, from the start, to the empty file fd_out.
+ * Where the filesystem supports it, FICLONE shares the data blocks instead
+ * of copying them at all; otherwise copy_file_range() lets the kernel do
+ * it without passing the data through user space.
+ * Return: 0, or -1 on error.
+ */
+int csync_copy_data(int fd_in, int fd_out)
+{
+	char buffer[RS_JOB_BUFSIZE];
+	ssize_t rc;
+
+#ifdef FICLONE
+	if (!ioctl(fd_out, FICLONE, fd_in))
+		return 0;
+#endif
+	if (lseek(fd_in, 0, SEEK_SET) < 0)
+		return -1;
+#ifdef HAVE_COPY_FILE_RANGE
+	do {
+		rc = copy_file_range(fd_in, NULL, fd_out, NULL, 1 << 30, 0);
+	} while (rc > 0 || (rc < 0 && errno == EINTR));
+	if (rc == 0)
+		return 0;
+	/* not for these files, or not by this kernel: go on ourselves */
+	if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+		return -1;
+#endif
+	while ((rc = csync_rs_read_fd(&fd_in, buffer, sizeof(buffer))) > 0)
+		if (csync_rs_write_fd(&fd_out, buffer, rc) < 0)
+			return -1;
+	return rc < 0 ? -1 : 0;
+}
+
+/* The "temporary" new file typically has been created as "-rw------- root:root".
+ * Before we rename it into place, "clone" the permissions and ownership of the
+ * old file to avoid files already with the "correct name", but root owned and
+ * unreadable by the applications, if even for a short time.
+ * If the old file does not exist (or cannot be stat()ed), ignore.
+ * If we cannot rename into place, but have to truncate/rewrite,
+ * we keep the existing file anyways, so no ownership/permission change happens.
+ * If permissions and/or ownership has also changed, in addition to
+ * content, those will be explicitly synced "soon".
+ * If there are errors while cloning the ownership or permissions, so what?
+ * Ignore, it stays at root:root 0600, and won't be worse than before.
+ *
+ * Can we do better?
+ * Until we change the ugly ad-hoc csync2 "protocol" to use "transaction" like
+ * semantics, and know all of the changed content, plus ownership, permissions,
+ * mtime, ACLs and other meta data as context information before starting to
+ * act on it on the receiving side, I don't see how.
+ */
+static void clone_ownership_and_permissions(int fd, const char *oldfname)
+{
+	struct stat sbuf;
+	int uid, gid;
+	if (stat(oldfname, &sbuf))
+		return; /* At least we tried */
+	uid = csync_ignore_uid ? -1 : sbuf.st_uid;
+	gid = csync_ignore_gid ? -1 : sbuf.st_gid;
+	csync_debug(3, "Cloning ownership and permissions to tmp file: 0o%03o %d:%d [%s]\n",
+			sbuf.st_mode, uid, gid, oldfname);
+	if (fchown(fd, uid, gid))
+		csync_debug(3, "Error '%s' for fchown(%d,%d) rsync-patch: %s\n",
+				strerror(errno), uid, gid, oldfname);
+	if (fchmod(fd, sbuf.st_mode))
+		csync_debug(3, "Error '%s' for fchmod(0o%03o) rsync-patch: %s\n",
+				strerror(errno), sbuf.st_mode, oldfname);
+
+	/* FIXME also "clone" acls;
+	 * as long as csync2 is no acl aware, there is no point, though */
+}
+
+/*
+ * The basis of a patch is mapped into memory, so librsync can copy from it
+ * without another round of buffering. If it cannot be mapped, we pread() it.
+ * A missing basis is treated as empty.
+ */
+struct csync_basis {
+	int fd;
+	off_t size;
+	char *map;
+	int sparse;		/* has fewer blocks allocated than its size needs */
+};
+
+static int csync_basis_open(struct csync_basis *b, const char *filename)
+{
+	struct stat st;
+
+	b->size = 0;
+	b->map = NULL;
+	b->sparse = 0;
+	b->fd = open(basis_path ? basis_path : prefixsubst(filename), O_RDONLY);
+	if (b->fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(b->fd, &st) < 0)
+		return -1;
+
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		b->size = st.st_size;
+		b->sparse = (long long)st.st_blocks * 512 < st.st_size;
+		b->map = mmap(NULL, b->size, PROT_READ, MAP_PRIVATE, b->fd, 0);
+		if (b->map == MAP_FAILED) {
+			csync_debug(3, "Can not mmap basis file (%s), using pread.\n",
+					strerror(errno));
+			b->map = NULL;
+		}
+	}
+	return 0;
+}
+
+static void csync_basis_close(struct csync_basis *b)
+{
+	if (b->map)
+		munmap(b->map, b->size);
+	if (b->fd >= 0)
+		close(b->fd);
+	b->map = NULL;
+	b->fd = -1;
+}
+
+static rs_result csync_basis_copy(void *opaque, rs_long_t pos, size_t *len, void **buf)
+{
+	struct csync_basis *b = opaque;
+	ssize_t rc;
+
+	if (b->map) {
+		if (pos < 0 || pos >= b->size)
+			return RS_INPUT_ENDED;
+		if (*len > b->size - pos)
+			*len = b->size - pos;
+		*buf = b->map + pos;
+		return RS_DONE;
+	}
+
+	if (b->fd < 0)
+		return RS_INPUT_ENDED;
+	do {
+		rc = pread(b->fd, *buf, *len, pos);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		return RS_IO_ERROR;
+	if (rc == 0)
+		return RS_INPUT_ENDED;
+	*len = rc;
+	return RS_DONE;
+}
+
+/* The part of the basis a segment of a segmented delta refers to. */
+struct csync_basis_range {
+	struct csync_basis *basis;
+	off_t offset, len;
+};
+
+static rs_result csync_basis_range_copy(void *opaque, rs_long_t pos, size_t *len, void **buf)
+{
+	struct csync_basis_range *r = opaque;
+
+	if (pos < 0 || pos >= r->len)
+		return RS_INPUT_ENDED;
+	if (*len > r->len - pos)
+		*len = r->len - pos;
+	return csync_basis_copy(r->basis, r->offset + pos, len, buf);
+}
+
+/*
+ * The output of a patch. If it is written sparse, blocks of zeros are not
+ * written but skipped, so they end up as holes in the new file.
+ */
+#define CSYNC_SPARSE_BLOCK 4096
+
+struct csync_patch_out {
+	FILE *f;
+	int sparse;
+	off_t pos;		/* in the file, where the next write goes */
+	off_t hole;		/* skipped before pos, not sought over yet */
+};
+
+static int csync_patch_out_flush(struct csync_patch_out *o)
+{
+	if ( o->hole && fseeko(o->f, o->hole, SEEK_CUR) < 0 )
+		return -1;
+	o->hole = 0;
+	return 0;
+}
+
+static int csync_rs_write_patch(void *ctx, const char *buf, size_t len)
+{
+	struct csync_patch_out *o = ctx;
+	size_t n, i;
+
+	if ( !o->sparse ) {
+		o->pos += len;
+		return csync_rs_write_file(o->f, buf, len);
+	}
+
+	while ( len > 0 ) {
+		/* up to the next block boundary of the file */
+		n = MIN(len, CSYNC_SPARSE_BLOCK - o->pos % CSYNC_SPARSE_BLOCK);
+		for (i = 0; i < n && !buf[i]; i++)
+			;
+		if ( i == n )
+			o->hole += n;
+		else if ( csync_patch_out_flush(o) < 0 ||
+			  fwrite(buf, n, 1, o->f) != 1 )
+			return -1;
+		o->pos += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int csync_rs_patch(const char *filename)
+{
+	FILE *basis_file = 0, *new_file = 0;
+	struct csync_basis basis = { -1, 0, NULL, 0 };
+	struct csync_patch_out out;
+	int backup_errno;
+	rs_job_t *job;
+	rs_result result;
+	char *errstr = "?";
+	char newfname[MAXPATHLEN];
+	struct csync_stream in, seg, *cur = NULL;
+	int type, new_is_temp = 0;
+	long long i, segments, total;
+
+	csync_debug(3, "Csync2 / Librsync: csync_rs_patch('%s')\n", filename);
+
+	type = csync_recv_header(&in);
+	if ( type < 0 ) goto error;
+
+	if ( type == STREAM_RAW ) {
+		csync_debug(3, "Receiving whole file from peer..\n");
+		new_file = open_new_file(newfname, prefixsubst(filename));
+		if ( !new_file ) { errstr="creating new data temp file"; goto io_error; }
+		csync_preallocate(new_file, in.file_size);
+		csync_recv_data(new_file, &in);
+		goto install;
+	}
+	if ( type == STREAM_SPARSE ) {
+		csync_debug(3, "Receiving data of sparse file from peer..\n");
+		new_file = open_new_file(newfname, prefixsubst(filename));
+		if ( !new_file ) { errstr="creating new data temp file"; goto io_error; }
+		new_is_temp = 1;
+		if ( csync_recv_data(new_file, &in) < 0 )
+			goto error;
+		goto install;
+	}
+
+	csync_debug(3, "Opening to be patched file on local host..\n");
+	if ( csync_basis_open(&basis, filename) ) {
+		errstr="opening data file for reading";
+		goto io_error;
+	}
+
+	csync_debug(3, "Opening temp file for new data on local host..\n");
+	new_file = open_new_file(newfname, prefixsubst(filename));
+	if ( !new_file ) { errstr="creating new data temp file"; goto io_error; }
+	new_is_temp = 1;
+	/* a sparse file stays sparse: blocks of zeros are not written */
+	out.f = new_file;
+	out.sparse = basis.sparse;
+	out.pos = out.hole = 0;
+	if ( !out.sparse )
+		csync_preallocate(new_file, in.file_size);
+
+	csync_debug(3, "Patching while receiving delta from peer..\n");
+	segments = type == STREAM_SEGMENTED ? in.left : 1;
+	for (i = 0; i < segments; i++) {
+		struct csync_basis_range range = { &basis,
+			i * in.segment_size, in.segment_size };
+		struct csync_stream *s = &in;
+
+		if ( type == STREAM_SEGMENTED ) {
+			/* each segment is patched against the same part of the basis */
+			in.left--;
+			cur = NULL;
+			if ( csync_recv_header(&seg) < 0 ) {
+				/* the sender gave up */
+				in.left = 0;
+				goto error;
+			}
+			s = cur = &seg;
+			if ( seg.type == STREAM_RAW || seg.type == STREAM_SPARSE ) {
+				if ( csync_patch_out_flush(&out) < 0 ) {
+					errstr="writing new data temp file";
+					goto io_error;
+				}
+				if ( csync_recv_data(new_file, &seg) < 0 )
+					goto error;
+				fseeko(new_file, 0, SEEK_END);
+				out.pos = ftello(new_file);
+				continue;
+			}
+			job = rs_patch_begin(csync_basis_range_copy, &range);
+		} else
+			job = rs_patch_begin(csync_basis_copy, &basis);
+
+		result = csync_rs_run_job(job, csync_rs_read_stream, s,
+				csync_rs_write_patch, &out);
+		rs_job_free(job);
+		if (result != RS_DONE) {
+			if (s->error)
+				goto error;
+			if (result == RS_IO_ERROR) {
+				errstr="patching data file";
+				goto io_error;
+			}
+			csync_debug(0, "Error '%s' from rsync library!\n", rs_strerror(result));
+			goto error;
+		}
+		/* librsync is done at the END command, which may have come
+		 * with the last chunk: the rest of the stream (e.g. the "0\n"
+		 * of a chunked one) is still to be read, and must be empty */
+		total = s->total;
+		if ( csync_stream_drain(s) != 0 || s->total != total ) {
+			csync_debug(0, "Data after the end of the delta for %s!\n", filename);
+			errno = EIO;
+			goto error;
+		}
+	}
+	if ( csync_patch_out_flush(&out) < 0 || fflush(new_file) ) {
+		errstr="writing new data temp file";
+		goto io_error;
+	}
+	/* give back what we preallocated too much, or make a trailing hole
+	 * part of the file */
+	if ( (in.file_size > out.pos || out.sparse) &&
+	     ftruncate(fileno(new_file), out.pos) ) {
+		errstr="truncating new data temp file";
+		goto io_error;
+	}
+
+	csync_basis_close(&basis);
+
+install:
+	/* from here on, the temp file is retained if something goes wrong */
+	new_is_temp = 0;
+
+#ifdef __CYGWIN__
+
+/* TODO: needed? */
+	// This creates the file using the native windows API, bypassing
+	// the cygwin wrappers and so making sure that we do not mess up the
+	// permissions..
+	{
+		char winfilename[MAX_PATH];
+		HANDLE winfh;
+
+		cygwin_conv_to_win32_path(prefixsubst(filename), winfilename);
+
+		winfh = CreateFile(TEXT(winfilename),
+				GENERIC_WRITE,          // open for writing
+				0,                      // do not share
+				NULL,                   // default security
+				CREATE_ALWAYS,          // overwrite existing
+				FILE_ATTRIBUTE_NORMAL | // normal file
+				FILE_FLAG_OVERLAPPED,   // asynchronous I/O
+				NULL);                  // no attr. template
+
+		if (winfh == INVALID_HANDLE_VALUE) {
+			csync_debug(0, "Win32 I/O Error %d in rsync-patch: %s\n",
+					(int)GetLastError(), winfilename);
+			errno = EACCES;
+			goto error;
+		}
+		CloseHandle(winfh);
+		goto copy;
+	}
+#endif
+
+	clone_ownership_and_permissions(fileno(new_file), prefixsubst(filename));
+
+	/* the content and metadata are complete, now it gets a name */
+	if ( !newfname[0] &&
+	     csync_link_tmpfile(fileno(new_file), newfname, prefixsubst(filename)) ) {
+		errstr="linking new data temp file";
+		goto io_error;
+	}
+
+	csync_debug(3, "Renaming tmp file to data file..\n");
+	if (rename(newfname, prefixsubst(filename))) {
+		char copyfname[MAXPATHLEN];
+		FILE *copy_file;
+		int rc;
+
+		if (errno != EXDEV) {
+			errstr="renaming tmp file to to be patched file";
+			goto io_error;
+		}
+
+		/* The temp file is on another filesystem (tempdir):
+		 * copy it to the directory of the file, and rename that. */
+		csync_debug(1, "rename not possible! Will copy next to the file first.\n");
+		copy_file = open_install_file(copyfname, prefixsubst(filename));
+		if ( copy_file ) {
+			rc = csync_copy_data(fileno(new_file), fileno(copy_file));
+			if ( !rc ) {
+				clone_ownership_and_permissions(fileno(copy_file), prefixsubst(filename));
+				if ( !copyfname[0] )
+					rc = csync_link_tmpfile(fileno(copy_file), copyfname,
+							prefixsubst(filename));
+			}
+			if ( !rc )
+				rc = rename(copyfname, prefixsubst(filename));
+			if ( rc && copyfname[0] )
+				unlink(copyfname);
+			fclose(copy_file);
+			if ( !rc ) {
+				unlink(newfname);
+				goto done;
+			}
+		}
+		/* a new inode: the old one may be linked as backup */
+		unlink(prefixsubst(filename));
+#ifdef __CYGWIN__
+copy:
+#endif
+		csync_debug(1, "Will truncate and copy instead.\n");
+		basis_file = fopen(prefixsubst(filename), "wb");
+		if ( !basis_file ) {
+			errstr="opening data file for writing";
+			goto io_error;
+		}
+
+		/* FIXME
+		 * Can easily lead to partially transfered files on the receiving side!
+		 * Think truncate, then connection loss.
+		 * Or any other failure scenario.
+		 * Need better error checks!
+		 */
+		rc = csync_copy_data(fileno(new_file), fileno(basis_file));
+		/* at least retain the temp file, if something went wrong. */
+		if (rc) {
+			csync_debug(0, "ERROR while copying temp file '%s' to basis file '%s'; "
+					"basis file may be corrupted; temp file has been retained.\n",
+					newfname, prefixsubst(filename));
+			goto error;
+		}
+		unlink(newfname);
+		fclose(basis_file);
+		basis_file = NULL;
+	}
+
+done:
+	csync_debug(3, "File has been patched successfully.\n");
+	fclose(new_file);
+
+	return 0;
+
+io_error:
+	backup_errno = errno;
+	csync_debug(0, "I/O Error '%s' while %s in rsync-patch: %s\n",
+			strerror(errno), errstr, prefixsubst(filename));
+	errno = backup_errno;
+error:;
+	backup_errno = errno;
+	/* keep the protocol in sync */
+	if ( type == STREAM_SEGMENTED )
+		csync_segmented_drain(&in, cur);
+	else if ( type >= 0 )
+		csync_stream_drain(&in);
+	csync_basis_close(&basis);
+	if ( basis_file ) fclose(basis_file);
+	if ( new_file )   fclose(new_file);
+	if ( new_is_temp && newfname[0] ) unlink(newfname);
+	errno = backup_errno;
+	return -1;
+}
+
+/*
+ * Install a small file received with BUNDLE: data, owner, mode and mtime
+ * (from attrs) are complete before the file gets its name.
+ * Return: 0, or -1 on error.
+ */
+int csync_rs_install_data(const char *filename, const char *data, size_t len,
+		const struct stat *attrs)
+{
+	struct timespec times[2];
+	char newfname[MAXPATHLEN];
+	int fd, backup_errno;
+	FILE *new_file;
+
+	new_file = open_install_file(newfname, prefixsubst(filename));
+	if ( !new_file )
+		return -1;
+	fd = fileno(new_file);
+
+	if ( (len && fwrite(data, len, 1, new_file) != 1) || fflush(new_file) )
+		goto error;
+	/* what is ignored stays as it is, like with PATCH */
+	if ( csync_ignore_uid || csync_ignore_gid || csync_ignore_mod )
+		clone_ownership_and_permissions(fd, prefixsubst(filename));
+	if ( (!csync_ignore_uid || !csync_ignore_gid) &&
+	     fchown(fd, csync_ignore_uid ? -1 : attrs->st_uid,
+			csync_ignore_gid ? -1 : attrs->st_gid) )
+		goto error;
+	if ( !csync_ignore_mod && fchmod(fd, attrs->st_mode & 07777) )
+		goto error;
+	times[0].tv_sec = times[1].tv_sec = attrs->st_mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	if ( futimens(fd, times) )
+		goto error;
+
+	if ( !newfname[0] &&
+	     csync_link_tmpfile(fd, newfname, prefixsubst(filename)) )
+		goto error;
+	if ( rename(newfname, prefixsubst(filename)) )
+		goto error;
+	fclose(new_file);
+	return 0;
+
+error:
+	backup_errno = errno;
+	csync_debug(1, "I/O Error '%s' while installing %s.\n",
+			strerror(errno), prefixsubst(filename));
+	fclose(new_file);
+	if ( newfname[0] )
+		unlink(newfname);
+	errno = backup_errno;
+	return -1;
+}
+
+/*
+ * In-place patching (the inplace statement): the new version is written
+ * right into the existing file, which needs neither the space nor the
+ * writes for a complete copy. Instead of a delta, the peer gets:
+ *
+ *   inplace-stream <size>	followed by records, by increasing offset:
+ *     <offset> <len>		<len> bytes of data follow, to be written
+ *				at <offset>
+ *     <offset> <len> <from>	copy <len> bytes from <from> to <offset>,
+ *				always from behind (<from> > <offset>)
+ *     0 0			the end, the file is truncated to <size>
+ *     -1 -1			the sender ran into an error
+ *
+ * It is made from a librsync delta. A copy from the same position is left
+ * out, nothing has changed there. A copy from behind reads data which has
+ * not been written to yet, as the records are applied in order. A copy
+ * from before might read data that has been overwritten already, so the
+ * data is sent instead, like literal data, from the new file.
+ */
+
+/* librsync delta commands, see prototab.h of librsync */
+#define RS_DELTA_MAGIC_BYTES	"rs\0026"
+#define RS_OP_END		0x00
+#define RS_OP_LITERAL_64	0x40	/* 0x01 - 0x40: literal of that length */
+#define RS_OP_LITERAL_N8	0x44	/* 0x41 - 0x44: length in 1, 2, 4, 8 bytes */
+#define RS_OP_COPY_N8_N8	0x54	/* 0x45 - 0x54: position and length in
+					 * 1, 2, 4, 8 bytes each */
+
+static int csync_delta_int(FILE *delta, int width, long long *val)
+{
+	int c;
+
+	*val = 0;
+	while ( width-- ) {
+		if ( (c = getc(delta)) == EOF )
+			return -1;
+		*val = (*val << 8) | c;
+	}
+	return 0;
+}
+
+struct csync_inplace_out {
+	int fd;			/* the new file */
+	long long pos;		/* where the next delta command goes */
+	long long run;		/* start of the data to be sent up to pos, or -1 */
+};
+
+static void csync_inplace_flush(struct csync_inplace_out *o)
+{
+	if ( o->run < 0 )
+		return;
+	conn_printf("%lld %lld\n", o->run, o->pos - o->run);
+	if ( lseek(o->fd, o->run, SEEK_SET) < 0 ||
+	     conn_sendfile(o->fd, o->pos - o->run) )
+		csync_fatal("Error '%s' while sending data.\n", strerror(errno));
+	o->run = -1;
+}
+
+/* Translate the delta to an inplace-stream and send it. */
+static int csync_inplace_send(FILE *delta, int fd, long long size)
+{
+	static const int width[] = { 1, 2, 4, 8 };
+	struct csync_inplace_out o = { fd, 0, -1 };
+	char magic[4];
+	long long len, from;
+	int op;
+
+	conn_printf("inplace-stream %lld\n", size);
+	if ( fread(magic, sizeof(magic), 1, delta) != 1 ||
+	     memcmp(magic, RS_DELTA_MAGIC_BYTES, sizeof(magic)) )
+		goto error;
+
+	while ( (op = getc(delta)) != EOF && op != RS_OP_END ) {
+		if ( op <= RS_OP_LITERAL_N8 ) {
+			if ( op <= RS_OP_LITERAL_64 )
+				len = op;
+			else if ( csync_delta_int(delta, width[op - RS_OP_LITERAL_64 - 1], &len) )
+				goto error;
+			if ( fseeko(delta, len, SEEK_CUR) < 0 )
+				goto error;
+			from = -1;
+		} else if ( op <= RS_OP_COPY_N8_N8 ) {
+			op -= RS_OP_LITERAL_N8 + 1;
+			if ( csync_delta_int(delta, width[op / 4], &from) ||
+			     csync_delta_int(delta, width[op % 4], &len) )
+				goto error;
+		} else
+			goto error;
+
+		if ( len <= 0 || o.pos + len > size )
+			goto error;
+		if ( from >= 0 && from >= o.pos ) {
+			csync_inplace_flush(&o);
+			if ( from > o.pos )
+				conn_printf("%lld %lld %lld\n", o.pos, len, from);
+		} else if ( o.run < 0 )
+			o.run = o.pos;
+		o.pos += len;
+	}
+	if ( op != RS_OP_END || o.pos != size )
+		goto error;
+	csync_inplace_flush(&o);
+	conn_printf("0 0\n");
+	return 0;
+
+error:
+	csync_debug(0, "Can not translate delta for in-place patching.\n");
+	conn_printf("-1 -1\n");
+	errno = EIO;
+	return -1;
+}
+
+/* Like csync_rs_delta(), but for a peer which patches the file in place. */
+int csync_rs_delta_inplace(const char *filename)
+{
+	FILE *delta_file = NULL;
+	struct csync_stream sig;
+	rs_signature_t *sumset = NULL;
+	rs_job_t *job;
+	rs_result result;
+	char tmpfname[MAXPATHLEN];
+	struct stat st;
+	int new_fd = -1, type, rc = -1;
+
+	csync_debug(3, "Csync2 / Librsync: csync_rs_delta_inplace('%s')\n", filename);
+
+	type = csync_recv_header(&sig);
+	if ( type < 0 )
+		return -1;
+	if ( type == STREAM_SEGMENTED ) {
+		/* not asked for by the peer when patching in place */
+		csync_segmented_drain(&sig, NULL);
+		goto sig_error;
+	}
+
+	job = rs_loadsig_begin(&sumset);
+	result = csync_rs_run_job(job, csync_rs_read_stream, &sig, NULL, NULL);
+	rs_job_free(job);
+	if ( csync_stream_drain(&sig) < 0 || result != RS_DONE )
+		goto sig_error;
+	if ( rs_build_hash_table(sumset) != RS_DONE )
+		goto sig_error;
+
+	new_fd = open(prefixsubst(filename), O_RDONLY);
+	if ( new_fd < 0 || fstat(new_fd, &st) < 0 )
+		goto io_error;
+	delta_file = open_temp_file(tmpfname, prefixsubst(filename));
+	if ( !delta_file )
+		goto io_error;
+	unlink(tmpfname);
+
+	/* the delta is usually small, the translation needs to look at it first */
+	job = rs_delta_begin(sumset);
+	result = csync_rs_run_job(job, csync_rs_read_fd, &new_fd,
+			csync_rs_write_file, delta_file);
+	rs_job_free(job);
+	if ( result != RS_DONE || fflush(delta_file) || fseeko(delta_file, 0, SEEK_SET) )
+		goto io_error;
+
+	csync_debug(3, "Sending in-place patch to peer..\n");
+	rc = csync_inplace_send(delta_file, new_fd, st.st_size);
+	goto out;
+
+io_error:
+	csync_debug(0, "I/O Error '%s' in rsync-delta: %s\n",
+			strerror(errno), prefixsubst(filename));
+sig_error:
+	conn_printf("octet-stream -1\n");
+	errno = EIO;
+out:
+	if ( sumset )
+		rs_free_sumset(sumset);
+	if ( delta_file )
+		fclose(delta_file);
+	if ( new_fd >= 0 )
+		close(new_fd);
+	return rc;
+}
+
+/* Copy len bytes from behind (from > to), front to back, like memmove(). */
+static int csync_inplace_copy(int fd, off_t to, off_t from, off_t len)
+{
+	char buffer[RS_JOB_BUFSIZE];
+	ssize_t rc;
+
+	while ( len > 0 ) {
+		do {
+			rc = pread(fd, buffer, MIN(len, sizeof(buffer)), from);
+		} while ( rc < 0 && errno == EINTR );
+		if ( rc <= 0 ) {
+			if ( rc == 0 )
+				errno = EIO;
+			return -1;
+		}
+		if ( pwrite(fd, buffer, rc, to) != rc )
+			return -1;
+		from += rc;
+		to += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/*
+ * Apply an inplace-stream to the file. If anything goes wrong, the file is
+ * left partially patched; the next sync will notice the difference.
+ */
+int csync_rs_patch_inplace(const char *filename)
+{
+	struct csync_stream in, data;
+	char line[100];
+	long long offset, len, from, end = 0;
+	int fd, n, failed = 0;
+
+	csync_debug(3, "Csync2 / Librsync: csync_rs_patch_inplace('%s')\n", filename);
+
+	if ( csync_recv_header(&in) < 0 )
+		return -1;
+	if ( in.type != STREAM_INPLACE )
+		csync_fatal("Format-error while receiving data.\n");
+
+	fd = open(prefixsubst(filename), O_RDWR);
+	if ( fd < 0 )
+		failed = errno;
+
+	/* even if we failed, the rest of the stream must be read */
+	for (;;) {
+		if ( !conn_gets(line, sizeof(line)) )
+			csync_fatal("Format-error while receiving data.\n");
+		n = sscanf(line, "%lld %lld %lld\n", &offset, &len, &from);
+		if ( n < 2 )
+			csync_fatal("Format-error while receiving data.\n");
+		if ( len < 0 ) {
+			if ( !failed )
+				failed = EIO;
+			break;
+		}
+		if ( len == 0 )
+			break;
+		if ( offset < end || offset + len > in.file_size ||
+		     (n == 3 && from <= offset) )
+			csync_fatal("Format-error while receiving data.\n");
+		end = offset + len;
+
+		if ( n == 3 ) {
+			if ( !failed && csync_inplace_copy(fd, offset, from, len) )
+				failed = errno;
+			continue;
+		}
+		if ( !failed && lseek(fd, offset, SEEK_SET) < 0 )
+			failed = errno;
+		if ( !failed ) {
+			if ( conn_recvfile(fd, len) )
+				csync_fatal("Error '%s' while receiving data.\n", strerror(errno));
+		} else {
+			memset(&data, 0, sizeof(data));
+			data.type = STREAM_OCTET;
+			data.left = len;
+			csync_stream_drain(&data);
+		}
+	}
+
+	if ( !failed && ftruncate(fd, in.file_size) )
+		failed = errno;
+	if ( fd >= 0 )
+		close(fd);
+	if ( failed ) {
+		csync_debug(0, "I/O Error '%s' while patching in place: %s\n",
+				strerror(failed), prefixsubst(filename));
+		errno = failed;
+		return -1;
+	}
+	csync_debug(3, "File has been patched in place successfully.\n");
+	return 0;
+}
+
+/*
+ * APPEND: if an append-only file has only grown, just the new data past
+ * the old end is sent, and appended to the peer's version in place. To
+ * make sure the peer's version really is what ours has grown from, both
+ * sides compare the MD4 of the last (up to) 64 kB before the old end.
+ */
+#define CSYNC_APPEND_CHECK 65536
+
+/*
+ * The check of the data before offset, as hex string. Fails (errno=ESTALE)
+ * if the file is not a regular file of at least offset bytes.
+ * Return: 0, or -1 on error.
+ */
+int csync_rs_append_check(const char *filename, long long offset, char *check, size_t size)
+{
+	char buf[CSYNC_APPEND_CHECK];
+	unsigned char md[MD4_LEN];
+	off_t len = MIN(offset, CSYNC_APPEND_CHECK);
+	struct stat st;
+	int fd, i, rc;
+
+	fd = open(prefixsubst(filename), O_RDONLY);
+	if ( fd < 0 )
+		return -1;
+	if ( fstat(fd, &st) < 0 ) {
+		close(fd);
+		return -1;
+	}
+	if ( !S_ISREG(st.st_mode) || offset <= 0 || st.st_size < offset ) {
+		close(fd);
+		errno = ESTALE;
+		return -1;
+	}
+	do {
+		rc = pread(fd, buf, len, offset - len);
+	} while ( rc < 0 && errno == EINTR );
+	close(fd);
+	if ( rc != len ) {
+		if ( rc >= 0 )
+			errno = EIO;
+		return -1;
+	}
+
+	rs_mdfour(md, buf, len);
+	for (i = rc = 0; i < MD4_LEN; i++)
+		rc += snprintf(check + rc, size - rc, "%02x", md[i]);
+	return 0;
+}
+
+/* The data for APPEND: everything past offset. */
+int csync_rs_append_send(const char *filename, long long offset)
+{
+	struct stat st;
+	int fd, rc;
+
+	csync_debug(3, "Csync2 / Librsync: csync_rs_append_send('%s', %lld)\n",
+			filename, offset);
+
+	fd = open(prefixsubst(filename), O_RDONLY);
+	if (fd >= 0 && (fstat(fd, &st) || lseek(fd, offset, SEEK_SET) < 0)) {
+		int backup_errno = errno;
+		close(fd);
+		fd = -1;
+		errno = backup_errno;
+	}
+	if (fd >= 0 && st.st_size < offset) {
+		/* not what the peer's version has grown to */
+		close(fd);
+		fd = -1;
+		errno = ESTALE;
+	}
+	if (fd < 0) {
+		int backup_errno = errno;
+		csync_debug(0, "I/O Error '%s' while %s in rsync-append: %s\n",
+				strerror(errno), "opening data file for reading", filename);
+		conn_printf("octet-stream -1\n");
+		errno = backup_errno;
+		return -1;
+	}
+
+	rc = csync_send_raw(fd, st.st_size - offset);
+	close(fd);
+	return rc;
+}
+
+/*
+ * Receive the data for APPEND and write it in place, past offset. If that
+ * fails, the file is truncated to offset again.
+ */
+int csync_rs_append(const char *filename, long long offset)
+{
+	struct csync_stream in;
+	struct stat st;
+	FILE *f = NULL;
+	int fd, type, backup_errno;
+
+	csync_debug(3, "Csync2 / Librsync: csync_rs_append('%s', %lld)\n",
+			filename, offset);
+
+	type = csync_recv_header(&in);
+	if ( type < 0 )
+		return -1;
+	if ( type != STREAM_RAW && type != STREAM_SPARSE )
+		csync_fatal("Format-error while receiving data.\n");
+
+	fd = open(prefixsubst(filename), O_WRONLY);
+	if ( fd < 0 || fstat(fd, &st) < 0 || !(f = fdopen(fd, "w")) )
+		goto io_error;
+	/* it might have changed since the APPEND command has been checked */
+	if ( st.st_size != offset ) {
+		errno = ESTALE;
+		goto io_error;
+	}
+	if ( fseeko(f, offset, SEEK_SET) < 0 )
+		goto io_error;
+	csync_preallocate(f, offset + in.file_size);
+	if ( csync_recv_data(f, &in) < 0 ) {
+		if ( ftruncate(fd, offset) )
+			csync_debug(0, "Error '%s' while truncating %s after failed append.\n",
+					strerror(errno), filename);
+		fclose(f);
+		errno = EIO;
+		return -1;
+	}
+	if ( fclose(f) )
+		return -1;
+	csync_debug(3, "Data has been appended successfully.\n");
+	return 0;
+
+io_error:
+	backup_errno = errno;
+	csync_debug(0, "I/O Error '%s' while %s in rsync-append: %s\n",
+			strerror(errno), "opening data file for appending", filename);
+	csync_stream_drain(&in);
+	if ( f )
+		fclose(f);
+	else if ( fd >= 0 )
+		close(fd);
+	errno = backup_errno;
+	return -1;
+}
+
+/*
+ * CHUNKS: files which share data with other files, like VM images or
+ * archives built from the same parts (see the dedup statement), are cut
+ * into chunks where the content says so (FastCDC: a gear hash of the last
+ * bytes matches a mask), so the same data makes the same chunks, wherever
+ * it is in whichever file. Both sides record the SHA-256 and position of
+ * the chunks of their dedup files in the chunk table.
+ *
+ * The sender sends the list of the chunks of the file (32 bytes SHA-256
+ * and 4 bytes length, big endian, each) as chunked-stream. The receiver
+ * looks them up in its chunk table, verifies the data it finds, and copies
+ * it to a temp file, the compact basis. Repeated chunks are only copied
+ * once, on their first occurrence. It answers with an octet-stream of one
+ * byte per chunk, 1 if it has the chunk. The sender then sends a librsync
+ * delta against the compact basis: copies of what the receiver has, and
+ * the rest of the file as literal data. It is patched like with PATCH.
+ */
+#define CDC_MIN		2048
+#define CDC_AVG		8192
+#define CDC_MAX		65536
+#define CDC_MASK_S	0x0000d9f003530000ULL	/* before CDC_AVG: cuts less likely */
+#define CDC_MASK_L	0x0000d90003530000ULL	/* after CDC_AVG: cuts more likely */
+#define CDC_RECORD	(SHA256_LEN + 4)
+
+#ifdef HAVE_LIBGNUTLS
+static uint64_t cdc_gear[256];
+
+/* The gear table must be the same on all hosts: splitmix64, fixed seed. */
+static void cdc_gear_init()
+{
+	static int done;
+	uint64_t x = 0x6373796e63320000ULL, z;
+	int i;
+
+	if (done)
+		return;
+	for (i = 0; i < 256; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		cdc_gear[i] = z ^ (z >> 31);
+	}
+	done = 1;
+}
+
+/* The length of the chunk at p, with n bytes of data available. */
+static size_t cdc_cut(const unsigned char *p, size_t n)
+{
+	uint64_t fp = 0;
+	size_t i = CDC_MIN, normal = CDC_AVG;
+
+	if (n <= CDC_MIN)
+		return n;
+	if (n > CDC_MAX)
+		n = CDC_MAX;
+	if (normal > n)
+		normal = n;
+	for (; i < normal; i++) {
+		fp = (fp << 1) + cdc_gear[p[i]];
+		if (!(fp & CDC_MASK_S))
+			return i;
+	}
+	for (; i < n; i++) {
+		fp = (fp << 1) + cdc_gear[p[i]];
+		if (!(fp & CDC_MASK_L))
+			return i;
+	}
+	return n;
+}
+
+struct cdc_reader {
+	int fd;
+	int eof;
+	size_t start, end;
+	long long offset;	/* of buf[start] in the file */
+	unsigned char buf[2 * CDC_MAX];
+};
+
+static struct cdc_reader *cdc_reader_new(int fd)
+{
+	struct cdc_reader *r = calloc(1, sizeof(*r));
+
+	if (!r)
+		csync_fatal("Out of memory.\n");
+	cdc_gear_init();
+	r->fd = fd;
+	return r;
+}
+
+/*
+ * The next chunk of the file, at *data, from *offset on.
+ * Return: its length, 0 at the end of the file, or -1 on error.
+ */
+static int cdc_next(struct cdc_reader *r, const unsigned char **data, long long *offset)
+{
+	size_t len;
+	ssize_t rc;
+
+	if (r->end - r->start < CDC_MAX && !r->eof) {
+		memmove(r->buf, r->buf + r->start, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+		while (r->end < sizeof(r->buf)) {
+			rc = read(r->fd, r->buf + r->end, sizeof(r->buf) - r->end);
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc < 0)
+				return -1;
+			if (rc == 0) {
+				r->eof = 1;
+				break;
+			}
+			r->end += rc;
+		}
+	}
+	if (r->start == r->end)
+		return 0;
+
+	len = cdc_cut(r->buf + r->start, r->end - r->start);
+	*data = r->buf + r->start;
+	*offset = r->offset;
+	r->start += len;
+	r->offset += len;
+	return len;
+}
+
+static void cdc_hex(const unsigned char *md, char *hex)
+{
+	int i;
+
+	for (i = 0; i < SHA256_LEN; i++)
+		sprintf(hex + 2 * i, "%02x", md[i]);
+}
+
+static void cdc_record(unsigned char *rec, const unsigned char *data, size_t len)
+{
+	gnutls_hash_fast(GNUTLS_DIG_SHA256, data, len, rec);
+	rec[SHA256_LEN] = len >> 24;
+	rec[SHA256_LEN + 1] = len >> 16;
+	rec[SHA256_LEN + 2] = len >> 8;
+	rec[SHA256_LEN + 3] = len;
+}
+
+static size_t cdc_record_len(const unsigned char *rec)
+{
+	return (size_t)rec[SHA256_LEN] << 24 | rec[SHA256_LEN + 1] << 16 |
+		rec[SHA256_LEN + 2] << 8 | rec[SHA256_LEN + 3];
+}
+
+static const unsigned char *cdc_sort_list;
+
+static int cdc_sort_cmp(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	int rc = memcmp(cdc_sort_list + x * CDC_RECORD,
+			cdc_sort_list + y * CDC_RECORD, CDC_RECORD);
+
+	return rc ? rc : x < y ? -1 : x > y;
+}
+
+/*
+ * For each chunk in the list, the index of its first occurrence. Both
+ * sides need to agree on it, it decides the layout of the compact basis.
+ */
+static long long *cdc_first(const unsigned char *list, long long count)
+{
+	long long *order = malloc(count * sizeof(*order) + 1);
+	long long *first = malloc(count * sizeof(*first) + 1);
+	long long i, f = 0;
+
+	if (!order || !first)
+		csync_fatal("Out of memory.\n");
+	for (i = 0; i < count; i++)
+		order[i] = i;
+	cdc_sort_list = list;
+	qsort(order, count, sizeof(*order), cdc_sort_cmp);
+	for (i = 0; i < count; i++) {
+		if (i == 0 || memcmp(list + order[i] * CDC_RECORD,
+				list + order[i - 1] * CDC_RECORD, CDC_RECORD))
+			f = order[i];
+		first[order[i]] = f;
+	}
+	free(order);
+	return first;
+}
+#endif
+
+/* Record the chunks of a dedup file in the chunk table. */
+void csync_cdc_index(const char *filename)
+{
+#ifdef HAVE_LIBGNUTLS
+	unsigned char rec[CDC_RECORD];
+	char hex[2 * SHA256_LEN + 1];
+	const unsigned char *data;
+	struct cdc_reader *r;
+	long long offset;
+	struct stat st;
+	int fd, len;
+
+	SQL("Removing chunk entries",
+	    "DELETE FROM chunk WHERE filename = '%s'",
+	    url_encode(filename));
+
+	fd = open(prefixsubst(filename), O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return;
+	}
+
+	csync_debug(3, "Recording chunks of %s.\n", filename);
+	r = cdc_reader_new(fd);
+	while ((len = cdc_next(r, &data, &offset)) > 0) {
+		cdc_record(rec, data, len);
+		cdc_hex(rec, hex);
+		SQL("Adding chunk entry",
+		    "INSERT INTO chunk (hash, filename, pos) VALUES ('%s', '%s', %lld)",
+		    hex, url_encode(filename), offset);
+	}
+	if (len < 0)
+		csync_debug(1, "I/O Error '%s' while recording chunks of %s.\n",
+				strerror(errno), filename);
+	free(r);
+	close(fd);
+#endif
+}
+
+#ifdef HAVE_LIBGNUTLS
+struct cdc_delta {
+	size_t len;
+	char buf[RS_JOB_BUFSIZE];
+};
+
+static void cdc_delta_flush(struct cdc_delta *d)
+{
+	if (d->len)
+		csync_stream_write(NULL, d->buf, d->len);
+	d->len = 0;
+}
+
+static void cdc_delta_op(struct cdc_delta *d, int op, long long a, long long b)
+{
+	int i;
+
+	if (d->len + 17 > sizeof(d->buf))
+		cdc_delta_flush(d);
+	d->buf[d->len++] = op;
+	for (i = 56; i >= 0; i -= 8)
+		d->buf[d->len++] = a >> i;
+	if (op == RS_OP_COPY_N8_N8)
+		for (i = 56; i >= 0; i -= 8)
+			d->buf[d->len++] = b >> i;
+}
+
+/* Add len bytes of the file from offset on to the delta. */
+static int cdc_delta_data(struct cdc_delta *d, int fd, off_t offset, long long len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		if (d->len == sizeof(d->buf))
+			cdc_delta_flush(d);
+		do {
+			rc = pread(fd, d->buf + d->len,
+					MIN(len, sizeof(d->buf) - d->len), offset);
+		} while (rc < 0 && errno == EINTR);
+		if (rc <= 0) {
+			if (rc == 0)
+				errno = EIO;
+			return -1;
+		}
+		d->len += rc;
+		offset += rc;
+		len -= rc;
+	}
+	return 0;
+}
+#endif
+
+/* The data for CHUNKS, see above. */
+int csync_cdc_send(const char *filename)
+{
+#ifdef HAVE_LIBGNUTLS
+	unsigned char *list = NULL, *have = NULL;
+	long long *first = NULL, *pos = NULL;
+	long long count = 0, alloc = 0, offset, i, j, len, next;
+	struct csync_stream in;
+	struct cdc_delta *d = NULL;
+	const unsigned char *data;
+	struct cdc_reader *r;
+	struct stat st, st2;
+	int fd, rc = -1, n;
+
+	csync_debug(3, "Csync2 / Librsync: csync_cdc_send('%s')\n", filename);
+
+	fd = open(prefixsubst(filename), O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		int backup_errno = errno;
+		csync_debug(0, "I/O Error '%s' while %s in rsync-chunks: %s\n",
+				strerror(errno), "opening data file for reading", filename);
+		conn_printf("octet-stream -1\n");
+		if (fd >= 0)
+			close(fd);
+		errno = backup_errno;
+		return -1;
+	}
+
+	r = cdc_reader_new(fd);
+	while ((n = cdc_next(r, &data, &offset)) > 0) {
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			list = realloc(list, alloc * CDC_RECORD);
+			if (!list)
+				csync_fatal("Out of memory.\n");
+		}
+		cdc_record(list + count * CDC_RECORD, data, n);
+		count++;
+	}
+	free(r);
+	conn_printf("chunked-stream\n");
+	for (i = 0; n == 0 && i < count * CDC_RECORD; i += len) {
+		len = MIN(count * CDC_RECORD - i, RS_JOB_BUFSIZE);
+		csync_stream_write(NULL, (char *)list + i, len);
+	}
+	if (n < 0) {
+		conn_printf("-1\n");
+		goto io_error;
+	}
+	conn_printf("0\n");
+
+	csync_debug(3, "Reading the chunks the peer has..\n");
+	if (csync_recv_header(&in) < 0)
+		goto out;
+	have = malloc(count + 1);
+	if (!have)
+		csync_fatal("Out of memory.\n");
+	for (i = 0; i < count; i += n) {
+		n = csync_stream_read(&in, (char *)have + i, count - i);
+		if (n <= 0)
+			break;
+	}
+	if (i < count || csync_stream_drain(&in) != 0 || in.total != count)
+		csync_fatal("Format-error while receiving data.\n");
+
+	/* where the chunks are in the compact basis */
+	first = cdc_first(list, count);
+	pos = malloc(count * sizeof(*pos) + 1);
+	if (!pos)
+		csync_fatal("Out of memory.\n");
+	for (i = 0, next = 0; i < count; i++) {
+		if (first[i] != i || !have[i])
+			continue;
+		pos[i] = next;
+		next += cdc_record_len(list + i * CDC_RECORD);
+	}
+
+	csync_debug(3, "Sending delta to peer..\n");
+	if (csync_size_hint(st.st_size) >= 0)
+		conn_printf("chunked-stream %lld\n", (long long)st.st_size);
+	else
+		conn_printf("chunked-stream\n");
+	d = malloc(sizeof(*d));
+	if (!d)
+		csync_fatal("Out of memory.\n");
+	memcpy(d->buf, RS_DELTA_MAGIC_BYTES, 4);
+	d->len = 4;
+	for (i = 0, offset = 0; i < count; i = j, offset += len) {
+		int copy = !!have[first[i]];
+
+		/* runs of chunks the peer has, which are next to each
+		 * other in the compact basis, or which it does not have */
+		len = cdc_record_len(list + i * CDC_RECORD);
+		for (j = i + 1; j < count && !!have[first[j]] == copy; j++) {
+			if (copy && pos[first[j]] != pos[first[i]] + len)
+				break;
+			len += cdc_record_len(list + j * CDC_RECORD);
+		}
+		if (copy)
+			cdc_delta_op(d, RS_OP_COPY_N8_N8, pos[first[i]], len);
+		else {
+			cdc_delta_op(d, RS_OP_LITERAL_N8, len, 0);
+			if (cdc_delta_data(d, fd, offset, len) < 0) {
+				conn_printf("-1\n");
+				goto io_error;
+			}
+		}
+	}
+	/* do not send a delta which does not match what we listed */
+	if (offset != st.st_size || fstat(fd, &st2) < 0 || !same_version(&st, &st2)) {
+		csync_debug(0, "File changed while sending it: %s\n", filename);
+		conn_printf("-1\n");
+		errno = EIO;
+		goto out;
+	}
+	d->buf[d->len++] = RS_OP_END;
+	cdc_delta_flush(d);
+	conn_printf("0\n");
+	csync_debug(3, "Delta has been sent successfully.\n");
+	rc = 0;
+	goto out;
+
+io_error:
+	csync_debug(0, "I/O Error '%s' in rsync-chunks: %s\n",
+			strerror(errno), prefixsubst(filename));
+	errno = EIO;
+out:
+	free(list);
+	free(have);
+	free(first);
+	free(pos);
+	free(d);
+	close(fd);
+	return rc;
+#else
+	conn_printf("octet-stream -1\n");
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+#ifdef HAVE_LIBGNUTLS
+/* The file the last chunk has been found in, likely to have the next one. */
+struct cdc_source {
+	char *filename;
+	int fd;
+};
+
+/*
+ * Look for the chunk in the chunk table, in files the peer may access,
+ * and write it to the compact basis at pos.
+ * Return: 1 if found, 0 if not, -1 if it could not be written.
+ */
+static int cdc_lookup(const unsigned char *rec, struct cdc_source *src,
+		int basis_fd, off_t pos, const char *key, const char *peer)
+{
+	unsigned char buf[CDC_MAX], md[SHA256_LEN];
+	char hex[2 * SHA256_LEN + 1];
+	size_t len = cdc_record_len(rec);
+	struct textlist *tl = 0, *t;
+	int found = 0, pass;
+	ssize_t rc;
+
+	cdc_hex(rec, hex);
+	SQL_BEGIN("Looking up chunk",
+		"SELECT filename, pos FROM chunk WHERE hash = '%s'", hex)
+	{
+		const char *filename = url_decode(SQL_V(0));
+
+		textlist_add2(&tl, filename, SQL_V(1),
+			src->filename && !strcmp(filename, src->filename));
+	} SQL_END;
+
+	/* the file of the last hit first */
+	for (pass = 1; pass >= 0 && !found; pass--)
+	for (t = tl; t && !found; t = t->next) {
+		if (t->intvalue != pass)
+			continue;
+		if (!src->filename || strcmp(t->value, src->filename)) {
+			if (csync_perm(t->value, key, peer))
+				continue;
+			if (src->fd >= 0)
+				close(src->fd);
+			free(src->filename);
+			src->filename = strdup(t->value);
+			src->fd = open(prefixsubst(t->value), O_RDONLY);
+		}
+		if (src->fd < 0)
+			continue;
+		do {
+			rc = pread(src->fd, buf, len, atoll(t->value2));
+		} while (rc < 0 && errno == EINTR);
+		if (rc != len)
+			continue;
+		gnutls_hash_fast(GNUTLS_DIG_SHA256, buf, len, md);
+		if (memcmp(md, rec, SHA256_LEN))
+			continue;
+		if (pwrite(basis_fd, buf, len, pos) != len) {
+			textlist_free(tl);
+			return -1;
+		}
+		found = 1;
+	}
+	textlist_free(tl);
+	return found;
+}
+#endif
+
+/* Receive the data for CHUNKS and patch the file with it, see above. */
+int csync_cdc_patch(const char *filename, const char *key, const char *peer)
+{
+#ifdef HAVE_LIBGNUTLS
+	struct cdc_source src = { NULL, -1 };
+	struct csync_stream in;
+	unsigned char *list = NULL, *have = NULL;
+	long long *first = NULL;
+	long long count, alloc = 0, total = 0, next = 0, found = 0, i;
+	char basisfname[MAXPATHLEN];
+	FILE *basis = NULL;
+	int rc, failed = 0;
+
+	csync_debug(3, "Csync2 / Librsync: csync_cdc_patch('%s')\n", filename);
+
+	if (csync_recv_header(&in) < 0)
+		return -1;
+	for (;;) {
+		if (total == alloc) {
+			alloc = alloc ? alloc * 2 : 1024 * CDC_RECORD;
+			list = realloc(list, alloc);
+			if (!list)
+				csync_fatal("Out of memory.\n");
+		}
+		rc = csync_stream_read(&in, (char *)list + total, alloc - total);
+		if (rc <= 0)
+			break;
+		total += rc;
+	}
+	if (rc < 0) {
+		free(list);
+		return -1;
+	}
+	if (total % CDC_RECORD)
+		csync_fatal("Format-error while receiving data.\n");
+	count = total / CDC_RECORD;
+	for (i = 0; i < count; i++) {
+		size_t len = cdc_record_len(list + i * CDC_RECORD);
+		if (len == 0 || len > CDC_MAX)
+			csync_fatal("Format-error while receiving data.\n");
+	}
+
+	basis = open_temp_file(basisfname, prefixsubst(filename));
+	if (!basis) {
+		int backup_errno = errno;
+		csync_debug(0, "I/O Error '%s' while %s in rsync-chunks: %s\n",
+				strerror(errno), "creating basis temp file", filename);
+		conn_printf("octet-stream -1\n");
+		free(list);
+		errno = backup_errno;
+		return -1;
+	}
+
+	first = cdc_first(list, count);
+	have = calloc(1, count + 1);
+	if (!have)
+		csync_fatal("Out of memory.\n");
+	for (i = 0; i < count && !failed; i++) {
+		if (first[i] != i)
+			continue;
+		rc = cdc_lookup(list + i * CDC_RECORD, &src, fileno(basis), next, key, peer);
+		if (rc < 0) {
+			/* go on without the rest */
+			csync_debug(1, "I/O Error '%s' while writing basis temp file for %s.\n",
+					strerror(errno), filename);
+			failed = 1;
+		} else if (rc) {
+			have[i] = 1;
+			next += cdc_record_len(list + i * CDC_RECORD);
+			found++;
+		}
+	}
+	if (src.fd >= 0)
+		close(src.fd);
+	free(src.filename);
+	csync_debug(2, "Found %lld of %lld chunks of %s here.\n", found, count, filename);
+
+	conn_printf("octet-stream %lld\n", count);
+	if (conn_write(have, count) != count)
+		csync_fatal("Write-error while sending data.\n");
+
+	csync_rs_use_basis(basisfname);
+	rc = csync_rs_patch(filename);
+	csync_rs_use_basis(NULL);
+
+	fclose(basis);
+	unlink(basisfname);
+	free(list);
+	free(have);
+	free(first);
+	return rc;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
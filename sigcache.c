@@ -0,0 +1,288 @@
+/*
+ *  csync2 - cluster synchronization tool, 2nd generation
+ *  Copyright (C) 2004 - 2015 LINBIT Information Technologies GmbH
+ *  http://www.linbit.com; see also AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "csync2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+/*
+ * On-disk cache of librsync signatures.
+ *
+ * There is one file per cached signature in the sigcache-directory, named
+ * after device and inode number of the file it belongs to and the kind of
+ * signature (librsync magic, or CSYNC_DIGEST_SHA256) and its block and
+ * strong sum length, so signatures of the same file with different
+ * parameters do not replace each other. It starts with
+ * a header that identifies the exact version of the file (size, mtime and
+ * ctime in nanoseconds) and the signature parameters, followed by the
+ * signature itself. Entries which do not match are stale and get removed.
+ *
+ * On every hit, the mtime of the entry is updated. If the cache grows
+ * beyond sigcache-size megabytes, the entries used least recently are
+ * removed. The size of the cache is taken from the directory once, and
+ * then kept track of; the directory is only read again when that goes
+ * beyond the limit.
+ */
+
+#define SIGCACHE_MAGIC "csync2S1"
+
+struct sigcache_header {
+	char magic[8];
+	uint64_t dev, ino, size;
+	int64_t mtime_sec, mtime_nsec;
+	int64_t ctime_sec, ctime_nsec;
+	uint32_t sig_magic, block_len, strong_len, pad;
+	uint64_t sig_len;
+};
+
+static void sigcache_fill_header(struct sigcache_header *h, const struct stat *st,
+		const struct csync_sig_params *params, long long sig_len)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, SIGCACHE_MAGIC, sizeof(h->magic));
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->size = st->st_size;
+	h->mtime_sec = st->st_mtim.tv_sec;
+	h->mtime_nsec = st->st_mtim.tv_nsec;
+	h->ctime_sec = st->st_ctim.tv_sec;
+	h->ctime_nsec = st->st_ctim.tv_nsec;
+	h->sig_magic = params->sig_magic;
+	h->block_len = params->block_len;
+	h->strong_len = params->strong_len;
+	h->sig_len = sig_len;
+}
+
+static void sigcache_entry_name(char *name, const struct stat *st,
+		const struct csync_sig_params *params)
+{
+	snprintf(name, MAXPATHLEN, "%s/%llx-%llx-%x-%x-%x", csync_sigcache_dir,
+			(unsigned long long)st->st_dev,
+			(unsigned long long)st->st_ino,
+			params->sig_magic, params->block_len, params->strong_len);
+}
+
+/*
+ * Look up the signature of the file st belongs to.
+ * Return: fd positioned at the start of the signature, or -1.
+ */
+int csync_sigcache_lookup(const struct stat *st,
+		const struct csync_sig_params *params, long long *sig_len)
+{
+	struct sigcache_header want, have;
+	char name[MAXPATHLEN];
+	struct stat cst;
+	int fd;
+
+	if (!csync_sigcache_dir)
+		return -1;
+
+	sigcache_entry_name(name, st, params);
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (read(fd, &have, sizeof(have)) != sizeof(have) || fstat(fd, &cst) < 0)
+		goto stale;
+
+	sigcache_fill_header(&want, st, params, have.sig_len);
+	if (memcmp(&want, &have, sizeof(want)) ||
+	    cst.st_size != sizeof(have) + have.sig_len)
+		goto stale;
+
+	/* LRU: remember when we last needed it */
+	futimens(fd, NULL);
+
+	csync_debug(3, "Using cached signature %s.\n", name);
+	*sig_len = have.sig_len;
+	return fd;
+
+stale:
+	csync_debug(3, "Removing stale cached signature %s.\n", name);
+	close(fd);
+	unlink(name);
+	return -1;
+}
+
+/*
+ * Create a new cache entry. Write the signature to the returned fd, then
+ * call csync_sigcache_commit() or csync_sigcache_abort().
+ */
+int csync_sigcache_create(char *tmpname)
+{
+	struct sigcache_header h;
+	int fd;
+
+	if (!csync_sigcache_dir)
+		return -1;
+
+	snprintf(tmpname, MAXPATHLEN, "%s/.new.XXXXXX", csync_sigcache_dir);
+	fd = mkstemp(tmpname);
+	if (fd < 0 && errno == ENOENT) {
+		char path[strlen(csync_sigcache_dir) + 3];
+		sprintf(path, "%s/x", csync_sigcache_dir);
+		if (!mkpath(path, 0700)) {
+			snprintf(tmpname, MAXPATHLEN, "%s/.new.XXXXXX", csync_sigcache_dir);
+			fd = mkstemp(tmpname);
+		}
+	}
+	if (fd < 0) {
+		csync_debug(1, "Can not create signature cache entry in %s: %s\n",
+				csync_sigcache_dir, strerror(errno));
+		return -1;
+	}
+
+	/* placeholder, filled in by csync_sigcache_commit() */
+	memset(&h, 0, sizeof(h));
+	if (write(fd, &h, sizeof(h)) != sizeof(h)) {
+		csync_sigcache_abort(fd, tmpname);
+		return -1;
+	}
+	return fd;
+}
+
+void csync_sigcache_abort(int fd, const char *tmpname)
+{
+	close(fd);
+	unlink(tmpname);
+}
+
+/* size of the cache, as far as we know, or -1 if not known yet */
+static long long sigcache_total = -1;
+
+struct sigcache_lru {
+	char name[NAME_MAX + 1];
+	time_t atime;
+	off_t size;
+};
+
+static int sigcache_lru_cmp(const void *a, const void *b)
+{
+	const struct sigcache_lru *x = a, *y = b;
+	return x->atime < y->atime ? -1 : x->atime > y->atime;
+}
+
+/* Remove the least recently used entries until we are below the limit. */
+static void sigcache_trim()
+{
+	struct sigcache_lru *e = NULL;
+	int n = 0, alloc = 0, i;
+	long long total = 0, limit;
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+	int dfd;
+
+	limit = (long long)csync_sigcache_size << 20;
+
+	dir = opendir(csync_sigcache_dir);
+	if (!dir)
+		return;
+	dfd = dirfd(dir);
+
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		if (fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+		    !S_ISREG(st.st_mode))
+			continue;
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			e = realloc(e, alloc * sizeof(*e));
+		}
+		strcpy(e[n].name, d->d_name);
+		e[n].atime = st.st_mtime;
+		e[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+
+	if (total > limit) {
+		/* make some room, so we do not need to do this every time */
+		limit -= limit / 10;
+		qsort(e, n, sizeof(*e), sigcache_lru_cmp);
+		for (i = 0; i < n && total > limit; i++) {
+			csync_debug(3, "Removing cached signature %s/%s (LRU).\n",
+					csync_sigcache_dir, e[i].name);
+			if (!unlinkat(dfd, e[i].name, 0))
+				total -= e[i].size;
+		}
+	}
+	sigcache_total = total;
+
+	closedir(dir);
+	free(e);
+}
+
+/*
+ * Put the new entry in place. st must describe the file as it was before
+ * the signature has been created, and the file must not have changed since.
+ * Return: 0, and fd positioned at the start of the signature, or -1 if
+ * the entry has been dropped.
+ */
+int csync_sigcache_commit(int fd, const char *tmpname, const struct stat *st,
+		const struct csync_sig_params *params, long long *sig_len)
+{
+	struct sigcache_header h;
+	char name[MAXPATHLEN];
+	off_t end;
+
+	end = lseek(fd, 0, SEEK_END);
+	if (end < (off_t)sizeof(h))
+		goto fail;
+
+	sigcache_fill_header(&h, st, params, end - sizeof(h));
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+		goto fail;
+
+	sigcache_entry_name(name, st, params);
+	if (rename(tmpname, name) < 0)
+		goto fail;
+	csync_debug(3, "Cached signature as %s.\n", name);
+
+	if (lseek(fd, sizeof(h), SEEK_SET) < 0) {
+		close(fd);
+		return -1;
+	}
+	*sig_len = h.sig_len;
+
+	/* replaced entries are counted twice, until the next trim */
+	if ( sigcache_total >= 0 )
+		sigcache_total += end;
+	if ( sigcache_total < 0 ||
+	     sigcache_total > (long long)csync_sigcache_size << 20 )
+		sigcache_trim();
+	return 0;
+
+fail:
+	csync_debug(1, "Can not store signature cache entry %s: %s\n",
+			tmpname, strerror(errno));
+	csync_sigcache_abort(fd, tmpname);
+	return -1;
+}
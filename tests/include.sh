@@ -63,17 +63,20 @@ dbg()
 # But we should be able to kill that daemon without using "killall".
 # So several layers of indirection are bad,
 # the caller would not know whom to kill really.
+#
+# With CSYNC2_CFGNAME set, csync2_$CSYNC2_CFGNAME.cfg is used instead of
+# csync2.cfg (see prepare_named_cfg_file), with its own databases.
 csync2_daemon()
 {
-	dbg 1 "CSYNC2_SYSTEM_DIR=$CSYNC2_SYSTEM_DIR csync2 -D $CSYNC2_DATABASE $*"
-	exec "$SOURCE_DIR/csync2" -D "$CSYNC2_DATABASE" "$@"
+	dbg 1 "CSYNC2_SYSTEM_DIR=$CSYNC2_SYSTEM_DIR csync2 -D $CSYNC2_DATABASE ${CSYNC2_CFGNAME:+-C $CSYNC2_CFGNAME }$*"
+	exec "$SOURCE_DIR/csync2" -D "$CSYNC2_DATABASE" ${CSYNC2_CFGNAME:+-C "$CSYNC2_CFGNAME"} "$@"
 }
 
 csync2()
 {
 	local ex
-	dbg 1 "CSYNC2_SYSTEM_DIR=$CSYNC2_SYSTEM_DIR csync2 -D $CSYNC2_DATABASE $*"
-	command "$SOURCE_DIR/csync2" -D "$CSYNC2_DATABASE" "$@"
+	dbg 1 "CSYNC2_SYSTEM_DIR=$CSYNC2_SYSTEM_DIR csync2 -D $CSYNC2_DATABASE ${CSYNC2_CFGNAME:+-C $CSYNC2_CFGNAME }$*"
+	command "$SOURCE_DIR/csync2" -D "$CSYNC2_DATABASE" ${CSYNC2_CFGNAME:+-C "$CSYNC2_CFGNAME"} "$@"
 	ex=$?
 	dbg 1 "exit code: $ex"
 	return $ex
@@ -84,10 +87,11 @@ cleanup()
 {
 	local host
 	local i
+	local cfg=${CSYNC2_CFGNAME:+_$CSYNC2_CFGNAME}
 	case $CSYNC2_DATABASE in
 		sqlite://*|sqlite2://*|sqlite3://*|/*)
 			mkdir -p "$CSYNC2_DATABASE/"
-			rm -f "$CSYNC2_DATABASE/"*.csync2.test.db*
+			rm -f "$CSYNC2_DATABASE/"*.csync2.test$cfg.db*
 			;;
 		pgsql://csync2:csync2@*/)
 			host=${CSYNC2_DATABASE#pgsql://csync2:csync2@}
@@ -95,7 +99,7 @@ cleanup()
 			[[ $host = *[/\ ]* ]] && bail_out "cannot use $CSYNC2_DATABASE"
 			for i in {1..9}; do
 				psql "host=$host user=csync2 password=csync2 dbname=postgres" \
-					-c "DROP DATABASE IF EXISTS csync2_${i}_csync2_test;" \
+					-c "DROP DATABASE IF EXISTS csync2_${i}_csync2_test$cfg;" \
 				|| bail_out "could not cleanup postgres database $i"
 			done
 			;;
@@ -105,7 +109,7 @@ cleanup()
 			[[ $host = *[/\ ]* ]] && bail_out "cannot use $CSYNC2_DATABASE"
 			for i in {1..9}; do
 				mysql --host=$host --user=csync2 --password=csync2 mysql \
-					-e "DROP DATABASE IF EXISTS csync2_${i}_csync2_test;" \
+					-e "DROP DATABASE IF EXISTS csync2_${i}_csync2_test$cfg;" \
 				|| bail_out "could not cleanup mysql database $i"
 			done
 			;;
@@ -150,6 +154,10 @@ prepare_cfg_file()
 
 		include %demodir%;
 		exclude %demodir%/e;
+
+		inplace %demodir%/inplace;
+		dedup %demodir%/dedup;
+		append-only %demodir%/append;
 	}
 
 	prefix demodir
@@ -169,6 +177,27 @@ prepare_cfg_file()
 ___
 }
 
+# generates csync2_$CSYNC2_CFGNAME.cfg from the groups and settings on
+# stdin, with the same %demodir% prefixes as the default config
+prepare_named_cfg_file()
+{
+	local CFG="$CSYNC2_SYSTEM_DIR/csync2_$CSYNC2_CFGNAME.cfg"
+	local i
+
+	dbg 0 "generating $CFG"
+	{
+		cat
+		echo "prefix demodir"
+		echo "{"
+		for i in {1..9}; do
+			echo "	on $i.csync2.test: $TESTS_DIR/$i;"
+		done
+		echo "}"
+		echo
+		echo "nossl * *;"
+	} > "$CFG"
+}
+
 __test_result_header()
 {
 	printf "# %s %s %s\n" $TEST_CALL_STACK
@@ -322,6 +351,33 @@ csync2_u()
 	fi
 }
 
+# Unlike csync2_u, which serves a single connection, keep servers for
+# the given hosts running (e.g. for several connections per peer), until
+# csync2_stop_servers. Their output goes to $TESTS_TMP_DIR/server.<host>.
+CSYNC2_SERVER_PIDS=""
+
+csync2_start_servers()
+{
+	local host now
+	for host; do
+		csync2 -N $host -ii -vv >> "$TESTS_TMP_DIR/server.$host" 2>&1 &
+		CSYNC2_SERVER_PIDS="$CSYNC2_SERVER_PIDS $!"
+		now=$SECONDS
+		while ! ss -tnl src $host:csync2 | grep -q ^LISTEN; do
+			(( SECONDS - now < 2 )) || bail_out "server for $host did not start"
+			sleep 0.1
+		done
+	done
+}
+
+csync2_stop_servers()
+{
+	[[ $CSYNC2_SERVER_PIDS ]] || return 0
+	kill $CSYNC2_SERVER_PIDS 2> /dev/null
+	wait $CSYNC2_SERVER_PIDS 2> /dev/null
+	CSYNC2_SERVER_PIDS=""
+}
+
 
 ################################
 ##  Basic setup code follows  ##
@@ -343,6 +399,7 @@ SOURCE_DIR=$(cd "$TESTS_DIR/.." && pwd )
 : CSYNC2_PORT	    ${CSYNC2_PORT:=30865}
 : CSYNC2_SYSTEM_DIR ${CSYNC2_SYSTEM_DIR:=$TESTS_DIR/etc}
 : CSYNC2_DATABASE   ${CSYNC2_DATABASE:=$TESTS_DIR/db}
+: CSYNC2_CFGNAME    ${CSYNC2_CFGNAME:=}
 
 : DEBUG_LEVEL=${DEBUG_LEVEL:=0}
 
@@ -359,7 +416,7 @@ case "$0" in
 *)
 
 	TESTS_TMP_DIR=$(mktemp -d "$TESTS_DIR/tmp.XXX")
-	trap 'rm -rf "$TESTS_TMP_DIR"' EXIT
+	trap 'csync2_stop_servers; rm -rf "$TESTS_TMP_DIR"' EXIT
 
 	__test_total_cnt=$(grep -Ece '^[[:space:]]*\<(TEST|TEST_EXPECT_EXIT_CODE|TEST_BREAK)\>' $0)
 	;;
@@ -369,7 +426,7 @@ if [[ $# -gt 1 ]] && [[ $1 = require ]]; then
 	"$@"
 fi
 
-export CSYNC2_SYSTEM_DIR CSYNC2_DATABASE
+export CSYNC2_SYSTEM_DIR CSYNC2_DATABASE CSYNC2_CFGNAME
 export TESTS_DIR TESTS_TMP_DIR SOURCE_DIR
 prepare_etc_hosts_bring_up_ips
 prepare_cfg_file
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+. $(dirname $0)/../include.sh
+
+# Files below %demodir%/inplace are patched in place
+# (see the inplace statement in the generated config),
+# so they keep their inode, while only the changed ranges are written.
+
+cleanup
+
+mkdir -p $D1/inplace
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+head -c 4M /dev/urandom > $D1/inplace/img
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+
+inode=$(stat -c %i $D2/inplace/img)
+
+# overwrite some blocks
+# ---------------------
+
+dd if=/dev/urandom of=$D1/inplace/img bs=4k seek=100 count=2 conv=notrunc status=none
+dd if=/dev/urandom of=$D1/inplace/img bs=4k seek=700 count=1 conv=notrunc status=none
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"same inode"	test $(stat -c %i $D2/inplace/img) = $inode
+
+# data moves towards the start (64k cut out), and the file grows
+# ---------------------------------------------------------------
+
+{
+	head -c 1M $D1/inplace/img
+	tail -c +$(( 1024*1024 + 65536 + 1 )) $D1/inplace/img
+	head -c 100k /dev/urandom
+} > $TESTS_TMP_DIR/img
+cat $TESTS_TMP_DIR/img > $D1/inplace/img
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"same inode"	test $(stat -c %i $D2/inplace/img) = $inode
+
+# data moves towards the end (64k inserted), and the file shrinks
+# ---------------------------------------------------------------
+
+{
+	head -c 512k $D1/inplace/img
+	head -c 64k /dev/urandom
+	tail -c +$(( 512*1024 + 1 )) $D1/inplace/img | head -c 2M
+} > $TESTS_TMP_DIR/img
+cat $TESTS_TMP_DIR/img > $D1/inplace/img
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"same inode"	test $(stat -c %i $D2/inplace/img) = $inode
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+. $(dirname $0)/../include.sh
+
+# Moved files are renamed on the peer instead of being sent again,
+# so they keep their inode there.
+
+cleanup
+
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+mkdir -p $D1/old
+head -c 1M /dev/urandom > $D1/old/a
+head -c 1M /dev/urandom > $D1/old/b
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+
+inode_a=$(stat -c %i $D2/old/a)
+inode_b=$(stat -c %i $D2/old/b)
+
+# rename a file, and a whole directory
+# ------------------------------------
+
+mv $D1/old/a $D1/old/c
+mv $D1/old $D1/new
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"same inode"	test $(stat -c %i $D2/new/c) = $inode_a
+TEST	"same inode"	test $(stat -c %i $D2/new/b) = $inode_b
+
+# moved and changed: sent as usual
+# --------------------------------
+
+mv $D1/new/b $D1/new/d
+echo more >> $D1/new/d
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
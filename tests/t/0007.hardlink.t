@@ -0,0 +1,28 @@
+#!/bin/bash
+
+. $(dirname $0)/../include.sh
+
+# Hard links are linked on the peer as well,
+# instead of being sent as independent files.
+
+cleanup
+
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+mkdir -p $D1/farm/a $D1/farm/b
+head -c 1M /dev/urandom > $D1/farm/a/file
+ln $D1/farm/a/file $D1/farm/b/file
+ln $D1/farm/a/file $D1/farm/b/other
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"linked"	test $(stat -c %h $D2/farm/a/file) = 3
+
+# a new link to a file the peer already has
+# -----------------------------------------
+
+ln $D1/farm/a/file $D1/farm/c
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"same inode"	test $(stat -c %i $D2/farm/c) = $(stat -c %i $D2/farm/a/file)
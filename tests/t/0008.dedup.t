@@ -0,0 +1,43 @@
+#!/bin/bash
+
+. $(dirname $0)/../include.sh
+
+# Files below %demodir%/dedup are synced by the chunks they share
+# with other files the peer has (see the dedup statement).
+
+cleanup
+
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+mkdir -p $D1/dedup
+head -c 2M /dev/urandom > $D1/dedup/base.img
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+
+# a clone of it, with data inserted and changed
+# ---------------------------------------------
+
+{
+	head -c 100k /dev/urandom
+	head -c 1M $D1/dedup/base.img
+	head -c 10k /dev/urandom
+	tail -c 1M $D1/dedup/base.img
+} > $D1/dedup/clone.img
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+
+# changed again, chunks repeated
+# ------------------------------
+
+{
+	head -c 512k $D1/dedup/clone.img
+	head -c 512k $D1/dedup/clone.img
+	head -c 5k /dev/urandom
+	tail -c 1M $D1/dedup/clone.img
+} > $D1/dedup/clone.new
+mv $D1/dedup/clone.new $D1/dedup/clone.img
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
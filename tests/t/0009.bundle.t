@@ -0,0 +1,36 @@
+#!/bin/bash
+
+. $(dirname $0)/../include.sh
+
+# Small files are sent in bundles (see the bundle-threshold statement),
+# with their mode and mtime.
+
+cleanup
+
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+mkdir -p $D1/bundle
+for i in $(seq 300); do
+	echo "file $i" > $D1/bundle/f$i
+done
+chmod 600 $D1/bundle/f1
+touch -d @1000000000 $D1/bundle/f2
+head -c 100k /dev/urandom > $D1/bundle/large
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"mode"		test $(stat -c %a $D2/bundle/f1) = 600
+TEST	"mtime"		test $(stat -c %Y $D2/bundle/f2) = 1000000000
+
+# changed on both sides: not taken, but reported as a conflict
+# ------------------------------------------------------------
+
+TEST	"init db 2"	csync2 -N $N2 -cIr $D2
+echo "changed on 1" > $D1/bundle/f3
+echo "changed on 2" > $D2/bundle/f3
+echo "changed on 1" > $D1/bundle/f4
+TEST	"check 1"	csync2 -N $N1 -cr $D1
+TEST	"check 2"	csync2 -N $N2 -cr $D2
+TEST_EXPECT_EXIT_CODE 1 "csync2 -uv" csync2_u $N1 $N2
+TEST	"f4 synced"	cmp $D1/bundle/f4 $D2/bundle/f4
+TEST	"f3 kept"	grep -q "changed on 2" $D2/bundle/f3
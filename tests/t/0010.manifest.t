@@ -0,0 +1,31 @@
+#!/bin/bash
+
+. $(dirname $0)/../include.sh
+
+# Dirty files the peer has in the same version already are only checked
+# with a manifest, and not sent again.
+
+cleanup
+
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+mkdir -p $D1/manifest
+for i in $(seq 20); do
+	echo "file $i" > $D1/manifest/f$i
+done
+head -c 100k /dev/urandom > $D1/manifest/large
+ln -s f1 $D1/manifest/link
+cp -a $D1/. $D2/
+touch -d @1000000000 $D1/manifest/f2
+echo "changed" > $D1/manifest/f3
+TEST	"init db 2"	csync2 -N $N2 -cIr $D2
+
+ino_f1=$(stat -c %i $D2/manifest/f1)
+ino_large=$(stat -c %i $D2/manifest/large)
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"f1 kept"	test $(stat -c %i $D2/manifest/f1) = $ino_f1
+TEST	"large kept"	test $(stat -c %i $D2/manifest/large) = $ino_large
+TEST	"mtime"		test $(stat -c %Y $D2/manifest/f2) = 1000000000
+TEST	"f3 synced"	grep -q "changed" $D2/manifest/f3
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+. $(dirname $0)/../include.sh
+
+# Files the peer has already are patched with a delta against its copy,
+# streamed while it is produced; the connection must stay in sync after
+# that, for the commands which follow (e.g. setting the mode).
+
+cleanup
+
+mkdir -p $D1/delta
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+for f in a b c; do
+	head -c 1M /dev/urandom > $D1/delta/$f
+done
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+
+# change some blocks
+# ------------------
+
+for f in a b c; do
+	dd if=/dev/urandom of=$D1/delta/$f bs=4k seek=10 count=1 conv=notrunc status=none
+	dd if=/dev/urandom of=$D1/delta/$f bs=4k seek=200 count=2 conv=notrunc status=none
+done
+chmod 600 $D1/delta/b
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"mode"		test $(stat -c %a $D2/delta/b) = 600
+
+# and once more, on the same connection as something else
+# -------------------------------------------------------
+
+dd if=/dev/urandom of=$D1/delta/a bs=4k seek=50 count=1 conv=notrunc status=none
+echo "new" > $D1/delta/new
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
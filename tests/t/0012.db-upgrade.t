@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# A database created by csync2 before the move, hardlink and chunk tables
+# existed (schema version 0) is upgraded when it is opened, and keeps its
+# content.
+
+. $(dirname $0)/../include.sh require \
+	eval '[[ $CSYNC2_DATABASE = /* ]] && type sqlite3 > /dev/null'
+
+cleanup
+
+db=$CSYNC2_DATABASE/$N1.db3
+sqlite3 $db <<'SQL'
+CREATE TABLE file (
+	filename, checktxt,
+	UNIQUE ( filename ) ON CONFLICT REPLACE
+);
+CREATE TABLE dirty (
+	filename, forced, myname, peername,
+	UNIQUE ( filename, peername ) ON CONFLICT IGNORE
+);
+CREATE TABLE hint (
+	filename, recursive,
+	UNIQUE ( filename, recursive ) ON CONFLICT IGNORE
+);
+CREATE TABLE action (
+	filename, command, logfile,
+	UNIQUE ( filename, command ) ON CONFLICT IGNORE
+);
+CREATE TABLE x509_cert (
+	peername, certdata,
+	UNIQUE ( peername ) ON CONFLICT IGNORE
+);
+INSERT INTO file VALUES ('/version-0', 'v1:mtime=0');
+SQL
+
+mkdir -p $D1/upgrade
+echo "upgraded" > $D1/upgrade/f
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"tables"	sqlite3 $db "SELECT count(*) FROM move, hardlink, chunk"
+TEST	"content kept"	test "$(sqlite3 $db "SELECT checktxt FROM file WHERE filename = '/version-0'")" = "v1:mtime=0"
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"reopen"	csync2 -N $N1 -cr $D1
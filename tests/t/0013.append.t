@@ -0,0 +1,60 @@
+#!/bin/bash
+
+. $(dirname $0)/../include.sh
+
+# Files below %demodir%/append are append-only (see the append-only
+# statement in the generated config): if they have only grown, just the
+# new data is appended to the peer's version, which keeps its inode.
+# Otherwise they are synced as usual.
+
+cleanup
+
+# the output of client and server, to check what has been done
+csync2_u_log()
+{
+	csync2_u "$@" > $TESTS_TMP_DIR/log 2>&1
+}
+
+mkdir -p $D1/append
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+head -c 200k /dev/urandom > $D1/append/log
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+
+inode=$(stat -c %i $D2/append/log)
+
+# grown: appended
+# ---------------
+
+head -c 100k /dev/urandom >> $D1/append/log
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u_log $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"same inode"	test $(stat -c %i $D2/append/log) = $inode
+TEST	"appended"	grep -q "Data has been appended successfully" $TESTS_TMP_DIR/log
+TEST_EXPECT_EXIT_CODE 1 "not refused" grep -q "OK (not_appended)" $TESTS_TMP_DIR/log
+
+# the last 64k the peer has rewritten, and grown: sent as usual
+# -------------------------------------------------------------
+
+dd if=/dev/urandom of=$D1/append/log bs=64k seek=3 count=2 status=none
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u_log $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"not appended"	grep -q "OK (not_appended)" $TESTS_TMP_DIR/log
+
+inode=$(stat -c %i $D2/append/log)
+
+# the peer's version has changed (same size and mtime, so it is not
+# dirty there): not appended to, but sent as usual
+# ------------------------------------------------------------------
+
+dd if=/dev/urandom of=$D2/append/log bs=1k seek=300 count=1 conv=notrunc status=none
+touch -r $D1/append/log $D2/append/log
+head -c 100k /dev/urandom >> $D1/append/log
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u_log $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"not appended"	grep -q "Not appending to .*/append/log, it has changed" $TESTS_TMP_DIR/log
@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# With parallel-peers, the peers are updated by worker processes at the
+# same time. Their errors add up: an unreachable peer makes csync2 fail,
+# but does not keep the others from being updated.
+
+CSYNC2_CFGNAME=peers
+. $(dirname $0)/../include.sh
+
+prepare_named_cfg_file <<___
+group peers
+{
+	host $N1 $N2 $N3;
+
+	key csync2.key_demo;
+
+	include %demodir%;
+}
+
+parallel-peers 2;
+___
+
+cleanup
+
+# is anything dirty for peer $1?
+dirty_for()
+{
+	csync2 -N $N1 -M | grep -q "	$1	"
+}
+
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+mkdir -p $D1/peers/a $D1/peers/b
+for i in $(seq 20); do
+	echo "a $i" > $D1/peers/a/f$i
+	echo "b $i" > $D1/peers/b/f$i
+done
+head -c 200k /dev/urandom > $D1/peers/large
+TEST	"check"		csync2 -N $N1 -cr $D1
+
+csync2_start_servers $N2 $N3
+TEST	"csync2 -uv"	csync2 -N $N1 -uvvv
+csync2_stop_servers
+TEST	"diff -rq 2"	diff -rq $D1 $D2
+TEST	"diff -rq 3"	diff -rq $D1 $D3
+
+# one peer unreachable
+# --------------------
+
+echo "changed" > $D1/peers/a/f1
+head -c 100k /dev/urandom >> $D1/peers/large
+TEST	"check"		csync2 -N $N1 -cr $D1
+
+csync2_start_servers $N2
+TEST_EXPECT_EXIT_CODE 1 "csync2 -uv" csync2 -N $N1 -uvvv
+csync2_stop_servers
+TEST	"diff -rq 2"	diff -rq $D1 $D2
+TEST_EXPECT_EXIT_CODE 1 "3 not synced" cmp -s $D1/peers/large $D3/peers/large
+TEST	"3 still dirty"	dirty_for $N3
+TEST_EXPECT_EXIT_CODE 1 "2 not dirty" dirty_for $N2
+
+# and back
+# --------
+
+csync2_start_servers $N3
+TEST	"csync2 -uv"	csync2 -N $N1 -uvvv
+csync2_stop_servers
+TEST	"diff -rq 3"	diff -rq $D1 $D3
+TEST_EXPECT_EXIT_CODE 2 "nothing dirty" csync2 -N $N1 -M
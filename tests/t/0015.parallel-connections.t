@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# With parallel-connections, many dirty files for one peer are split up
+# by the subtrees below their common directory, and each part is updated
+# over its own connection. A parent directory missing on the peer outside
+# of a worker's subtrees makes it fall back to a sequential redo.
+
+CSYNC2_CFGNAME=conn
+. $(dirname $0)/../include.sh
+
+prepare_named_cfg_file <<___
+group conn
+{
+	host $N1 $N2;
+
+	key csync2.key_demo;
+
+	include %demodir%;
+}
+
+parallel-connections 3;
+___
+
+cleanup
+
+# the output of the client, to check what has been done
+csync2_u_log()
+{
+	csync2 -N $N1 -uvv > $TESTS_TMP_DIR/log 2>&1
+}
+
+# the directories are known, but not dirty: they are missing on the peer
+mkdir -p $D1/conn/{a,b,c,d}
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+for d in a b c d; do
+	for i in $(seq 25); do
+		echo "$d $i" > $D1/conn/$d/f$i
+	done
+	head -c 100k /dev/urandom > $D1/conn/$d/large
+done
+# and a new one
+mkdir $D1/conn/e
+for i in $(seq 25); do
+	echo "e $i" > $D1/conn/e/f$i
+done
+TEST	"check"		csync2 -N $N1 -cr $D1
+
+csync2_start_servers $N2
+TEST	"csync2 -uv"	csync2_u_log
+TEST	"parallel"	grep -q "using [0-9]* connections" $TESTS_TMP_DIR/log
+TEST	"redo"		grep -q "missing parent dir : .*/conn$" $TESTS_TMP_DIR/log
+TEST	"diff -rq"	diff -rq $D1 $D2
+
+# all of them there now: no redo
+# ------------------------------
+
+for d in a b c d e; do
+	for i in $(seq 25); do
+		echo "$d $i changed" > $D1/conn/$d/f$i
+	done
+done
+dd if=/dev/urandom of=$D1/conn/a/large bs=4k seek=5 count=1 conv=notrunc status=none
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u_log
+TEST	"parallel"	grep -q "using [0-9]* connections" $TESTS_TMP_DIR/log
+TEST_EXPECT_EXIT_CODE 1 "no redo" grep -q "missing parent dir" $TESTS_TMP_DIR/log
+csync2_stop_servers
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST_EXPECT_EXIT_CODE 2 "nothing dirty" csync2 -N $N1 -M
@@ -0,0 +1,67 @@
+#!/bin/bash
+
+# A new file is patched from a similar file the peer has already, instead
+# of being sent as a whole: the newest backup of it, if it has been
+# deleted before, or a file in the same directory with an alike name and
+# size (e.g. the previous version of a versioned file name).
+
+CSYNC2_CFGNAME=basis
+. $(dirname $0)/../include.sh
+
+prepare_named_cfg_file <<___
+group basis
+{
+	host $N1 $N2;
+
+	key csync2.key_demo;
+
+	include %demodir%;
+
+	backup-directory $TESTS_TMP_DIR/backup;
+	backup-generations 3;
+}
+___
+
+cleanup
+
+# the output of client and server, to check what has been done
+csync2_u_log()
+{
+	csync2_u "$@" > $TESTS_TMP_DIR/log 2>&1
+}
+
+mkdir -p $D1/basis
+TEST	"init db 1"	csync2 -N $N1 -cIr $D1
+
+head -c 200k /dev/urandom > $D1/basis/app-1.2.2.jar
+head -c 200k /dev/urandom > $D1/basis/data
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+
+# the next version of a versioned file name
+# -----------------------------------------
+
+cp $D1/basis/app-1.2.2.jar $D1/basis/app-1.2.3.jar
+dd if=/dev/urandom of=$D1/basis/app-1.2.3.jar bs=4k seek=10 count=2 conv=notrunc status=none
+head -c 10k /dev/urandom >> $D1/basis/app-1.2.3.jar
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u_log $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"from sibling"	grep -q "Patching new file .*/basis/app-1.2.3.jar from .*/basis/app-1.2.2.jar" $TESTS_TMP_DIR/log
+
+# deleted, and created again: patched from the backup
+# ---------------------------------------------------
+
+cp $D1/basis/data $TESTS_TMP_DIR/data
+rm $D1/basis/data
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u $N1 $N2
+TEST	"deleted"	test ! -e $D2/basis/data
+
+cp $TESTS_TMP_DIR/data $D1/basis/data
+dd if=/dev/urandom of=$D1/basis/data bs=4k seek=20 count=1 conv=notrunc status=none
+TEST	"check"		csync2 -N $N1 -cr $D1
+TEST	"csync2 -uv"	csync2_u_log $N1 $N2
+TEST	"diff -rq"	diff -rq $D1 $D2
+TEST	"from backup"	grep -q "Patching new file .*/basis/data from $TESTS_TMP_DIR/backup/.*/basis/data\.$" $TESTS_TMP_DIR/log
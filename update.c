@@ -30,9 +30,15 @@
 #include <fnmatch.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
 
 static int connection_closed_error = 1;
 
+/* don't bother to open another connection for less files than this */
+#define PARALLEL_CONNECTIONS_MIN_FILES 32
+
 enum connection_response read_conn_status(const char *file, const char *host)
 {
 	char line[4096];
@@ -57,6 +63,41 @@ enum connection_response read_conn_status(const char *file, const char *host)
 	return conn_status;
 }
 
+/*
+ * Tell the peer which optional protocol features we support, and learn
+ * which of them it supports as well. Peers predating the FEATURES command
+ * answer with an unknown command error, which is not an error for us.
+ */
+static int negotiate_features(const char *peername)
+{
+	enum connection_response r;
+	char line[256];
+
+	conn_printf("FEATURES %s\n",
+			url_encode(conn_features_string(CSYNC_FEATURES_SUPPORTED)));
+	r = read_conn_status(NULL, peername);
+	if (r == CR_OK_DATA_FOLLOWS) {
+		if (!conn_gets(line, sizeof(line))) {
+			csync_debug(1, "Features command failed.\n");
+			conn_close();
+			return -1;
+		}
+		csync_conn_features = conn_features_parse(line) &
+			CSYNC_FEATURES_SUPPORTED;
+	} else if (r == CR_ERR_UNKNOWN_COMMAND) {
+		csync_error_count--;
+		csync_conn_features = 0;
+	} else {
+		csync_debug(1, "Features command failed.\n");
+		conn_close();
+		return -1;
+	}
+
+	csync_debug(2, "Protocol features for %s: %s\n", peername,
+			csync_conn_features ? conn_features_string(csync_conn_features) : "none");
+	return 0;
+}
+
 int connect_to_host(const char *peername)
 {
 	int use_ssl = 1;
@@ -101,6 +142,9 @@ int connect_to_host(const char *peername)
 		return -1;
 	}
 
+	if (use_ssl)
+		conn_activate_ktls();
+
 	if (active_grouplist) {
 		conn_printf("GROUP %s\n", url_encode(active_grouplist));
 		if (!is_ok_response(read_conn_status(NULL, peername))) {
@@ -110,9 +154,131 @@ int connect_to_host(const char *peername)
 		}
 	}
 
+	return negotiate_features(peername);
+}
+
+/*
+ * Compare the whole file digest from a DIGEST response with ours.
+ * Return: 1 if they differ, 0 if they are equal, -1 on error.
+ */
+static int csync_compare_digest(const char *filename, int isreg, int known_diff)
+{
+	char peer_digest[256], digest[100];
+
+	if (!conn_gets(peer_digest, sizeof(peer_digest)))
+		return -1;
+	peer_digest[strcspn(peer_digest, "\n")] = 0;
+	if (known_diff)
+		return 1;
+
+	if (csync_rs_digest(filename, isreg, digest, sizeof(digest))) {
+		csync_debug(0, "I/O Error '%s' while computing digest: %s\n",
+				strerror(errno), filename);
+		return -1;
+	}
+
+	if (strcmp(peer_digest, digest)) {
+		csync_debug(2, "File is different on peer (digest).\n");
+		csync_debug(3, ">>> PEER:  %s\n>>> LOCAL: %s\n", peer_digest, digest);
+		return 1;
+	}
 	return 0;
 }
 
+/*
+ * The command to compare a file with the peer: the whole file digest,
+ * the digests of the signature, or the signature itself.
+ */
+static const char *check_command(void)
+{
+	if (csync_conn_features & CSYNC_FEATURE_DIGEST)
+		return "DIGEST";
+	if (csync_conn_features & CSYNC_FEATURE_SIGLIST)
+		return "SIGLIST";
+	return "SIG";
+}
+
+/*
+ * Compare with the response to check_command(). If the checktxt already
+ * tells the file is different, only the response is consumed.
+ * Return: 1 if they differ, 0 if they are equal, -1 on error.
+ */
+static int check_response(const char *filename, int isreg, int known_diff)
+{
+	if (csync_conn_features & CSYNC_FEATURE_DIGEST)
+		return csync_compare_digest(filename, isreg, known_diff);
+	if (csync_conn_features & CSYNC_FEATURE_SIGLIST)
+		return csync_rs_check_siglist(filename, isreg, known_diff);
+	return csync_rs_check(filename, isreg, known_diff);
+}
+
+/*
+ * If the file is append-only and the peer's version (as told by its
+ * checktxt) is smaller, ours may just have grown from it: the offset
+ * to append the rest at, or 0.
+ */
+static long long append_offset(const char *filename, const char *peer_checktxt,
+		const struct stat *st)
+{
+	const char *p;
+	long long size;
+
+	if ( !(csync_conn_features & CSYNC_FEATURE_APPEND) || !S_ISREG(st->st_mode) ||
+	     !csync_append_only(filename) )
+		return 0;
+	p = strstr(peer_checktxt, ":type=reg:size=");
+	if ( !p || sscanf(p, ":type=reg:size=%lld", &size) != 1 )
+		return 0;
+	return size > 0 && size < st->st_size ? size : 0;
+}
+
+/*
+ * Another name of this file (see csync_check_hardlink()) which is up to
+ * date on the peer, so the peer can link to it instead of getting the
+ * file again, or NULL.
+ */
+static char *hardlink_source(const char *peername, const char *filename,
+		const char *key, const struct stat *st)
+{
+	struct textlist *tl = NULL, *t;
+	char *source = NULL;
+	char inode[64];
+	struct stat sst;
+
+	snprintf(inode, sizeof(inode), "%llx-%llx",
+			(unsigned long long)st->st_dev,
+			(unsigned long long)st->st_ino);
+
+	SQL_BEGIN("Get other names of this file",
+		"SELECT filename FROM hardlink WHERE inode = '%s' AND filename != '%s'",
+		inode, url_encode(filename))
+	{
+		textlist_add(&tl, url_decode(SQL_V(0)), 0);
+	} SQL_END;
+
+	for (t = tl; t != 0 && !source; t = t->next) {
+		const char *other_key = csync_key(peername, t->value);
+		int dirty = 0;
+
+		/* the peer checks the permissions for both names with this key */
+		if ( !other_key || strcmp(other_key, key) ||
+		     lstat_strict(prefixsubst(t->value), &sst) != 0 ||
+		     sst.st_dev != st->st_dev || sst.st_ino != st->st_ino )
+			continue;
+
+		SQL_BEGIN("Check if the other name is dirty",
+			"SELECT 1 FROM dirty WHERE filename = '%s' AND peername = '%s'",
+			url_encode(t->value), url_encode(peername))
+		{
+			dirty = 1;
+		} SQL_END;
+		if (!dirty)
+			source = strdup(t->value);
+	}
+	textlist_free(tl);
+	return source;
+}
+
 static int get_auto_method(const char *peername, const char *filename)
 {
 	const struct csync_group *g = 0;
@@ -180,7 +346,7 @@ auto_resolve_entry_point:
 		int i, found_diff = 0;
 		int rs_check_result;
 
-		conn_printf("SIG %s %s\n",
+		conn_printf("%s %s %s\n", check_command(),
 				url_encode(key), url_encode(filename));
 
 		last_conn_status = read_conn_status(filename, peername);
@@ -202,7 +368,7 @@ auto_resolve_entry_point:
 				break;
 			}
 
-		rs_check_result = csync_rs_check(filename, 0);
+		rs_check_result = check_response(filename, 0, found_diff);
 		if ( rs_check_result < 0 )
 			goto got_error;
 		if ( rs_check_result ) {
@@ -300,6 +466,8 @@ enum connection_response csync_update_file_mod(const char *peername,
 	struct stat st;
 	enum connection_response last_conn_status = CR_ERROR;
 	int auto_resolve_run = 0;
+	int peer_missing;
+	long long offset;
 	const char *key = csync_key(peername, filename);
 
 	if ( !key ) {
@@ -309,6 +477,8 @@ enum connection_response csync_update_file_mod(const char *peername,
 
 auto_resolve_entry_point:
 	csync_debug(1, "Updating %s on %s ...\n", filename, peername);
+	peer_missing = 0;
+	offset = 0;
 
 	if ( lstat_strict(prefixsubst(filename), &st) != 0 ) {
 		csync_debug(0, "ERROR: Cant stat %s.\n", filename);
@@ -332,14 +502,20 @@ auto_resolve_entry_point:
 		int i, found_diff = 0;
 		int rs_check_result;
 
-		conn_printf("SIG %s %s\n",
-				url_encode(key), url_encode(filename));
+		/* DIGEST does not compute a digest of a file of another size */
+		if ( (csync_conn_features & CSYNC_FEATURE_DIGEST) && S_ISREG(st.st_mode) )
+			conn_printf("DIGEST %s %s %lld\n", url_encode(key),
+					url_encode(filename), (long long)st.st_size);
+		else
+			conn_printf("%s %s %s\n", check_command(),
+					url_encode(key), url_encode(filename));
 		last_conn_status = read_conn_status(filename, peername);
 
 		if (!is_ok_response(last_conn_status)) {
 			csync_debug(3, "error from peer\n");
 			goto got_error;
 		}
+		peer_missing = last_conn_status == CR_OK_PATH_NOT_FOUND;
 
 		if ( !conn_gets(chk1, sizeof(chk1)) ) goto got_error;
 		chk2 = csync_genchecktxt(&st, filename, 1);
@@ -351,13 +527,15 @@ auto_resolve_entry_point:
 				break;
 			}
 
-		rs_check_result = csync_rs_check(filename, S_ISREG(st.st_mode));
+		rs_check_result = check_response(filename, S_ISREG(st.st_mode), found_diff);
 		if ( rs_check_result < 0 )
 			goto got_error;
 		if ( rs_check_result ) {
 			csync_debug(2, "File is different on peer (rsync sig).\n");
 			found_diff=1;
 		}
+		if ( found_diff )
+			offset = append_offset(filename, chk1, &st);
 		last_conn_status = read_conn_status(filename, peername);
 		if (!is_ok_response(last_conn_status))
 			goto got_error;
@@ -378,23 +556,94 @@ auto_resolve_entry_point:
 	}
 
 	if ( S_ISREG(st.st_mode) ) {
-		conn_printf("PATCH %s %s\n",
-				url_encode(key), url_encode(filename));
-		last_conn_status = read_conn_status(filename, peername);
-		/* FIXME be more specific?
-		 * (last_conn_status != CR_OK_SEND_DATA) ??
-		 * (last_conn_status == CR_ERR_ALSO_DIRTY_HERE) ?? */
-		if (!is_ok_response(last_conn_status))
-			goto maybe_auto_resolve;
+		/* The peer may have the chunks of it, in whichever files. */
+		int chunks = (csync_conn_features & CSYNC_FEATURE_CHUNKS) &&
+			csync_dedup(filename) && !csync_inplace(filename) &&
+			st.st_size > 0 && st.st_size >= csync_whole_file_threshold;
+		/* The peer may have a similar file to patch a new one from. */
+		int basis = (csync_conn_features & CSYNC_FEATURE_BASIS) && !chunks &&
+			peer_missing && st.st_size > 0 &&
+			st.st_size >= csync_whole_file_threshold;
+		/* Nothing to compute a delta against, or not worth the round
+		 * trip for the signature: just send the whole file. */
+		int put = (csync_conn_features & CSYNC_FEATURE_PUT) && !basis && !chunks &&
+			(peer_missing || st.st_size < csync_whole_file_threshold);
+		int appended = 0, linked = 0;
+		char check[100], digest[100], *source;
+
+		/* Another name of it is up to date on the peer: link to that. */
+		if ( (csync_conn_features & CSYNC_FEATURE_LINK) && st.st_nlink > 1 &&
+		     (source = hardlink_source(peername, filename, key, &st)) ) {
+			if ( !csync_rs_digest(filename, 1, digest, sizeof(digest)) ) {
+				conn_printf("LINK %s %s %s %s %s\n",
+						url_encode(key), url_encode(filename),
+						url_encode(source),
+						url_encode(csync_genchecktxt(&st, filename, 0)),
+						url_encode(digest));
+				last_conn_status = read_conn_status(filename, peername);
+				if (last_conn_status == CR_OK_NOT_LINKED)
+					csync_debug(2, "Peer has not linked, sending the file.\n");
+				else if (!is_ok_response(last_conn_status)) {
+					free(source);
+					goto maybe_auto_resolve;
+				} else
+					linked = 1;
+			}
+			free(source);
+		}
 
-		if ( csync_rs_delta(filename) ) {
-			//why is the response ignored?
+		/* An append-only file that has only grown: send what is new. */
+		if ( !linked && offset > 0 &&
+		     !csync_rs_append_check(filename, offset, check, sizeof(check)) ) {
+			conn_printf("APPEND %s %s %lld %s\n",
+					url_encode(key), url_encode(filename), offset, check);
 			last_conn_status = read_conn_status(filename, peername);
-			goto got_error;
+			if (last_conn_status == CR_OK_NOT_APPENDED)
+				csync_debug(2, "Peer has not appended, sending the file.\n");
+			else if (!is_ok_response(last_conn_status))
+				goto maybe_auto_resolve;
+			else {
+				if ( csync_rs_append_send(filename, offset) ) {
+					last_conn_status = read_conn_status(filename, peername);
+					goto got_error;
+				}
+				last_conn_status = read_conn_status(filename, peername);
+				if (!is_ok_response(last_conn_status))
+					goto got_error;
+				appended = 1;
+			}
+		}
+
+		if ( !appended && !linked ) {
+			if (chunks)
+				conn_printf("CHUNKS %s %s\n",
+						url_encode(key), url_encode(filename));
+			else if (basis)
+				conn_printf("PATCH %s %s %lld\n", url_encode(key),
+						url_encode(filename), (long long)st.st_size);
+			else
+				conn_printf("%s %s %s\n", put ? "PUT" : "PATCH",
+						url_encode(key), url_encode(filename));
+			last_conn_status = read_conn_status(filename, peername);
+			/* FIXME be more specific?
+			 * (last_conn_status != CR_OK_SEND_DATA) ??
+			 * (last_conn_status == CR_ERR_ALSO_DIRTY_HERE) ?? */
+			if (!is_ok_response(last_conn_status))
+				goto maybe_auto_resolve;
+
+			if ( chunks ? csync_cdc_send(filename) :
+			     put ? csync_rs_put(filename) :
+			     last_conn_status == CR_OK_SEND_DATA_INPLACE ?
+					csync_rs_delta_inplace(filename) :
+					csync_rs_delta(filename) ) {
+				//why is the response ignored?
+				last_conn_status = read_conn_status(filename, peername);
+				goto got_error;
+			}
+			last_conn_status = read_conn_status(filename, peername);
+			if (!is_ok_response(last_conn_status))
+				goto got_error;
 		}
-		last_conn_status = read_conn_status(filename, peername);
-		if (!is_ok_response(last_conn_status))
-			goto got_error;
 	} else
 	if ( S_ISDIR(st.st_mode) ) {
 		conn_printf("MKDIR %s %s\n",
@@ -452,6 +701,23 @@ auto_resolve_entry_point:
 		goto got_error;
 	}
 
+	if ( csync_conn_features & CSYNC_FEATURE_ATTRS ) {
+		/* owner, mode and mtime with a single round trip */
+		if ( S_ISLNK(st.st_mode) )
+			conn_printf("ATTRS %s %s %d %d - -\n",
+					url_encode(key), url_encode(filename),
+					st.st_uid, st.st_gid);
+		else
+			conn_printf("ATTRS %s %s %d %d %d %lld\n",
+					url_encode(key), url_encode(filename),
+					st.st_uid, st.st_gid, st.st_mode,
+					(long long)st.st_mtime);
+		last_conn_status = read_conn_status(filename, peername);
+		if (!is_ok_response(last_conn_status))
+			goto got_error;
+		goto done;
+	}
+
 	conn_printf("SETOWN %s %s %d %d\n",
 			url_encode(key), url_encode(filename),
 			st.st_uid, st.st_gid);
@@ -477,6 +743,7 @@ skip_action:
 			goto got_error;
 	}
 
+done:
 	SQL("Remove dirty-file entry.",
 		"DELETE FROM dirty WHERE filename = '%s' "
 		"AND peername = '%s'", url_encode(filename),
@@ -630,6 +897,9 @@ struct update_context {
 	int dry_run;
 
 	char *missing_parent_dir;
+
+	/* if set, only update files in these subtrees */
+	struct textlist *subtrees;
 };
 
 enum connection_response conn_hello(struct update_context *c, struct textlist *t)
@@ -647,9 +917,155 @@ enum connection_response conn_hello(struct update_context *c, struct textlist *t
 	return r;
 }
 
+/*
+ * Small regular files are sent with BUNDLE, many at once, each with its
+ * owner, mode and mtime, without asking the peer for its version first.
+ * The files the peer has not taken are synced one by one afterwards.
+ */
+#define BUNDLE_MAX_FILES	256
+#define BUNDLE_MAX_BYTES	(4 << 20)
+
+/* intvalue (otherwise the force flag) of dirty entries after BUNDLE */
+#define BUNDLE_TAKEN		-1
+#define BUNDLE_NOT_TAKEN	-2
+
+struct update_bundle {
+	struct textlist *entry[BUNDLE_MAX_FILES];
+	int count;
+	long long bytes;
+};
+
+static int csync_update_bundle_add(struct update_bundle *b,
+		struct update_context *c, struct textlist *t)
+{
+	struct stat st;
+
+	if ( !(csync_conn_features & CSYNC_FEATURE_BUNDLE) || c->dry_run ||
+	     csync_bundle_threshold <= 0 || t->intvalue != 0 )
+		return 0;
+	/* all of them are sent with the same HELLO */
+	if ( b->count && strcmp(b->entry[0]->value2, t->value2) )
+		return 0;
+	/* hard links are linked on the peer, see csync_update_file_mod() */
+	if ( lstat_strict(prefixsubst(t->value), &st) != 0 || !S_ISREG(st.st_mode) ||
+	     st.st_size > csync_bundle_threshold || st.st_nlink > 1 ||
+	     !csync_key(c->peername, t->value) )
+		return 0;
+
+	b->entry[b->count++] = t;
+	b->bytes += st.st_size;
+	return 1;
+}
+
+static int csync_update_bundle_full(struct update_bundle *b)
+{
+	return b->count == BUNDLE_MAX_FILES || b->bytes >= BUNDLE_MAX_BYTES;
+}
+
+/* Send one file of the bundle, see csync_daemon_bundle(). */
+static void csync_update_bundle_file(struct update_context *c, const char *filename)
+{
+	static char data[CSYNC_BUNDLE_MAX_FILE_SIZE];
+	const char *key = csync_key(c->peername, filename);
+	long long size = -1;
+	struct stat st;
+	int fd, rc;
+
+	fd = open(prefixsubst(filename), O_RDONLY);
+	if ( fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	     st.st_size <= sizeof(data) ) {
+		for (size = 0; size < st.st_size; size += rc) {
+			rc = read(fd, data + size, st.st_size - size);
+			if ( rc < 0 && errno == EINTR ) {
+				rc = 0;
+				continue;
+			}
+			if ( rc <= 0 )
+				break;
+		}
+		if ( size != st.st_size )
+			size = -1;
+	}
+	if ( fd >= 0 )
+		close(fd);
+	if ( size < 0 ) {
+		csync_debug(1, "Can not read %s for bundle, will sync it on its own.\n", filename);
+		conn_printf("%s %s 0 0 0 0 -1\n", url_encode(key), url_encode(filename));
+		return;
+	}
+
+	conn_printf("%s %s %d %d %d %lld %lld\n", url_encode(key), url_encode(filename),
+			st.st_uid, st.st_gid, st.st_mode, (long long)st.st_mtime, size);
+	if ( size && conn_write(data, size) != size )
+		csync_fatal("Write-error while sending data.\n");
+}
+
+/*
+ * Send the bundle, and mark its files as BUNDLE_TAKEN or BUNDLE_NOT_TAKEN.
+ * Return: the status of the connection.
+ */
+static enum connection_response csync_update_bundle_send(struct update_bundle *b,
+		struct update_context *c)
+{
+	char result[BUNDLE_MAX_FILES + 2];
+	enum connection_response r;
+	int i;
+
+	for (i = 0; i < b->count; i++)
+		b->entry[i]->intvalue = BUNDLE_NOT_TAKEN;
+
+	r = conn_hello(c, b->entry[0]);
+	if ( !is_ok_response(r) || connection_closed_error )
+		return r;
+
+	csync_debug(1, "Updating %d small files on %s ...\n", b->count, c->peername);
+	conn_printf("BUNDLE %d\n", b->count);
+	r = read_conn_status(NULL, c->peername);
+	if ( r != CR_OK_SEND_DATA ) {
+		if ( connection_closed_error )
+			return r;
+		/* they are synced one by one, with their own errors */
+		if ( !is_ok_response(r) )
+			csync_error_count--;
+		return CR_OK;
+	}
+
+	for (i = 0; i < b->count; i++)
+		csync_update_bundle_file(c, b->entry[i]->value);
+
+	r = read_conn_status(NULL, c->peername);
+	if ( r != CR_OK_DATA_FOLLOWS )
+		return r;
+	if ( !conn_gets(result, sizeof(result)) ||
+	     strlen(result) != b->count + 1 ) {
+		csync_debug(0, "ERROR: Bad answer to BUNDLE from %s.\n", c->peername);
+		csync_error_count++;
+		return CR_ERROR;
+	}
+	r = read_conn_status(NULL, c->peername);
+
+	for (i = 0; i < b->count; i++) {
+		const char *filename = b->entry[i]->value;
+
+		if ( result[i] != '+' ) {
+			csync_debug(2, "Peer has not taken %s (%c), syncing it on its own.\n",
+					filename, result[i]);
+			continue;
+		}
+		b->entry[i]->intvalue = BUNDLE_TAKEN;
+		csync_debug(2, "Updated %s on %s with bundle.\n", filename, c->peername);
+		SQL("Remove dirty-file entry.",
+			"DELETE FROM dirty WHERE filename = '%s' "
+			"AND peername = '%s'", url_encode(filename),
+			url_encode(c->peername));
+	}
+	return r;
+}
+
 enum connection_response csync_update_tl_mod(struct textlist *tl_mod, struct update_context *c)
 {
-	struct textlist *t;
+	struct update_bundle b = { .count = 0 };
+	struct textlist *t, *next;
 	char *skip_subtree;
 	size_t skip_subtree_len;
 	enum connection_response r = CR_OK;
@@ -661,7 +1077,8 @@ enum connection_response csync_update_tl_mod(struct textlist *tl_mod, struct upd
 	skip_subtree = c->missing_parent_dir;
 	skip_subtree_len = skip_subtree ? strlen(skip_subtree) : 0;
 
-	for (t = tl_mod; t != 0; t = t->next) {
+	for (t = tl_mod; t != 0; t = next) {
+		next = t->next;
 		if (skip_subtree) {
 			int cmp = strncmp(skip_subtree, t->value, skip_subtree_len);
 			if (cmp > 0)
@@ -673,11 +1090,29 @@ enum connection_response csync_update_tl_mod(struct textlist *tl_mod, struct upd
 			skip_subtree = NULL;
 			skip_subtree_len = 0;
 		}
+		if (t->intvalue == BUNDLE_TAKEN)
+			continue;
+		/* collect small files until the bundle is full, or the next
+		 * file does not fit in; then go back to sync the files the
+		 * peer has not taken, in order */
+		if (csync_update_bundle_add(&b, c, t) &&
+		    next && !csync_update_bundle_full(&b))
+			continue;
+		if (b.count) {
+			r = csync_update_bundle_send(&b, c);
+			if (!is_ok_response(r))
+				return r;
+			next = b.entry[0];
+			b.count = 0;
+			b.bytes = 0;
+			continue;
+		}
 		r = conn_hello(c, t);
 		if (!is_ok_response(r))
 			return r;
 		if (!connection_closed_error)
-			r = csync_update_file_mod(c->peername, t->value, t->intvalue, c->dry_run);
+			r = csync_update_file_mod(c->peername, t->value,
+					t->intvalue < 0 ? 0 : t->intvalue, c->dry_run);
 
 		if (r == CR_ERR_PARENT_DIR_MISSING) {
 			struct textlist *tl = NULL;
@@ -711,6 +1146,257 @@ enum connection_response csync_update_tl_mod(struct textlist *tl_mod, struct upd
 	return r;
 }
 
+/*
+ * Ask the peer to rename its copy of oldname to filename, if it is exactly
+ * our (moved) file. Return: 0 if it did, 1 if it did not, -1 on error.
+ */
+static int csync_update_file_rename(const char *peername,
+		const char *filename, const char *oldname)
+{
+	const char *key = csync_key(peername, filename);
+	const char *oldkey = csync_key(peername, oldname);
+	enum connection_response r;
+	char digest[100];
+	struct stat st;
+
+	/* the peer checks the permissions for both names with this key */
+	if ( !key || !oldkey || strcmp(key, oldkey) )
+		return 1;
+	if ( lstat_strict(prefixsubst(filename), &st) != 0 || !S_ISREG(st.st_mode) ||
+	     csync_rs_digest(filename, 1, digest, sizeof(digest)) )
+		return 1;
+
+	csync_debug(1, "Renaming %s to %s on %s ...\n", oldname, filename, peername);
+	conn_printf("RENAME %s %s %s %s %s\n",
+			url_encode(key), url_encode(filename), url_encode(oldname),
+			url_encode(csync_genchecktxt(&st, filename, 0)),
+			url_encode(digest));
+	r = read_conn_status(filename, peername);
+	if (r == CR_OK_NOT_RENAMED) {
+		csync_debug(2, "Not renamed, deleting and sending it instead.\n");
+		return 1;
+	}
+	if (!is_ok_response(r))
+		return -1;
+
+	SQL("Remove dirty-file entry.",
+		"DELETE FROM dirty WHERE (filename = '%s' OR filename = '%s') "
+		"AND peername = '%s'", url_encode(filename), url_encode(oldname),
+		url_encode(peername));
+	return 0;
+}
+
+static int textlist_cmp_value(const void *a, const void *b)
+{
+	const struct textlist *x = *(struct textlist **)a;
+	const struct textlist *y = *(struct textlist **)b;
+	return strcmp(x->value, y->value);
+}
+
+/*
+ * Before anything else, let the peer rename its copies of the files which
+ * have been moved here (see csync_check_move()), and drop both names from
+ * the dirty list if it did. Otherwise, they are deleted and sent as usual.
+ */
+static void csync_update_moves(struct update_context *c, struct textlist **tl)
+{
+	struct textlist *t, **tp, **index, key, *keyp = &key;
+	struct stat st;
+	int n = 0, renamed = 0;
+
+	if ( !(csync_conn_features & CSYNC_FEATURE_RENAME) || c->dry_run )
+		return;
+
+	for (t = *tl; t != 0; t = t->next)
+		n++;
+	index = malloc(n * sizeof(*index));
+	n = 0;
+	for (t = *tl; t != 0; t = t->next)
+		index[n++] = t;
+	qsort(index, n, sizeof(*index), textlist_cmp_value);
+
+	/* forced entries are never renamed */
+	for (t = *tl; t != 0; t = t->next) {
+		struct textlist **newp = NULL;
+
+		if ( t->intvalue ||
+		     (lstat_strict(prefixsubst(t->value), &st) == 0 && !csync_check_pure(t->value)) )
+			continue;
+
+		SQL_BEGIN("Checking for move entry",
+			"SELECT filename FROM move WHERE oldname = '%s'",
+			url_encode(t->value))
+		{
+			if (!newp) {
+				key.value = (char *)url_decode(SQL_V(0));
+				newp = bsearch(&keyp, index, n, sizeof(*index), textlist_cmp_value);
+			}
+		} SQL_END;
+
+		/* not dirty for this peer, forced, or already done */
+		if ( !newp || (*newp)->intvalue )
+			continue;
+
+		if ( !is_ok_response(conn_hello(c, t)) || connection_closed_error )
+			break;
+		if ( csync_update_file_rename(c->peername, (*newp)->value, t->value) )
+			continue;
+		/* marks them done */
+		t->intvalue = (*newp)->intvalue = -1;
+		renamed++;
+	}
+	free(index);
+
+	if (!renamed)
+		return;
+	for (tp = tl; (t = *tp) != 0; ) {
+		if (t->intvalue < 0) {
+			*tp = t->next;
+			t->next = 0;
+			textlist_free(t);
+		} else
+			tp = &t->next;
+	}
+}
+
+/*
+ * Before syncing the dirty files one by one, send the peer a MANIFEST of
+ * them, with their checktxt and DIGEST, many at once. The files it has in
+ * the same version already (e.g. after both have been restored from the
+ * same backup) only get their mtime set there, and are dropped from the
+ * dirty list.
+ */
+#define MANIFEST_MAX_FILES	1024
+
+/* Return: the number of files the peer has already, or -1 on error. */
+static int csync_update_manifest_send(struct update_context *c,
+		struct textlist **entry, int count)
+{
+	char result[MANIFEST_MAX_FILES + 2], digest[100];
+	enum connection_response r;
+	struct stat st;
+	int i, same = 0;
+
+	r = conn_hello(c, entry[0]);
+	if ( !is_ok_response(r) || connection_closed_error )
+		return -1;
+
+	csync_debug(2, "Sending manifest of %d dirty files to %s ...\n",
+			count, c->peername);
+	conn_printf("MANIFEST %d\n", count);
+	r = read_conn_status(NULL, c->peername);
+	if ( r != CR_OK_SEND_DATA ) {
+		if ( connection_closed_error )
+			return -1;
+		/* they are synced one by one, with their own errors */
+		if ( !is_ok_response(r) )
+			csync_error_count--;
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		const char *filename = entry[i]->value;
+		const char *key = csync_key(c->peername, filename);
+
+		/* changed again in the meantime: it will not match */
+		if ( lstat_strict(prefixsubst(filename), &st) != 0 ) {
+			conn_printf("%s %s - - -\n", url_encode(key), url_encode(filename));
+			continue;
+		}
+		conn_printf("%s %s ", url_encode(key), url_encode(filename));
+		conn_printf("%s ", url_encode(csync_genchecktxt(&st, filename, 1)));
+		if ( csync_rs_digest(filename, S_ISREG(st.st_mode), digest, sizeof(digest)) )
+			strcpy(digest, "x");
+		if ( S_ISLNK(st.st_mode) )
+			conn_printf("%s -\n", url_encode(digest));
+		else
+			conn_printf("%s %lld\n", url_encode(digest), (long long)st.st_mtime);
+	}
+
+	r = read_conn_status(NULL, c->peername);
+	if ( r != CR_OK_DATA_FOLLOWS )
+		return -1;
+	if ( !conn_gets(result, sizeof(result)) ||
+	     strlen(result) != count + 1 ) {
+		csync_debug(0, "ERROR: Bad answer to MANIFEST from %s.\n", c->peername);
+		csync_error_count++;
+		return -1;
+	}
+	r = read_conn_status(NULL, c->peername);
+
+	for (i = 0; i < count; i++) {
+		const char *filename = entry[i]->value;
+
+		if ( result[i] != '=' )
+			continue;
+		/* marks it done */
+		entry[i]->intvalue = -1;
+		same++;
+		csync_debug(2, "Peer has %s already.\n", filename);
+		SQL("Remove dirty-file entry.",
+			"DELETE FROM dirty WHERE filename = '%s' "
+			"AND peername = '%s'", url_encode(filename),
+			url_encode(c->peername));
+	}
+
+	return is_ok_response(r) ? same : -1;
+}
+
+static void csync_update_manifest(struct update_context *c, struct textlist **tl)
+{
+	struct textlist *entry[MANIFEST_MAX_FILES], *t, **tp;
+	struct stat st;
+	int count = 0, same = 0, rc;
+
+	if ( !(csync_conn_features & CSYNC_FEATURE_MANIFEST) || c->dry_run )
+		return;
+
+	/* forced entries are always sent, deleted ones never match */
+	for (t = *tl; t != 0; t = t->next) {
+		if ( t->intvalue || !csync_key(c->peername, t->value) ||
+		     lstat_strict(prefixsubst(t->value), &st) != 0 ||
+		     csync_check_pure(t->value) )
+			continue;
+		/* all of them are sent with the same HELLO */
+		if ( count == MANIFEST_MAX_FILES ||
+		     (count && strcmp(entry[0]->value2, t->value2)) ) {
+			rc = csync_update_manifest_send(c, entry, count);
+			if ( rc < 0 )
+				break;
+			same += rc;
+			count = 0;
+		}
+		entry[count++] = t;
+	}
+	if ( !t && count ) {
+		rc = csync_update_manifest_send(c, entry, count);
+		if ( rc > 0 )
+			same += rc;
+	}
+
+	if (!same)
+		return;
+	csync_debug(1, "%d dirty files are up to date on %s already.\n",
+			same, c->peername);
+	for (tp = tl; (t = *tp) != 0; ) {
+		if (t->intvalue < 0) {
+			*tp = t->next;
+			t->next = 0;
+			textlist_free(t);
+		} else
+			tp = &t->next;
+	}
+}
+
+static int in_subtrees(struct update_context *c, const char *filename)
+{
+	struct textlist *t;
+	for (t = c->subtrees; t != 0; t = t->next)
+		if (compare_files(filename, t->value, 1))
+			return 1;
+	return 0;
+}
+
 struct textlist *csync_find_dirty(struct update_context *c)
 {
 	struct textlist *tl = NULL;
@@ -725,6 +1411,8 @@ struct textlist *csync_find_dirty(struct update_context *c)
 		for (i=0; i < c->patnum && !use_this; i++)
 			if (compare_files(filename, c->patlist[i], c->recursive))
 				use_this = 1;
+		if (use_this && c->subtrees)
+			use_this = in_subtrees(c, filename);
 		if (use_this)
 			textlist_add2(&tl, filename, url_decode(SQL_V(1)), atoi(SQL_V(2)));
 	} SQL_END;
@@ -732,12 +1420,359 @@ struct textlist *csync_find_dirty(struct update_context *c)
 	return tl;
 }
 
+/*
+ * Update workers report their error count and whether they need the
+ * parent to redo the update (see csync_update_worker()) in the exit code.
+ */
+#define WORKER_EXIT_REDO 128
+
+static void csync_update_worker_exit(int redo)
+{
+	int errors = csync_error_count;
+
+	if (errors > WORKER_EXIT_REDO - 1)
+		errors = WORKER_EXIT_REDO - 1;
+	exit(errors | (redo ? WORKER_EXIT_REDO : 0));
+}
+
+/*
+ * Wait for one of the forked update workers and account for the
+ * errors it reported by its exit code.
+ * Returns 1 if the worker asked for a redo.
+ */
+static int csync_update_reap_worker()
+{
+	int status;
+	pid_t pid;
+
+	do {
+		pid = wait(&status);
+	} while (pid < 0 && errno == EINTR);
+
+	if (pid < 0) {
+		csync_debug(0, "ERROR: Waiting for update worker: %s\n", strerror(errno));
+		csync_error_count++;
+		return 0;
+	}
+
+	if (WIFEXITED(status)) {
+		csync_error_count += WEXITSTATUS(status) & ~WORKER_EXIT_REDO;
+		return (WEXITSTATUS(status) & WORKER_EXIT_REDO) != 0;
+	}
+
+	csync_debug(0, "ERROR: Update worker %d terminated by signal %d.\n",
+			(int)pid, WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+	csync_error_count++;
+	return 0;
+}
+
+/*
+ * Do the updates of one worker of csync_update_tl_mod_parallel().
+ *
+ * Missing parent directories inside of our own subtrees are handled
+ * like in csync_update_host_c(). If a missing parent directory is
+ * outside of them, we leave it to the parent process to do a
+ * sequential redo, and return 1.
+ */
+static int csync_update_worker(struct textlist *tl_mod, struct update_context *c)
+{
+	struct textlist *tl, *t, *next_t;
+	enum connection_response r;
+	int saved_csync_error_count = csync_error_count;
+
+	r = csync_update_tl_mod(tl_mod, c);
+	while (r == CR_ERR_PARENT_DIR_MISSING) {
+		if (!in_subtrees(c, c->missing_parent_dir))
+			return 1;
+
+		csync_error_count = saved_csync_error_count;
+
+		/* csync_find_dirty() returns the files in reverse order */
+		tl = csync_find_dirty(c);
+		tl_mod = NULL;
+		for (t = tl; t != 0; t = next_t) {
+			struct stat st;
+			next_t = t->next;
+			t->next = NULL;
+			if (!lstat_strict(prefixsubst(t->value), &st) && !csync_check_pure(t->value)) {
+				t->next = tl_mod;
+				tl_mod = t;
+			} else
+				textlist_free(t);
+		}
+		r = csync_update_tl_mod(tl_mod, c);
+		textlist_free(tl_mod);
+	}
+	return 0;
+}
+
+struct update_unit {
+	const char *key;
+	int keylen;
+	int first;
+	int count;
+	int id;
+	int worker;
+};
+
+static int dir_end(char ch)
+{
+	return ch == '/' || ch == 0;
+}
+
+/* length of the deepest directory containing all the files in tl */
+static int common_dir_prefix_len(struct textlist *tl)
+{
+	struct textlist *t;
+	int len = strlen(tl->value);
+
+	for (t = tl->next; t != 0; t = t->next) {
+		int i = 0;
+		while (i < len && t->value[i] == tl->value[i])
+			i++;
+		len = i;
+		while (len > 0 && !(dir_end(tl->value[len]) && dir_end(t->value[len])))
+			len--;
+	}
+	return len;
+}
+
+static int unit_cmp_key(const void *a, const void *b)
+{
+	const struct update_unit *ua = a, *ub = b;
+	int len = ua->keylen < ub->keylen ? ua->keylen : ub->keylen;
+	int cmp = strncmp(ua->key, ub->key, len);
+
+	if (cmp)
+		return cmp;
+	if (ua->keylen != ub->keylen)
+		return ua->keylen - ub->keylen;
+	return ua->first - ub->first;
+}
+
+static int unit_cmp_count(const void *a, const void *b)
+{
+	const struct update_unit *ua = a, *ub = b;
+	return ub->count - ua->count;
+}
+
+/*
+ * Split the files in tl_mod over up to csync_parallel_connections
+ * connections to the peer.
+ *
+ * The files are grouped by the first path component below their deepest
+ * common directory, and these subtrees are distributed over the workers.
+ * So a directory is always created by the same worker as the files in it,
+ * in the original order. Files which are not inside such a subtree (the
+ * common directory itself and its parents) are updated first.
+ *
+ * The first worker is this process, using the existing connection,
+ * all others are forked and open their own connection.
+ *
+ * Returns CR_ERR_PARENT_DIR_MISSING if a sequential redo is needed.
+ */
+static enum connection_response csync_update_tl_mod_parallel(struct textlist *tl_mod,
+		struct update_context *c)
+{
+	struct textlist *t, *heads = NULL;
+	struct textlist **lists, **subtrees;
+	struct update_unit *units;
+	unsigned *load;
+	int *worker_of;
+	int count = 0, nunits = 0, nworkers, prefix_len, i, j, redo = 0;
+	int saved_db_blocking_mode = db_blocking_mode;
+	enum connection_response r;
+
+	for (t = tl_mod; t != 0; t = t->next)
+		count++;
+
+	nworkers = count / PARALLEL_CONNECTIONS_MIN_FILES;
+	if (nworkers > (int)csync_parallel_connections)
+		nworkers = csync_parallel_connections;
+	if (nworkers < 2)
+		return csync_update_tl_mod(tl_mod, c);
+
+	prefix_len = common_dir_prefix_len(tl_mod);
+	units = calloc(count, sizeof(*units));
+	worker_of = calloc(count, sizeof(*worker_of));
+
+	for (t = tl_mod, i = 0; t != 0; t = t->next, i++) {
+		const char *key = t->value + prefix_len;
+		if (!*key) {
+			worker_of[i] = -1;
+			continue;
+		}
+		key++;
+		units[nunits].key = key;
+		units[nunits].keylen = strcspn(key, "/");
+		units[nunits].first = i;
+		units[nunits].count = 1;
+		nunits++;
+	}
+
+	/* merge the entries of each subtree into one unit */
+	qsort(units, nunits, sizeof(*units), unit_cmp_key);
+	for (i = 0, j = -1; i < nunits; i++) {
+		if (j >= 0 && units[j].keylen == units[i].keylen &&
+		    !strncmp(units[j].key, units[i].key, units[i].keylen)) {
+			units[j].count++;
+			worker_of[units[i].first] = j;
+			continue;
+		}
+		units[++j] = units[i];
+		worker_of[units[i].first] = j;
+	}
+	nunits = j + 1;
+
+	if (nunits < nworkers)
+		nworkers = nunits;
+	if (nworkers < 2) {
+		free(units);
+		free(worker_of);
+		return csync_update_tl_mod(tl_mod, c);
+	}
+
+	/* biggest subtrees first, each to the least loaded worker */
+	for (i = 0; i < nunits; i++)
+		units[i].id = i;
+	{
+		struct update_unit *sorted = malloc(nunits * sizeof(*sorted));
+		memcpy(sorted, units, nunits * sizeof(*sorted));
+		qsort(sorted, nunits, sizeof(*sorted), unit_cmp_count);
+
+		load = calloc(nworkers, sizeof(*load));
+		subtrees = calloc(nworkers, sizeof(*subtrees));
+		for (i = 0; i < nunits; i++) {
+			int w = 0;
+			char *root;
+			for (j = 1; j < nworkers; j++)
+				if (load[j] < load[w])
+					w = j;
+			load[w] += sorted[i].count;
+			units[sorted[i].id].worker = w;
+
+			ASPRINTF(&root, "%.*s/%.*s", prefix_len, tl_mod->value,
+					sorted[i].keylen, sorted[i].key);
+			textlist_add(&subtrees[w], root, 0);
+			free(root);
+		}
+		free(sorted);
+	}
+
+	/* build the per worker lists, keeping the original order */
+	lists = calloc(nworkers, sizeof(*lists));
+	{
+		struct textlist **items = malloc(count * sizeof(*items));
+		for (t = tl_mod, i = 0; t != 0; t = t->next, i++)
+			items[i] = t;
+		for (i = count - 1; i >= 0; i--) {
+			struct textlist **l = worker_of[i] < 0 ? &heads :
+				&lists[units[worker_of[i]].worker];
+			textlist_add2(l, items[i]->value, items[i]->value2, items[i]->intvalue);
+		}
+		free(items);
+	}
+
+	r = CR_OK;
+	if (heads)
+		r = csync_update_tl_mod(heads, c);
+	if (r == CR_ERR_PARENT_DIR_MISSING) {
+		redo = 1;
+		goto out;
+	}
+
+	csync_debug(1, "Updating %d files on %s using %d connections.\n",
+			count, c->peername, nworkers);
+
+	fflush(stdout);
+	fflush(stderr);
+	csync_db_close();
+	db_blocking_mode = 0;
+
+	for (i = 1; i < nworkers; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			/* do it ourselves then */
+			csync_debug(1, "Can't fork update worker: %s\n", strerror(errno));
+			for (t = subtrees[i]; t != 0; t = t->next)
+				textlist_add(&subtrees[0], t->value, 0);
+			textlist_free(subtrees[i]);
+			subtrees[i] = NULL;
+			{
+				struct textlist **tail = &lists[0];
+				while (*tail)
+					tail = &(*tail)->next;
+				*tail = lists[i];
+				lists[i] = NULL;
+			}
+			continue;
+		}
+		if (!pid) {
+			struct update_context wc = *c;
+
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			csync_server_child_pid = getpid();
+			csync_error_count = 0;
+			conn_abandon();
+			csync_db_open(csync_database);
+
+			wc.current_name = NULL;
+			wc.missing_parent_dir = NULL;
+			wc.subtrees = subtrees[i];
+
+			if (connect_to_host(c->peername)) {
+				csync_error_count++;
+				csync_debug(0, "ERROR: Connection to remote host `%s' failed.\n", c->peername);
+				csync_debug(1, "Files stay in dirty state. "
+						"Try again later...\n");
+			} else {
+				redo = csync_update_worker(lists[i], &wc);
+				conn_printf("BYE\n");
+				read_conn_status(0, c->peername);
+				conn_close();
+			}
+			csync_db_close();
+			csync_update_worker_exit(redo);
+		}
+		csync_debug(2, "Update worker %d started for %s.\n", (int)pid, c->peername);
+	}
+
+	csync_db_open(csync_database);
+	c->subtrees = subtrees[0];
+	redo = csync_update_worker(lists[0], c);
+	c->subtrees = NULL;
+
+	/* workers we failed to fork have no subtrees left */
+	for (i = 1; i < nworkers; i++)
+		if (subtrees[i] && csync_update_reap_worker())
+			redo = 1;
+
+	csync_db_close();
+	db_blocking_mode = saved_db_blocking_mode;
+	csync_db_open(csync_database);
+
+out:
+	for (i = 0; i < nworkers; i++) {
+		textlist_free(lists[i]);
+		textlist_free(subtrees[i]);
+	}
+	textlist_free(heads);
+	free(lists);
+	free(subtrees);
+	free(load);
+	free(units);
+	free(worker_of);
+
+	return redo ? CR_ERR_PARENT_DIR_MISSING : CR_OK;
+}
+
 void csync_update_host_c(struct update_context *c)
 {
 	struct textlist *tl, *t, *next_t;
 	struct textlist *tl_mod, **last_tn;
 	enum connection_response r = CR_OK;
 	int saved_csync_error_count = csync_error_count;
+	int parallel = csync_parallel_connections > 1;
 
 	tl = csync_find_dirty(c);
 	tl_mod = NULL;
@@ -754,6 +1789,9 @@ void csync_update_host_c(struct update_context *c)
 		return;
 	}
 
+	csync_update_moves(c, &tl);
+	csync_update_manifest(c, &tl);
+
 redo:
 	/*
 	 * The SQL statement above creates a linked list. Due to the
@@ -788,12 +1826,17 @@ ident_failed_1:
 		}
 	}
 
-	r = csync_update_tl_mod(tl_mod, c);
+	if (parallel)
+		r = csync_update_tl_mod_parallel(tl_mod, c);
+	else
+		r = csync_update_tl_mod(tl_mod, c);
 
 	textlist_free(tl_mod);
 	textlist_free(tl);
 
 	if (r == CR_ERR_PARENT_DIR_MISSING) {
+		/* no second try at splitting things up */
+		parallel = 0;
 		csync_error_count = saved_csync_error_count;
 		tl = csync_find_dirty(c);
 		tl_mod = NULL;
@@ -818,14 +1861,82 @@ void csync_update_host(const char *peername,
 		.recursive = recursive,
 		.dry_run = dry_run,
 		.missing_parent_dir = NULL,
+		.subtrees = NULL,
 	};
 	csync_update_host_c(&c);
 }
 
 
+/*
+ * Update the selected peers (intvalue set), up to csync_parallel_peers
+ * of them at the same time.
+ *
+ * Every peer is handled by a forked worker process with its own
+ * connection and its own database handle. The database is closed
+ * in the parent while the workers run, and the workers do not
+ * keep transactions open, so they only hold the database lock for
+ * single statements. They only ever delete the dirty rows of their
+ * own peer. The number of errors seen by a worker is passed back
+ * in its exit code and summed up here.
+ */
+static void csync_update_parallel(struct textlist *peers,
+		const char **patlist, int patnum, int recursive, int dry_run)
+{
+	struct textlist *t;
+	unsigned running = 0;
+
+	fflush(stdout);
+	fflush(stderr);
+	csync_db_close();
+
+	for (t = peers; t != 0; t = t->next) {
+		pid_t pid;
+
+		if (!t->intvalue)
+			continue;
+
+		while (running >= csync_parallel_peers) {
+			csync_update_reap_worker();
+			running--;
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			csync_debug(0, "ERROR: Can't fork update worker for %s: %s\n",
+					t->value, strerror(errno));
+			csync_debug(1, "Host stays in dirty state. "
+					"Try again later...\n");
+			csync_error_count++;
+			continue;
+		}
+
+		if (!pid) {
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			csync_server_child_pid = getpid();
+			csync_error_count = 0;
+			db_blocking_mode = 0;
+			csync_db_open(csync_database);
+			csync_update_host(t->value, patlist, patnum, recursive, dry_run);
+			csync_db_close();
+			csync_update_worker_exit(0);
+		}
+
+		csync_debug(2, "Updating %s in worker %d.\n", t->value, (int)pid);
+		running++;
+	}
+
+	while (running) {
+		csync_update_reap_worker();
+		running--;
+	}
+
+	csync_db_open(csync_database);
+}
+
 void csync_update(const char ** patlist, int patnum, int recursive, int dry_run)
 {
 	struct textlist *tl = 0, *t;
+	int peer_count = 0;
 
 	SQL_BEGIN("Get hosts from dirty table",
 		"SELECT peername FROM dirty GROUP BY peername")
@@ -847,9 +1958,20 @@ void csync_update(const char ** patlist, int patnum, int recursive, int dry_run)
 			continue;
 		}
 found_asactive:
-		csync_update_host(t->value, patlist, patnum, recursive, dry_run);
+		t->intvalue = 1;
+		peer_count++;
 	}
 
+	if (csync_parallel_peers > 1 && peer_count > 1)
+		csync_update_parallel(tl, patlist, patnum, recursive, dry_run);
+	else
+		for (t = tl; t != 0; t = t->next)
+			if (t->intvalue)
+				csync_update_host(t->value, patlist, patnum, recursive, dry_run);
+
+	SQL("Forget moves which have been synced",
+		"DELETE FROM move WHERE oldname NOT IN (SELECT filename FROM dirty)");
+
 	textlist_free(tl);
 }
 